@@ -24,10 +24,6 @@
 #include "version.h"
 #include <limits.h>
 
-/* ne's temporary file name template for the THROUGH command. */
-
-#define NE_TMP ".ne-tmp.XXXXXX"
-
 /* Turns an unspecified integer argument (-1) to 1. This
 is what most commands require. */
 
@@ -204,11 +200,7 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 			print_error(CANT_SAVE_EXIT_SUSPENDED);
 			return ERROR;
 		}
-		else {
-			close_history();
-			unset_interactive_mode();
-			exit(0);
-		}
+		else leave_ne();
 		return OK;
 
 	case SAVEALL_A:
@@ -231,9 +223,8 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 
 	case QUIT_A:
 		if (modified_buffers() && !request_response(b, info_msg[SOME_DOCUMENTS_ARE_NOT_SAVED], false)) return ERROR;
-		close_history();
-		unset_interactive_mode();
-		exit(0);
+		leave_ne();
+		return OK;
 
 	case LINEUP_A:
 		NORMALIZE(c);
@@ -908,6 +899,7 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 			if (!print_error(error)) {
 				const bool load_syntax = b->filename == NULL || ! same_str(extension(p), extension(b->filename));
 				change_filename(b, p);
+				watch_buffer(b);
 				if (load_syntax) {
 					b->syn = NULL; /* So that autoprefs will load the right syntax. */
 					load_auto_prefs(b, NULL); /* Will get extension from the name, or virtual extension. */
@@ -921,14 +913,15 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 				return ERROR;
 			}
 		}
-		b->undo.last_save_step = b->undo.cur_step;
 		return OK;
 
 	case KEYCODE_A:
 		if (c >= NUM_KEYS) c = -1;
 		if (c < 0) {
+			if (batch_mode) return ERROR;
 			print_message(info_msg[PRESS_A_KEY]);
-			do c = get_key_code(); while(c == INVALID_CHAR || c > 0xFF || CHAR_CLASS(c) == IGNORE);
+			do c = get_key_code(); while(c == INVALID_CHAR && !detaching || c > 0xFF || CHAR_CLASS(c) == IGNORE);
+			if (c == INVALID_CHAR) return ERROR; /* The terminal went away. */
 		}
 		col = (c < 0) ? -c-1 : c;
 		snprintf(msg, MAX_MESSAGE_SIZE, "Key Code: 0x%02x,  Input Class: %s,  Assigned Command: %s", (int)col, input_class_names[CHAR_CLASS(c)],
@@ -968,6 +961,7 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 					&& error != OUT_OF_MEMORY
 					&& error != OUT_OF_MEMORY_DISK_FULL) {
 					change_filename(b, p);
+					watch_buffer(b);
 					b->syn = NULL; /* So that autoprefs will load the right syntax. */
 					if (b->opt.auto_prefs) {
 						if (b->allocated_chars - b->free_chars <= MAX_SYNTAX_SIZE) {
@@ -995,6 +989,7 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 		return OK;
 
 	case REFRESH_A:
+		if (batch_mode) return OK;
 		clear_entire_screen();
 		ttysize();
 		keep_cursor_on_screen(cur_buffer);
@@ -1214,11 +1209,11 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 		return OK;
 
 	case BEEP_A:
-		ring_bell();
+		if (!batch_mode) ring_bell();
 		return OK;
 
 	case FLASH_A:
-		do_flash();
+		if (!batch_mode) do_flash();
 		return OK;
 
 	case ESCAPETIME_A:
@@ -1246,6 +1241,15 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 		turbo = c;
 		return OK;
 
+	case UNDOJOURNAL_A:
+		SET_GLOBAL_FLAG(c, undo_journal);
+		return OK;
+
+	case UNDOMEMORY_A:
+		if ((int)c < 0 && (int)(c = request_number(b, "Undo Memory (KB, 0 for no limit)", undo_memory)) < 0) return NUMERIC_ERROR(c);
+		undo_memory = c;
+		return OK;
+
 	case CLIPNUMBER_A:
 		if ((int)c < 0 && (int)(c = request_number(b, "Clip Number", b->opt.cur_clip)) < 0) return NUMERIC_ERROR(c);
 		b->opt.cur_clip = c;
@@ -1303,6 +1307,17 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 		SET_GLOBAL_FLAG(c, verbose_macros);
 		return OK;
 
+	case SYNCSAVE_A:
+		SET_GLOBAL_FLAG(c, sync_save);
+		return OK;
+
+	case AUTORELOAD_A:
+		SET_GLOBAL_FLAG(c, auto_reload);
+		return OK;
+
+	case FOLLOW_A:
+		return set_following(b, c < 0 ? !b->following : c != 0);
+
 	case AUTOPREFS_A:
 		SET_USER_FLAG(b, c, opt.auto_prefs);
 		return OK;
@@ -1413,10 +1428,15 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 
 	case PLAY_A:
 		if (!b->recording && !b->executing_internal_macro) {
+			if (!b->cur_macro || !b->cur_macro->len) return print_error(NO_MACRO_RECORDED) ? ERROR : 0;
 			if (c < 0 && (c = request_number(b, "Times", 1))<=0) return NUMERIC_ERROR(c);
+			/* The macro is compiled once for all repetitions. */
+			compiled_macro * const cm = compile_macro(b->cur_macro);
+			if (!cm) return print_error(OUT_OF_MEMORY) ? ERROR : 0;
 			b->executing_internal_macro = 1;
-			for(int64_t i = 0; i < c && !(error = play_macro(b, b->cur_macro)); i++);
+			for(int64_t i = 0; i < c && !(error = run_compiled_macro(b, cm)); i++);
 			b->executing_internal_macro = 0;
+			release_compiled_macro(cm);
 			return print_error(error) ? ERROR : 0;
 		}
 		else return ERROR;
@@ -1460,11 +1480,7 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 
 	case CLOSEDOC_A:
 		if ((b->is_modified) && !request_response(b, info_msg[THIS_DOCUMENT_NOT_SAVED], false)) return ERROR;
-		if (!delete_buffer()) {
-			close_history();
-			unset_interactive_mode();
-			exit(0);
-		}
+		if (!delete_buffer()) leave_ne();
 		keep_cursor_on_screen(cur_buffer);
 		reset_window();
 
@@ -1608,56 +1624,42 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 		if (!b->marking) b->mark_is_vertical = 0;
 
 		if (p || (p = request_string(b, "Filter", NULL, false, COMPLETE_FILE, b->encoding == ENC_UTF8 || b->encoding == ENC_ASCII && b->opt.utf8auto))) {
-			int fin = -1, fout = -1;
-
-			char tmpnam1[strlen(P_tmpdir)+strlen(NE_TMP)+2], tmpnam2[strlen(P_tmpdir)+strlen(NE_TMP)+2], *command;
+			clip_desc *cd = get_nth_clip(INT_MAX);
 
-			strcat(strcat(strcpy(tmpnam1, P_tmpdir), "/"), NE_TMP);
-			strcat(strcat(strcpy(tmpnam2, P_tmpdir), "/"), NE_TMP);
-			if ((fin = mkstemp(tmpnam1)) != -1) close(fin);
-			if ((fout = mkstemp(tmpnam2)) != -1) close(fout);
-			if (fin != -1 && fout != -1) {
+			if (!cd && (cd = alloc_clip_desc(INT_MAX, 0))) add_head(&clips, &cd->cd_node);
 
-				realloc_clip_desc(get_nth_clip(INT_MAX), INT_MAX, 0);
+			if (!cd) error = OUT_OF_MEMORY;
+			else {
+				realloc_clip_desc(cd, INT_MAX, 0);
 
 				if (!b->marking || !(error = (b->mark_is_vertical ? copy_vert_to_clip : copy_to_clip)(b, INT_MAX, false))) {
 
-					if (!(error = save_clip(INT_MAX, tmpnam1, b->is_CRLF, b->opt.binary))) {
-						if (command = malloc(strlen(p) + strlen(tmpnam1) + strlen(tmpnam2) + 16)) {
-
-							strcat(strcat(strcat(strcat(strcat(strcpy(command, "( "), p), " ) <"), tmpnam1), " >"), tmpnam2);
+					/* The block is piped through the command, and the output
+						replaces it in the clip. */
 
-							unset_interactive_mode();
-							if (system(command)) error = EXTERNAL_COMMAND_ERROR;
-							set_interactive_mode();
+					cd = get_nth_clip(INT_MAX);
+					char_stream * const cs = alloc_char_stream(0);
 
-							if (!error) {
+					if (!cs) error = OUT_OF_MEMORY;
+					else if (!(error = materialize_clip(cd)) && !(error = filter_stream(cd->cs, cs, p, b->is_CRLF, b->opt.binary, b->opt.preserve_cr))) {
+						free_char_stream(cd->cs);
+						cd->cs = cs;
+						set_stream_encoding(cd->cs, ENC_ASCII);
 
-								if (!(error = load_clip(INT_MAX, tmpnam2, b->opt.preserve_cr, b->opt.binary))) {
-
-									start_undo_chain(b);
+						start_undo_chain(b);
 
-									if (b->marking) (b->mark_is_vertical ? erase_vert_block : erase_block)(b, true);
-									error = (b->mark_is_vertical ? paste_vert_to_buffer : paste_to_buffer)(b, INT_MAX);
-									end_undo_chain(b);
+						if (b->marking) (b->mark_is_vertical ? erase_vert_block : erase_block)(b, true);
+						error = (b->mark_is_vertical ? paste_vert_to_buffer : paste_to_buffer)(b, INT_MAX);
+						end_undo_chain(b);
 
-									b->marking = 0;
+						b->marking = 0;
 
-									realloc_clip_desc(get_nth_clip(INT_MAX), INT_MAX, 0);
-								}
-							}
-							free(command);
-						}
-						else error = OUT_OF_MEMORY;
+						realloc_clip_desc(cd, INT_MAX, 0);
 					}
+					else free_char_stream(cs);
 				}
 			}
-			else error = CANT_OPEN_TEMPORARY_FILE;
-
-			remove(tmpnam1);
-			remove(tmpnam2);
 
-			ttysize();
 			keep_cursor_on_screen(cur_buffer);
 			reset_window();
 			free(p);
@@ -1725,6 +1727,13 @@ int do_action(buffer *b, action a, int64_t c, char *p) {
 		if (p) free(p);
 		return print_error(error) ? ERROR : 0;
 
+	case SORTLINES_A:
+	case UNIQLINES_A:
+		if (b->opt.read_only) return DOCUMENT_IS_READ_ONLY;
+		error = sort_lines(b, a == UNIQLINES_A);
+		if (stop) error = STOPPED;
+		return print_error(error) ? ERROR : 0;
+
 	case LOADPREFS_A:
 		if (p || (p = request_file(b, "Prefs Name", NULL))) {
 			error = print_error(load_prefs(b, p));
@@ -20,74 +20,462 @@
 
 #include "ne.h"
 #include "support.h"
+#include <pthread.h>
+#include <signal.h>
 
 #define EXTERNAL_FLAG_CHAR '*'
 
-#define MAX_AUTOCOMPLETE_SCAN (1000000)
+/* Every buffer involved in an autocompletion gets a word index, that is, a
+   ternary search tree containing all the words of the buffer with their
+   number of occurrences. The index is built the first time it is needed, and
+   from then on insert_stream() and delete_stream() keep it up to date: the
+   first time a line is modified its words are removed from the index, and
+   the line is added to a set of dirty lines, which are indexed again just
+   before the next completion. In this way, repeated changes to the same line
+   (e.g., by a ReplaceAll) cost a single lookup in the set. If most lines
+   become dirty, we simply discard the index.
+
+   Completing a prefix requires just a walk down the tree, followed by a visit
+   of the subtree of the words extending the prefix. Nodes are never freed:
+   words whose count drops to zero are simply not reported, and when dead
+   nodes become too many the index is rebuilt. */
+
+typedef struct {
+	uint32_t lo, eq, hi;  /* Children (0 means no child). */
+	uint32_t count;       /* Occurrences of the word ending at this node. */
+	unsigned char c;
+} word_node;
+
+struct word_index {
+	word_node *node;      /* The nodes; node[0] is unused, and the root is node[1]. */
+	uint32_t nodes;       /* The number of nodes in use, including node[0]. */
+	uint32_t size;        /* The number of allocated nodes. */
+	int64_t chars;        /* The overall length of the distinct words with positive count. */
+	int64_t max_len;      /* The maximum length of a word ever added. */
+	const line_desc **dirty; /* An open-addressing hash set of dirty lines. */
+	int64_t dirty_size;   /* The size of dirty (a power of two, or zero). */
+	int64_t dirty_count;  /* The number of dirty lines. */
+	encoding_type encoding;
+};
+
+#define MIN_DEAD_NODES (64 * 1024)
 
 static req_list rl;
 
-/* Keeps track of how many strings we have scanned. At MAX_AUTOCOMPLETE_SCAN we return. */
-static int count_scanned;
+void free_word_index(buffer * const b) {
+	if (b->word_index) {
+		free(b->word_index->node);
+		free(b->word_index->dirty);
+		free(b->word_index);
+		b->word_index = NULL;
+	}
+}
+
+/* Adds delta (which must be 1 or -1) to the count of the given word. Returns
+   false on failure, in which case the index is no longer usable. */
 
-static void add_string(const char * const s, const int len, const int ext) {
-	static char *buf = NULL;
-	static uint64_t buflen = 0;
-	char *buf_new;
-	int cplen = len;
+static bool add_word(struct word_index * const wi, const char * const s, const int64_t len, const int delta) {
+	if (delta < 0 && !wi->nodes) return true; /* Cannot happen in a consistent index. */
+	if (delta > 0 && wi->nodes + len > wi->size) {
+		const int64_t size = max(wi->size * 2LL, wi->nodes + len + 1024);
+		if (size > UINT32_MAX) return false;
+		word_node * const node = realloc(wi->node, size * sizeof *node);
+		if (!node) return false;
+		wi->node = node;
+		wi->size = size;
+		if (wi->nodes == 0) {
+			wi->node[0] = (word_node){ 0 };
+			wi->nodes = 1;
+		}
+	}
+
+	uint32_t *link = &wi->node[0].eq, n = 0;
+	for(int64_t i = 0; i < len; i++) {
+		const unsigned char c = s[i];
+		for(;;) {
+			if (!(n = *link)) {
+				if (delta < 0) return true; /* Cannot happen in a consistent index. */
+				n = *link = wi->nodes++;
+				wi->node[n] = (word_node){ 0, 0, 0, 0, c };
+			}
+			if (c < wi->node[n].c) link = &wi->node[n].lo;
+			else if (c > wi->node[n].c) link = &wi->node[n].hi;
+			else break;
+		}
+		link = &wi->node[n].eq;
+	}
+
+	if (delta > 0) {
+		if (wi->node[n].count++ == 0) wi->chars += len;
+		if (len > wi->max_len) wi->max_len = len;
+	}
+	else if (wi->node[n].count > 0 && --wi->node[n].count == 0) wi->chars -= len;
+
+	return true;
+}
 
-	if (len < 1) {
-		if (buf) free(buf);
-		buf = NULL;
-		buflen = 0;
+/* Adds delta to the counts of all words in a line, as split by ne_isword().
+   We accept "'" as a word character if it is followed by another word
+   character, so that words like "don't" are not broken into "don" and "t". */
+
+static bool index_line(struct word_index * const wi, const line_desc * const ld, const int delta) {
+	const encoding_type encoding = wi->encoding;
+	int64_t l = 0;
+	while(l < ld->line_len) {
+		while (l < ld->line_len && !ne_isword(get_char(&ld->line[l], encoding), encoding)) l += get_char_width(&ld->line[l], encoding);
+		if (l == ld->line_len) break;
+		int64_t r = l + get_char_width(&ld->line[l], encoding);
+		int ch;
+		while (r < ld->line_len
+		       && (    ne_isword(ch = get_char(&ld->line[r], encoding), encoding)
+		            || ( r + 1 < ld->line_len && ch == '\'' && ne_isword(get_char(&ld->line[r + 1], encoding), encoding))
+		          )
+		      ) r += get_char_width(&ld->line[r], encoding);
+		if (!add_word(wi, &ld->line[l], r - l, delta)) return false;
+		l = r;
+	}
+	return true;
+}
+
+static int64_t dirty_slot(const struct word_index * const wi, const line_desc * const ld) {
+	int64_t i = ((uintptr_t)ld >> 4) * 0x9E3779B97F4A7C15ULL & wi->dirty_size - 1;
+	while(wi->dirty[i] && wi->dirty[i] != ld) i = i + 1 & wi->dirty_size - 1;
+	return i;
+}
+
+/* Adds a line to the set of dirty lines, removing its words from the index
+   if remove is true. */
+
+static void add_dirty_line(buffer * const b, const line_desc * const ld, const bool remove) {
+	struct word_index * const wi = b->word_index;
+
+	if (wi->dirty_size && wi->dirty[dirty_slot(wi, ld)]) return;
+
+	if (wi->dirty_count > b->num_lines / 2 + 1024) {
+		free_word_index(b);
 		return;
 	}
-	if (len >= buflen) {
-		if (buf_new = realloc(buf, len * 2 + 1)) {
-			buflen = len * 2 + 1;
-			buf = buf_new;
+
+	if ((wi->dirty_count + 1) * 2 > wi->dirty_size) {
+		const line_desc ** const old = wi->dirty;
+		const int64_t old_size = wi->dirty_size;
+		wi->dirty_size = max(old_size * 2, 1024);
+		if (!(wi->dirty = calloc(wi->dirty_size, sizeof *wi->dirty))) {
+			wi->dirty = old;
+			free_word_index(b);
+			return;
 		}
-		else cplen = buflen - 1;
+		for(int64_t i = 0; i < old_size; i++) if (old[i]) wi->dirty[dirty_slot(wi, old[i])] = old[i];
+		free(old);
+	}
+
+	if (remove && !index_line(wi, ld, -1)) {
+		free_word_index(b);
+		return;
 	}
-	strncpy(buf, s, cplen);
-	buf[cplen] = '\0';
-	req_list_add(&rl, buf, ext);
+
+	wi->dirty[dirty_slot(wi, ld)] = ld;
+	wi->dirty_count++;
 }
 
-static void search_buff(const buffer *b, char * p, const int encoding, const bool case_search, const int ext) {
-	assert(p);
-	const int p_len = strlen(p);
-
-	for(line_desc *ld = (line_desc *)b->line_desc_list.head, *next; next = (line_desc *)ld->ld_node.next; ld = next) {
-		int64_t l = 0, r = 0;
-		do {
-			/* find left edge of word */
-			while (l < ld->line_len - p_len && !ne_isword(get_char(&ld->line[l], b->encoding), b->encoding)) l += get_char_width(&ld->line[l], b->encoding);
-			if (l < ld->line_len - p_len ) {
-				int ch;
-				/* find right edge of word */
-				r = l + get_char_width(&ld->line[l], b->encoding);
-				/* accept "'" as a word character if it is followed by another word character, so that
-				   words like "don't" are not broken into "don" and "t". */
-				while (r < ld->line_len
-				       && (    ne_isword(ch=get_char(&ld->line[r], b->encoding), b->encoding)
-				            || ( r+1 < ld->line_len && ch == '\'' && ne_isword(get_char(&ld->line[r+1], b->encoding), b->encoding))
-				          )
-				      ) r += get_char_width(&ld->line[r], b->encoding);
-				if (r - l > p_len && !(case_search ? strncmp : strncasecmp)(p, &ld->line[l], p_len)) {
-					if (b->encoding == encoding || is_ascii(&ld->line[l], r - l)) add_string(&ld->line[l], r - l, ext);
+/* The following functions must be called before modifying the contents of
+   a line, after creating a new line (with its contents), and before freeing a
+   line, respectively. */
+
+void word_index_modify(buffer * const b, const line_desc * const ld) {
+	if (b->word_index) add_dirty_line(b, ld, true);
+}
+
+void word_index_add(buffer * const b, const line_desc * const ld) {
+	if (b->word_index) add_dirty_line(b, ld, false);
+}
+
+void word_index_remove(buffer * const b, const line_desc * const ld) {
+	struct word_index * const wi = b->word_index;
+	if (!wi) return;
+
+	int64_t i = wi->dirty_size ? dirty_slot(wi, ld) : 0;
+	if (!wi->dirty_size || !wi->dirty[i]) {
+		if (!index_line(wi, ld, -1)) free_word_index(b);
+		return;
+	}
+
+	/* Deletion with backward shift. */
+	wi->dirty[i] = NULL;
+	wi->dirty_count--;
+	for(int64_t j = i + 1 & wi->dirty_size - 1; wi->dirty[j]; j = j + 1 & wi->dirty_size - 1) {
+		const int64_t k = ((uintptr_t)wi->dirty[j] >> 4) * 0x9E3779B97F4A7C15ULL & wi->dirty_size - 1;
+		if ((j - k & wi->dirty_size - 1) >= (j - i & wi->dirty_size - 1)) {
+			wi->dirty[i] = wi->dirty[j];
+			wi->dirty[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+/* Returns the word index of a buffer, building it if necessary, or NULL if
+   building it failed or was interrupted. */
+
+static struct word_index *get_word_index(buffer * const b) {
+	struct word_index *wi = b->word_index;
+	if (wi && (wi->encoding != b->encoding || wi->nodes > 2 * wi->chars + MIN_DEAD_NODES)) free_word_index(b);
+
+	if (!b->word_index) {
+		if (!(wi = b->word_index = calloc(1, sizeof *wi))) return NULL;
+		wi->encoding = b->encoding;
+		for(line_desc *ld = (line_desc *)b->line_desc_list.head; ld->ld_node.next; ld = (line_desc *)ld->ld_node.next) {
+			if (stop || !index_line(wi, ld, 1)) {
+				free_word_index(b);
+				return NULL;
+			}
+		}
+	}
+	else if (wi->dirty_count) {
+		for(int64_t i = 0; i < wi->dirty_size; i++) {
+			if (wi->dirty[i] && !index_line(wi, wi->dirty[i], 1)) {
+				free_word_index(b);
+				return NULL;
+			}
+		}
+		memset(wi->dirty, 0, wi->dirty_size * sizeof *wi->dirty);
+		wi->dirty_count = 0;
+	}
+
+	return b->word_index;
+}
+
+/* Completions are gathered from all buffers in parallel: a few worker
+   threads take buffers from a shared counter, bring their word indices up to
+   date, and collect in a completion_set the matching words, sorted by the
+   comparison function of rl. The sets are then merged, removing duplicates,
+   into rl, which is thus built with req_list_append(). Workers touch only
+   the buffer they are working on, and the main thread waits for all of them
+   before doing anything else, so no further locking is necessary. */
+
+typedef struct {
+	const char *word;
+	int64_t offset;    /* The offset of the word in chars, before sorting. */
+	uint32_t count;
+} completion;
+
+typedef struct {
+	buffer *b;
+	int ext;
+	completion *completion;
+	int64_t n, size;
+	char *chars;       /* The words, with their terminating NULs. */
+	int64_t chars_len, chars_size;
+	char *word;        /* A buffer for the word being visited. */
+} completion_set;
+
+typedef struct {
+	completion_set *set;
+	int n;
+	int next;          /* The next set to be processed. */
+	pthread_mutex_t mutex;
+	const char *p;
+	int encoding;
+	bool case_search;
+} completion_job;
+
+static int (*cmpfnc)(const char *, const char *);
+
+static int completioncmp(const void *a, const void *b) {
+	return cmpfnc(((const completion *)a)->word, ((const completion *)b)->word);
+}
+
+static bool add_completion(completion_set * const cs, const int64_t len, const uint32_t count) {
+	if (cs->n == cs->size) {
+		completion * const c = realloc(cs->completion, (cs->size = cs->size * 2 + 64) * sizeof *c);
+		if (!c) return false;
+		cs->completion = c;
+	}
+	if (cs->chars_len + len + 1 > cs->chars_size) {
+		char * const c = realloc(cs->chars, cs->chars_size = (cs->chars_size + len + 1) * 2);
+		if (!c) return false;
+		cs->chars = c;
+	}
+	memcpy(cs->chars + cs->chars_len, cs->word, len + 1);
+	cs->completion[cs->n].offset = cs->chars_len;
+	cs->completion[cs->n++].count = count;
+	cs->chars_len += len + 1;
+	return true;
+}
+
+/* Adds to cs all words in the subtree rooted at n, whose nodes are at the
+   given depth (cs->word contains the characters along the path to n). */
+
+static bool add_subtree(completion_set * const cs, const struct word_index * const wi, uint32_t n, const int64_t depth, const int encoding) {
+	struct { uint32_t n; int64_t depth; } *stack = NULL;
+	int64_t size = 0, top = 0;
+
+	for(int64_t d = depth;;) {
+		const word_node * const node = &wi->node[n];
+		cs->word[d] = node->c;
+		if (node->count) {
+			cs->word[d + 1] = 0;
+			if ((wi->encoding == encoding || is_ascii(cs->word, d + 1)) && !add_completion(cs, d + 1, node->count)) break;
+		}
+
+		if (top + 2 > size) {
+			void * const p = realloc(stack, (size = size * 2 + 64) * sizeof *stack);
+			if (!p) break;
+			stack = p;
+		}
+		if (node->hi) stack[top].n = node->hi, stack[top++].depth = d;
+		if (node->lo) stack[top].n = node->lo, stack[top++].depth = d;
+
+		if (node->eq) n = node->eq, d++;
+		else if (top) n = stack[--top].n, d = stack[top].depth;
+		else {
+			free(stack);
+			return !stop;
+		}
+	}
+
+	free(stack);
+	return false;
+}
+
+/* Collects in cs all words of cs->b strictly longer than the prefix p,
+   matching case only if case_search is true, and sorts them. Words not in the
+   given encoding are collected only if they are US-ASCII. */
+
+static void search_buff(completion_set * const cs, const char * const p, const int encoding, const bool case_search) {
+	const struct word_index * const wi = get_word_index(cs->b);
+	if (!wi || wi->nodes <= 1) return;
+
+	const int64_t p_len = strlen(p);
+	if (!(cs->word = malloc(max(wi->max_len, p_len) + 1))) return;
+
+	if (p_len == 0) add_subtree(cs, wi, wi->node[0].eq, 0, encoding);
+	else {
+		/* We walk down the tree along all paths matching p; each element of the
+		   stack is a node matching p[depth - 1], or the root. */
+		struct { uint32_t n; int64_t depth; } *stack = malloc((p_len + 1) * 2 * sizeof *stack);
+		if (!stack) return;
+		int64_t top = 0;
+		bool result = true;
+
+		stack[top].n = 0;
+		stack[top++].depth = 0;
+
+		while(top && result) {
+			const uint32_t m = stack[--top].n;
+			const int64_t depth = stack[top].depth;
+			if (depth) cs->word[depth - 1] = wi->node[m].c;
+			if (depth == p_len) {
+				if (wi->node[m].eq) result = add_subtree(cs, wi, wi->node[m].eq, depth, encoding);
+				continue;
+			}
+
+			const unsigned char c[2] = { p[depth], case_search ? p[depth] : isupper((unsigned char)p[depth]) ? tolower((unsigned char)p[depth]) : toupper((unsigned char)p[depth]) };
+			for(int i = 0; i < (c[0] == c[1] ? 1 : 2); i++) {
+				for(uint32_t n = wi->node[m].eq; n; ) {
+					if (c[i] < wi->node[n].c) n = wi->node[n].lo;
+					else if (c[i] > wi->node[n].c) n = wi->node[n].hi;
+					else {
+						stack[top].n = n;
+						stack[top++].depth = depth + 1;
+						break;
+					}
 				}
-				l = r;
-				count_scanned++;
 			}
-			assert(l <= ld->line_len);
-			if (stop || count_scanned >= MAX_AUTOCOMPLETE_SCAN) {
-				add_string(NULL, -1, 0);
-				return;
+		}
+
+		free(stack);
+	}
+
+	for(int64_t i = 0; i < cs->n; i++) cs->completion[i].word = cs->chars + cs->completion[i].offset;
+	qsort(cs->completion, cs->n, sizeof *cs->completion, completioncmp);
+}
+
+static void *completion_worker(void * const arg) {
+	completion_job * const job = arg;
+	for(;;) {
+		pthread_mutex_lock(&job->mutex);
+		const int i = job->next++;
+		pthread_mutex_unlock(&job->mutex);
+		if (i >= job->n) return NULL;
+		search_buff(&job->set[i], job->p, job->encoding, job->case_search);
+	}
+}
+
+/* Runs job using the current thread and, if there is more than one set to
+   process, some additional worker threads, which do not receive signals. */
+
+#define MAX_COMPLETION_THREADS 8
+
+static void run_completion_job(completion_job * const job) {
+	pthread_t thread[MAX_COMPLETION_THREADS];
+	int threads = 0;
+
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (job->n > 1 && cpus > 1) {
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		while(threads < min(min(job->n, cpus), MAX_COMPLETION_THREADS) - 1 && !pthread_create(&thread[threads], NULL, completion_worker, job)) threads++;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	completion_worker(job);
+	for(int i = 0; i < threads; i++) pthread_join(thread[i], NULL);
+}
+
+/* A binary heap of set indices, ordered by the current word of each set, and
+   then by index, so that among equal words the one from the set with the
+   smallest index (i.e., the current buffer, if any) comes first. */
+
+static bool heap_less(const completion_set * const set, const int64_t * const pos, const int i, const int j) {
+	const int c = cmpfnc(set[i].completion[pos[i]].word, set[j].completion[pos[j]].word);
+	return c < 0 || c == 0 && i < j;
+}
+
+static void heap_down(const completion_set * const set, const int64_t * const pos, int * const heap, const int n, int i) {
+	for(int c; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && heap_less(set, pos, heap[c + 1], heap[c])) c++;
+		if (!heap_less(set, pos, heap[c], heap[i])) break;
+		const int t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+	}
+}
+
+/* Merges the sorted completion sets into rl, keeping just the first of
+   equal words, and returns the most frequent word (to be freed), or NULL. */
+
+static char *merge_completion_sets(const completion_set * const set, const int n) {
+	int64_t * const pos = calloc(n, sizeof *pos);
+	int * const heap = malloc(n * sizeof *heap);
+	const char *last = NULL, *best_word = NULL;
+	uint32_t best_count = 0;
+	int h = 0;
+
+	if (pos && heap) {
+		for(int i = 0; i < n; i++) if (set[i].n) heap[h++] = i;
+		for(int i = h / 2; i-- != 0;) heap_down(set, pos, heap, h, i);
+
+		while(h) {
+			const int i = heap[0];
+			const completion * const c = &set[i].completion[pos[i]];
+			if (!last || cmpfnc(c->word, last)) {
+				if (req_list_append(&rl, c->word, set[i].ext) != OK) break;
+				last = c->word;
+			}
+			if (c->count > best_count) {
+				best_count = c->count;
+				best_word = c->word;
 			}
-		} while (l < ld->line_len - p_len);
+			if (++pos[i] == set[i].n) heap[0] = heap[--h];
+			heap_down(set, pos, heap, h, 0);
+		}
 	}
-	add_string(NULL, -1, 0);
+
+	req_list_sort(&rl);
+	free(pos);
+	free(heap);
+	return best_word ? str_dup(best_word) : NULL;
 }
 
 /* Returns a completion for the (non-NULL) prefix p, showing suffixes from
@@ -104,30 +492,47 @@ char *autocomplete(char *p, char *req_msg, const int ext, int * const error) {
 
 	assert(p);
 
-	req_list_init(&rl, (cur_buffer->opt.case_search ? strcmp : strdictcmp), false, false, EXTERNAL_FLAG_CHAR);
-	count_scanned = 0;
+	cmpfnc = cur_buffer->opt.case_search ? strcmp : strdictcmp;
+	req_list_init(&rl, cmpfnc, false, false, EXTERNAL_FLAG_CHAR);
 
-	search_buff(cur_buffer, p, cur_buffer->encoding, cur_buffer->opt.case_search, false);
-	if (stop) {
-		req_list_free(&rl);
+	/* The current buffer comes first, so its words take precedence. */
+	completion_job job = { .p = p, .encoding = cur_buffer->encoding, .case_search = cur_buffer->opt.case_search };
+	for(buffer *b = (buffer *)buffers.head; b->b_node.next; b = (buffer *)b->b_node.next) job.n++;
+	if (!(job.set = calloc(ext ? job.n : 1, sizeof *job.set))) {
 		free(p);
+		*error = AUTOCOMPLETE_NO_MATCH;
 		return NULL;
 	}
 
+	job.n = 0;
+	job.set[job.n++].b = cur_buffer;
 	if (ext) {
-		buffer *b = (buffer *)buffers.head;
-		while (b->b_node.next) {
+		for(buffer *b = (buffer *)buffers.head; b->b_node.next; b = (buffer *)b->b_node.next)
 			if (b != cur_buffer) {
-				search_buff(b, p, cur_buffer->encoding, cur_buffer->opt.case_search, true);
-				if (stop) {
-					req_list_free(&rl);
-					free(p);
-					return NULL;
-				}
+				job.set[job.n].b = b;
+				job.set[job.n++].ext = true;
 			}
-			b = (buffer *)b->b_node.next;
-		}
- 	}
+	}
+
+	pthread_mutex_init(&job.mutex, NULL);
+	run_completion_job(&job);
+	pthread_mutex_destroy(&job.mutex);
+
+	char * const best_word = stop ? NULL : merge_completion_sets(job.set, job.n);
+
+	for(int i = 0; i < job.n; i++) {
+		free(job.set[i].completion);
+		free(job.set[i].chars);
+		free(job.set[i].word);
+	}
+	free(job.set);
+
+	if (stop) {
+		req_list_free(&rl);
+		free(best_word);
+		free(p);
+		return NULL;
+	}
 
 	for(int i = 0; i < rl.cur_entries; i++) {
 		const int l = strlen(rl.entries[i]);
@@ -149,6 +554,7 @@ char *autocomplete(char *p, char *req_msg, const int ext, int * const error) {
 	}
 	*error = AUTOCOMPLETE_COMPLETED;
 	req_list_free(&rl);
+	free(best_word);
 	return p;
 #endif
 
@@ -173,8 +579,14 @@ char *autocomplete(char *p, char *req_msg, const int ext, int * const error) {
 			*error = min_len == m ? AUTOCOMPLETE_COMPLETED : AUTOCOMPLETE_PARTIAL;
 		}
 		else {
+			/* We start from the most frequent completion. */
+			int best = 0;
+			if (best_word) {
+				const int best_len = strlen(best_word);
+				while(best < rl.cur_entries - 1 && (strncmp(rl.entries[best], best_word, best_len) || rl.entries[best][best_len] && rl.entries[best][best_len] != EXTERNAL_FLAG_CHAR)) best++;
+			}
 			if (req_msg) print_message(req_msg);
-			int result = request_strings(&rl, 0);
+			int result = request_strings(&rl, best);
 			if (result != ERROR) {
 				result = result >= 0 ? result : -result - 2;
 				/* Delete EXTERNAL_FLAG_CHAR at the end of the strings if necessary. */
@@ -189,6 +601,7 @@ char *autocomplete(char *p, char *req_msg, const int ext, int * const error) {
 	else *error = AUTOCOMPLETE_NO_MATCH;
 
 	req_list_free(&rl);
+	free(best_word);
 	D(fprintf(stderr, "autocomp returning '%s', entries: %d\n", p, rl.cur_entries);)
 	return p;
 }
@@ -22,6 +22,8 @@
 #include "ne.h" 
 #include "support.h"
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
 
 /* The standard pool allocation dimension. */
 
@@ -31,6 +33,12 @@
 
 #define STD_LINE_DESC_POOL_SIZE (512)
 
+/* The maximum sizes of the pools allocated when appending text to a buffer
+   (see append_fd_to_buffer()), which otherwise double at each allocation. */
+
+#define MAX_APPEND_POOL_SIZE (16 * 1024 * 1024)
+#define MAX_APPEND_LINE_DESC_POOL_SIZE (256 * 1024)
+
 /* The starting size when reading a non-seekable file. */
 
 #define START_SIZE (8 * 1024)
@@ -45,9 +53,19 @@ pool dimension, with respect to the number of lines of the given file. */
 
 #define MAX_STACK_SPACES (256)
 
-/* The length of the block used in order to optimize saves. */
+/* The maximum number of segments gathered in a single writev() call while saving. */
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define SAVE_IOV_MAX IOV_MAX
+#else
+#define SAVE_IOV_MAX (1024)
+#endif
 
-#define SAVE_BLOCK_LEN	(16 * 1024 - 1)
+/* Lines shorter than this are copied into a staging area of SAVE_STAGE_LEN
+   bytes while saving, instead of being written in place. */
+
+#define SAVE_DIRECT_LEN (512)
+#define SAVE_STAGE_LEN (64 * 1024)
 
 /* The length of a half of the circular buffer used for memory mapping. */
 
@@ -255,9 +273,11 @@ not cleared. */
 void free_buffer_contents(buffer * const b) {
 
 	if (!b) return;
+	if (b->shared_clips) unshare_clips(b);
 
 	block_signals();
 
+	col_index_invalidate(NULL);
 	free_list(&b->line_desc_pool_list, free_line_desc_pool);
 	free_list(&b->char_pool_list, free_char_pool);
 	new_list(&b->line_desc_list);
@@ -268,7 +288,8 @@ void free_buffer_contents(buffer * const b) {
 	b->is_CRLF = false;
 	b->encoding = ENC_ASCII;
 	b->bookmark_mask = 0;
-	b->mtime = 0;
+	memset(&b->stamp, 0, sizeof b->stamp);
+	unwatch_buffer(b);
 
 	free_char_stream(b->last_deleted);
 	b->last_deleted = NULL;
@@ -277,7 +298,9 @@ void free_buffer_contents(buffer * const b) {
 	b->filename = NULL;
 
 	reset_undo_buffer(&b->undo);
-	b->is_modified = b->marking = b->recording = b->x_wanted = 0;
+	free_word_index(b);
+	free_bracket_index(b);
+	b->is_modified = b->marking = b->recording = b->x_wanted = b->changed_on_disk = b->following = 0;
 
 	release_signals();
 }
@@ -426,6 +449,7 @@ line_desc *alloc_line_desc(buffer * const b) {
 
 			ldp->allocated_items++;
 
+			col_index_invalidate(ld);
 			ld->line = NULL;
 			ld->line_len = 0;
 			if (do_syntax) ld->highlight_state.state = -1;
@@ -443,6 +467,7 @@ line_desc *alloc_line_desc(buffer * const b) {
 		line_desc * const ld = (line_desc *)ldp->free_list.head;
 		rem(&ld->ld_node);
 		ldp->allocated_items = 1;
+		col_index_invalidate(ld);
 		if (do_syntax) ld->highlight_state.state = -1;
 		release_signals();
 		return ld;
@@ -473,6 +498,7 @@ void free_line_desc(buffer * const b, line_desc * const ld) {
 
 	block_signals();
 
+	col_index_invalidate(ld);
 	add_head(&ldp->free_list, &ld->ld_node);
 
 	if (--ldp->allocated_items == 0) {
@@ -532,11 +558,13 @@ char *alloc_chars(buffer * const b, const int64_t len) {
 	}
 
 	/* If no free space has been found, we allocate a new pool which is guaranteed
-	to contain at least len characters. The pool is added to the head of the list. */
+	to contain at least len characters (and possibly the reserved characters).
+	The pool is added to the head of the list. */
 
-	if (cp = alloc_char_pool(len, 0, -1)) {
+	if ((cp = alloc_char_pool(max(len, b->reserved_chars), 0, -1)) || b->reserved_chars > len && (cp = alloc_char_pool(len, 0, -1))) {
 		add_head(&b->char_pool_list, &cp->cp_node);
 		cp->last_used = len - 1;
+		b->reserved_chars = 0;
 
 		b->allocated_chars += cp->size;
 		b->free_chars += cp->size - len;
@@ -551,6 +579,20 @@ char *alloc_chars(buffer * const b, const int64_t len) {
 
 
 
+/* Declares that the next edits will allocate about len characters with
+   alloc_chars(), so that if a new pool is needed it is allocated large
+   enough to satisfy all of them. Otherwise, a batch of edits on many adjacent
+   lines (e.g., a vertical paste) would scatter them over a large number of
+   small pools, making the pool list, which is scanned linearly, very long.
+   The reservation lasts until a new pool is allocated or reserve_chars() is
+   called again (possibly with len equal to zero). */
+
+void reserve_chars(buffer * const b, const int64_t len) {
+	b->reserved_chars = len;
+}
+
+
+
 /* This function is very important, since it embeds all the philosophy behind
    ne's character pool management. It performs an allocation *locally*, that
    is, it tries to see if there are enough free characters around the line
@@ -729,16 +771,22 @@ int insert_stream(buffer * const b, line_desc * ld, int64_t line, int64_t pos, c
 	assert_line_desc(ld, b->encoding);
 	assert_buffer(b);
 
+	if (b->shared_clips) unshare_clips(b);
+
 	block_signals();
+	col_index_invalidate(ld);
 
 	if (b->opt.do_undo && !(b->undoing || b->redoing)) {
-		const int error = add_undo_step(b, line, pos, -stream_len);
+		const int error = add_undo_step(b, line, pos, -stream_len, !memchr(stream, 0, stream_len));
 		if (error) {
 			release_signals();
 			return error;
 		}
 	}
 
+	word_index_modify(b, ld);
+	bracket_index_modify(b, line, memchr(stream, 0, stream_len) != NULL);
+
 	const char *s = stream;
 	while(s - stream < stream_len) {
 		int64_t const len = strnlen_ne(s, stream_len - (s - stream));
@@ -816,6 +864,7 @@ int insert_stream(buffer * const b, line_desc * ld, int64_t line, int64_t pos, c
 					ld->line_len = pos + len;
 					if (pos + len == 0) ld->line = NULL;
 				}
+				word_index_add(b, new_ld);
 
 				b->is_modified = 1;
 				ld = new_ld;
@@ -909,16 +958,22 @@ int delete_stream(buffer * const b, line_desc * const ld, const int64_t line, co
 	/* If we are in no man's land, we return. */
 	if (!b || !ld || !len || pos > ld->line_len || pos == ld->line_len && !ld->ld_node.next->next) return ERROR;
 
+	if (b->shared_clips) unshare_clips(b);
+
 	block_signals();
+	col_index_invalidate(ld);
 
 	if (b->opt.do_undo && !(b->undoing || b->redoing)) {
-		const int error = add_undo_step(b, line, pos, len);
+		const int error = add_undo_step(b, line, pos, len, true);
 		if (error) {
 			release_signals();
 			return error;
 		}
 	}
 
+	word_index_modify(b, ld);
+	bracket_index_modify(b, line, len > ld->line_len - pos);
+
 	while(len) {
 		/* First case: we are just on the end of a line. We join the current
 		line with the following one (if it's there of course). If, however,
@@ -930,6 +985,8 @@ int delete_stream(buffer * const b, line_desc * const ld, const int64_t line, co
 			/* There's nothing more to do--we are at the end of the file. */
 			if (next_ld->ld_node.next == NULL) break;
 
+			word_index_remove(b, next_ld);
+
 			/* We're about to join line+1 to line; adjust mark and bookmarks accordingly. */
 			if (b->marking) {
 				if (b->block_start_line == line+1) {
@@ -1070,6 +1127,99 @@ int delete_stream(buffer * const b, line_desc * const ld, const int64_t line, co
 }
 
 
+/* Moves a line/position pair referring to the n lines starting at line, which
+   are being replaced by m of them, to the corresponding place in the
+   resulting text. */
+
+static void reorder_line_pos(int64_t * const l, int64_t * const pos, const int64_t line, const int64_t n, const int64_t m) {
+	if (*l < line) return;
+	if (*l >= line + n) *l -= n - m;
+	else {
+		*l = min(*l, line + m - 1);
+		if (pos) *pos = 0;
+	}
+}
+
+/* Replaces the n lines starting at ld, which is the line-th line, with the
+   first m line descriptors of lds[], which must contain exactly the same
+   descriptors in some order; the descriptors in lds[m..n) are freed. The
+   line list is relinked in place, so no text is copied, but the undo system
+   records two steps, which must thus be wrapped in an undo chain. The cursor
+   and the window are moved to the resulting lines, but they must be resynced
+   by the caller. */
+
+int reorder_lines(buffer * const b, line_desc * const ld, const int64_t line, line_desc ** const lds, const int64_t n, const int64_t m) {
+	assert_buffer(b);
+	assert(m > 0 && m <= n);
+	if (!b || !ld || m < 1 || m > n || line + n > b->num_lines) return ERROR;
+
+	if (b->shared_clips) unshare_clips(b);
+
+	int64_t old_len = n - 1, new_len = m - 1;
+	line_desc *l = ld;
+	for(int64_t i = 0; i < n; i++, l = (line_desc *)l->ld_node.next) old_len += l->line_len;
+	for(int64_t i = 0; i < m; i++) new_len += lds[i]->line_len;
+	node * const prev = ld->ld_node.prev, * const next = &l->ld_node;
+
+	block_signals();
+
+	/* For the undo system, the new lines and a newline are inserted before
+	   the old lines, which are then deleted with the newline preceding them:
+	   in this way, both undoing and redoing end with the deletion, which might
+	   free the descriptor of the cursor line. */
+	if (b->opt.do_undo && !(b->undoing || b->redoing)) {
+		int error = add_undo_step(b, line, 0, -(new_len + 1), false);
+		if (!error) error = add_undo_step(b, line + m - 1, lds[m - 1]->line_len, old_len + 1, false);
+		l = ld;
+		for(int64_t i = 0; !error && i < n; i++, l = (line_desc *)l->ld_node.next) {
+			if (error = add_to_undo_stream(&b->undo, "", 1)) break;
+			if (l->line_len) error = add_to_undo_stream(&b->undo, l->line, l->line_len);
+		}
+		if (error) {
+			release_signals();
+			return error;
+		}
+	}
+
+	bracket_index_modify(b, line, true);
+
+	for(int64_t i = m; i < n; i++) {
+		word_index_remove(b, lds[i]);
+		col_index_invalidate(lds[i]);
+		if (lds[i]->line) free_chars(b, lds[i]->line, lds[i]->line_len);
+		free_line_desc(b, lds[i]);
+	}
+
+	prev->next = &lds[0]->ld_node;
+	lds[0]->ld_node.prev = prev;
+	for(int64_t i = 1; i < m; i++) {
+		lds[i - 1]->ld_node.next = &lds[i]->ld_node;
+		lds[i]->ld_node.prev = &lds[i - 1]->ld_node;
+	}
+	lds[m - 1]->ld_node.next = next;
+	next->prev = &lds[m - 1]->ld_node;
+	b->num_lines -= n - m;
+
+	/* The descriptors of lines in the range are taken from lds[], the other
+	   ones are still valid. */
+	if (b->win_y >= line && b->win_y < line + n) b->top_line_desc = lds[min(b->win_y, line + m - 1) - line];
+	if (b->cur_line >= line && b->cur_line < line + n) b->cur_line_desc = lds[min(b->cur_line, line + m - 1) - line];
+	reorder_line_pos(&b->win_y, NULL, line, n, m);
+	reorder_line_pos(&b->cur_line, NULL, line, n, m);
+	b->cur_y = (int)(b->cur_line - b->win_y);
+	b->cur_pos = -1;
+	b->attr_len = -1;
+
+	if (b->marking) reorder_line_pos(&b->block_start_line, &b->block_start_pos, line, n, m);
+	for (int i = 0, mask = b->bookmark_mask; mask; i++, mask >>= 1)
+		if (mask & 1) reorder_line_pos(&b->bookmark[i].line, &b->bookmark[i].pos, line, n, m);
+
+	b->is_modified = 1;
+	release_signals();
+	return OK;
+}
+
+
 /* Deletes a single character. */
 
 int delete_one_char(buffer * const b, line_desc * const ld, const int64_t line, const int64_t pos) {
@@ -1139,7 +1289,7 @@ int load_file_in_buffer(buffer * const b, const char *name) {
 	if (fd >= 0) {
 		const int result = load_fd_in_buffer(b, fd);
 		close(fd);
-		b->mtime = file_mod_time(name);
+		get_file_stamp(name, &b->stamp);
 		if (!result) b->opt.read_only = (access(name, W_OK) != 0);
 		return result;
 	}
@@ -1477,6 +1627,203 @@ int load_fd_in_buffer(buffer *b, int fd) {
 	return OK;
 }
 
+/* Appends to a buffer the content of a file descriptor from offset *pos to
+   the end of the file, splitting it into lines exactly as load_fd_in_buffer()
+   would have done with the whole file: the text continues the last line, and
+   the new lines are appended to the line list. The text is read into the free
+   space at the end of the character pool at the head of the list, if there is
+   enough; otherwise, into a new pool at least twice as large (up to
+   MAX_APPEND_POOL_SIZE). Line descriptors are taken in the same way from the
+   line descriptor pool at the head of the list. Thus, the cost is proportional
+   to the size of the text appended, and following a file needs a logarithmic
+   number of pools. This is the way growing files (e.g., logs) are followed
+   (see follow_file()). *pos is advanced by the number of bytes appended, which
+   is smaller than expected if the file ends with an incomplete UTF-8 sequence.
+   As for loading, no undo step is recorded and the buffer is not marked as
+   modified: the caller must make sure that the buffer is not modified. */
+
+int append_fd_to_buffer(buffer * const b, const int fd, off_t * const pos) {
+	char terminators[] = { 0x0d, 0x0a };
+	if (b->opt.preserve_cr) terminators[0] = 0;
+
+	const off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0) return IO_ERROR;
+	if (size <= *pos) return OK;
+
+	line_desc * const last = (line_desc *)b->line_desc_list.tail_pred;
+	const int64_t prefix = last->line_len;
+
+	/* If the last line ends at the end of the head pool, the text just
+	   continues it; otherwise, we copy the last line before the text. */
+	char_pool *cp = (char_pool *)b->char_pool_list.head;
+	const int64_t free_space = cp->cp_node.next ? cp->size - cp->last_used - 1 : 0;
+	const bool in_place = prefix && free_space >= size - *pos && last->line + prefix == cp->pool + cp->last_used + 1;
+	const int64_t copy = in_place ? 0 : prefix, needed = copy + size - *pos;
+	const bool new_pool = free_space < needed;
+	if (new_pool && !(cp = alloc_char_pool(max(needed, cp->cp_node.next ? min(2 * cp->size, MAX_APPEND_POOL_SIZE) : 0), 0, 0))) return OUT_OF_MEMORY;
+
+	int64_t len;
+	char * const line = new_pool ? cp->pool : in_place ? last->line : cp->pool + cp->last_used + 1;
+	char * const start = line + prefix;
+	if (lseek(fd, *pos, SEEK_SET) < 0 || (len = read_safely(fd, start, size - *pos)) < 0) {
+		if (new_pool) free_char_pool(cp);
+		else memset(start, 0, size - *pos);
+		return IO_ERROR;
+	}
+
+	/* We do not split UTF-8 sequences: an incomplete one will be appended
+	   when the rest is written. */
+	if (!b->opt.binary && (b->encoding == ENC_UTF8 || b->encoding == ENC_ASCII && b->opt.utf8auto)) {
+		for(int64_t i = len; i-- > max(len - 6, 0); ) {
+			if ((unsigned char)start[i] < 0x80) break;
+			if ((unsigned char)start[i] >= 0xC0) {
+				if (utf8len(start[i]) > len - i) {
+					memset(start + i, 0, len - i);
+					len = i;
+				}
+				break;
+			}
+		}
+	}
+
+	if (len == 0) {
+		if (new_pool) free_char_pool(cp);
+		return OK;
+	}
+
+	/* If the last character appended was a CR ending a line, a LF following it
+	   is part of the same terminator. */
+	char *p = start;
+	int64_t unused = 0;
+	if (*pos > 0 && prefix == 0 && !b->opt.binary && !b->opt.preserve_cr && *p == '\n') {
+		char c;
+		if (pread(fd, &c, 1, *pos - 1) == 1 && c == '\r') {
+			*p++ = 0;
+			unused++;
+		}
+	}
+	char * const end = start + len;
+
+	/* The first pass counts the new lines, as in load_fd_in_buffer(). */
+	int64_t n = 0;
+	for(char *q = p; q < end; q++)
+		if (!b->opt.binary && (*q == terminators[0] || *q == terminators[1]) || !*q) {
+			if (q < end - 1 && q[0] == '\r' && q[1] == '\n') {
+				b->is_CRLF = true;
+				q++;
+				unused++;
+			}
+			n++;
+			unused++;
+		}
+
+	line_desc_pool *ldp = (line_desc_pool *)b->line_desc_pool_list.head;
+	const bool new_ldp = n && (!ldp->ldp_node.next || ldp->size - ldp->allocated_items < n);
+	if (new_ldp && !(ldp = alloc_line_desc_pool(max(n, ldp->ldp_node.next ? min(2 * ldp->size, MAX_APPEND_LINE_DESC_POOL_SIZE) : 0), -1))) {
+		if (new_pool) free_char_pool(cp);
+		else memset(start, 0, len);
+		return OUT_OF_MEMORY;
+	}
+
+	if (b->shared_clips) unshare_clips(b);
+
+	block_signals();
+
+	col_index_invalidate(last);
+	word_index_modify(b, last);
+	bracket_index_modify(b, b->num_lines - 1, n != 0);
+
+	char * const old_line = last->line;
+	if (copy) memcpy(line, old_line, copy);
+
+	/* The second pass finds the lines, as in load_fd_in_buffer(); the first
+	   one is the continuation of the last line. */
+	line_desc *ld = last;
+	char *s = line;
+	for(int64_t i = 0; ; i++) {
+		char *q = p;
+		while(q < end && (b->opt.binary || *q != terminators[0] && *q != terminators[1]) && *q) q++;
+
+		ld->line_len = q - s;
+		ld->line = q - s ? s : NULL;
+
+		if (q < end) {
+			if (q < end - 1 && q[0] == '\r' && q[1] == '\n') *q++ = 0;
+			*q++ = 0;
+		}
+
+		if (i != 0) word_index_add(b, ld);
+		if (i == n) break;
+
+		ld = (line_desc *)ldp->free_list.head;
+		rem(&ld->ld_node);
+		ldp->allocated_items++;
+		col_index_invalidate(ld);
+		if (do_syntax) ld->highlight_state.state = -1;
+		add_tail(&b->line_desc_list, &ld->ld_node);
+		s = p = q;
+	}
+
+	if (new_ldp) add_head(&b->line_desc_pool_list, &ldp->ldp_node);
+	else if (n && !ldp->free_list.head->next) {
+		rem(&ldp->ldp_node);
+		add_tail(&b->line_desc_pool_list, &ldp->ldp_node);
+	}
+
+	/* We update the offsets of the first and last character used, as in
+	load_fd_in_buffer(). The characters used are those of the text (and of
+	the copied line), except for the terminators. */
+	if (new_pool) {
+		b->allocated_chars += cp->size;
+		b->free_chars += cp->size;
+	}
+	b->free_chars -= copy + len - unused;
+
+	if (copy + len > unused) {
+		if (new_pool) {
+			cp->last_used = copy + len;
+			while(!cp->pool[cp->first_used]) cp->first_used++;
+			while(!cp->pool[--cp->last_used]);
+			add_head(&b->char_pool_list, &cp->cp_node);
+		}
+		else for(int64_t i = end - cp->pool; i-- > cp->last_used; ) if (cp->pool[i]) {
+			cp->last_used = i;
+			break;
+		}
+		assert_char_pool(cp);
+	}
+	else if (new_pool) {
+		b->allocated_chars -= cp->size;
+		b->free_chars -= cp->size;
+		free_char_pool(cp);
+	}
+
+	if (copy) free_chars(b, old_line, copy);
+
+	b->num_lines += n;
+
+	/* The encoding might change only because of the new text. */
+	const encoding_type encoding = detect_encoding(start, len);
+	if (encoding != ENC_ASCII && encoding != b->encoding && b->encoding != ENC_8_BIT) {
+		if (b->encoding == ENC_UTF8) reset_undo_buffer(&b->undo);
+		b->encoding = b->encoding == ENC_ASCII && encoding == ENC_UTF8 && b->opt.utf8auto ? ENC_UTF8 : ENC_8_BIT;
+		reset_syntax_states(b);
+	}
+	else if (b->syn) {
+		HIGHLIGHT_STATE state = last->highlight_state;
+		for(ld = last; ld->ld_node.next; ld = (line_desc *)ld->ld_node.next) {
+			ld->highlight_state = state;
+			state = parse(b->syn, ld, state, b->encoding == ENC_UTF8);
+		}
+	}
+	b->attr_len = -1;
+
+	release_signals();
+	*pos += len;
+	return OK;
+}
+
+
 /* Recomputes initial states for all lines in a buffer. */
 
 void reset_syntax_states(buffer *b) {
@@ -1508,138 +1855,231 @@ void ensure_attr_buf(buffer * const b, const int64_t capacity) {
 }
 
 
-/* Here we save a buffer to a given file. If no file is specified, the
-   buffer filename field is used. The is_modified flag is set to 0,
-   and the mtime is updated. */
+/* Writes the given iovec array to fd, resuming after partial writes. The
+   array is modified in the process. Returns OK, CANNOT_SAVE_DISK_FULL or
+   IO_ERROR. */
 
+static int write_iovec(const int fd, struct iovec *iov, int iovcnt) {
+	while(iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return errno == ENOSPC ? CANNOT_SAVE_DISK_FULL : IO_ERROR;
+		}
+		if (written == 0) return CANNOT_SAVE_DISK_FULL;
 
-int save_buffer_to_file(buffer *b, const char *name) {
-	line_desc *ld = (line_desc *)b->line_desc_list.head;
+		while(iovcnt > 0 && written >= (ssize_t)iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return OK;
+}
 
-	if (!b) return ERROR;
 
-	assert_buffer(b);
+/* Appends len bytes from p to the staging area, extending the last segment
+   if it already ends at the staging area tail. */
 
-	if (name == NULL) name = b->filename;
+static inline void stage_bytes(struct iovec * const iov, int * const n, char * const stage, size_t * const used, const char * const p, const size_t len) {
+	if (*n == 0 || (char *)iov[*n - 1].iov_base + iov[*n - 1].iov_len != stage + *used) {
+		iov[*n].iov_base = stage + *used;
+		iov[(*n)++].iov_len = 0;
+	}
+	memcpy(stage + *used, p, len);
+	*used += len;
+	iov[*n - 1].iov_len += len;
+}
 
-	if (!name) return ERROR;
 
-	name = tilde_expand(name);
+/* Writes the contents of a buffer to fd. Segments are gathered into batches
+   of at most SAVE_IOV_MAX entries, which are written using writev(). Lines
+   of at least SAVE_DIRECT_LEN bytes are referenced in place; shorter lines
+   and terminators are packed into a staging area, as the per-segment cost of
+   writev() would otherwise dominate. If the staging area cannot be
+   allocated, everything is referenced in place. */
+
+static int write_buffer_lines(const buffer * const b, const int fd) {
+	struct iovec iov[SAVE_IOV_MAX];
+	char * const stage = malloc(SAVE_STAGE_LEN);
+	const char * const terminator = b->opt.binary ? "\0" : b->is_CRLF ? "\r\n" : "\n";
+	const size_t terminator_len = b->opt.binary ? 1 : b->is_CRLF ? 2 : 1;
+	size_t used = 0;
+	int n = 0, error = OK;
+
+	for(line_desc *ld = (line_desc *)b->line_desc_list.head; ld->ld_node.next; ld = (line_desc *)ld->ld_node.next) {
+		/* Each line needs at most two segments and SAVE_DIRECT_LEN + 1 staged bytes. */
+		if (n > SAVE_IOV_MAX - 2 || used > SAVE_STAGE_LEN - SAVE_DIRECT_LEN - 2) {
+			if (error = write_iovec(fd, iov, n)) break;
+			n = 0;
+			used = 0;
+		}
 
-	if (is_directory(name)) return FILE_IS_DIRECTORY;
-	if (is_migrated(name)) return FILE_IS_MIGRATED;
+		if (ld->line_len) {
+			if (stage && ld->line_len < SAVE_DIRECT_LEN) stage_bytes(iov, &n, stage, &used, ld->line, ld->line_len);
+			else {
+				iov[n].iov_base = ld->line;
+				iov[n++].iov_len = ld->line_len;
+			}
+		}
 
-	block_signals();
+		if (ld->ld_node.next->next) {
+			if (stage) stage_bytes(iov, &n, stage, &used, terminator, terminator_len);
+			else {
+				iov[n].iov_base = (char *)terminator;
+				iov[n++].iov_len = terminator_len;
+			}
+		}
+	}
 
-	int error = OK;
-	const int fd = open(name, WRITE_FLAGS, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-	if (fd >= 0) {
+	if (error == OK && n) error = write_iovec(fd, iov, n);
+	free(stage);
+	return error;
+}
 
-		/* If we can allocate SAVE_BLOCK_LEN bytes, we will use
-		them as a buffer for our saves. */
 
-		char * const p = malloc(SAVE_BLOCK_LEN + 1);
-		if (p) {
+/* Saves a buffer by writing it to a temporary file in the same directory as
+   name, and then renaming the temporary file over name. If sync_save is set,
+   the data is committed to disk before the rename. If a suitable temporary
+   file cannot be set up (e.g., because name is not a regular file, has
+   multiple links or belongs to another user), NOT_FOUND is returned and the
+   caller should fall back to saving in place. */
 
-			/* used keeps track of the number of bytes used in the buffer. l, len
-			specify the pointer to the block of characters to save, and
-			its length. In case of very long lines, or buffer border crossing,
-			they could point in the middle of a line descriptor. */
+static int save_buffer_atomically(const buffer * const b, const char * const name) {
+	struct stat st;
+	const bool exists = stat(name, &st) == 0;
 
-			int64_t used = 0, len;
-			char *l;
+	if (exists && (!S_ISREG(st.st_mode) || st.st_nlink > 1)) return NOT_FOUND;
+	if (!exists && errno != ENOENT) return NOT_FOUND;
 
-			while(ld->ld_node.next) {
-				l = ld->line;
-				len = ld->line_len;
+	const char * const base = file_part(name);
+	const size_t dir_len = base - name;
+	char * const tmp_name = malloc(strlen(name) + 10);
+	if (!tmp_name) return NOT_FOUND;
+	memcpy(tmp_name, name, dir_len);
+	sprintf(tmp_name + dir_len, ".%s.XXXXXX", base);
 
-				while(len > 0) {
-					if (SAVE_BLOCK_LEN - used > len) {
-						memcpy(p + used, l, len);
-						used += len;
-						len = 0;
-					}
-					else {
-						memcpy(p + used, l, SAVE_BLOCK_LEN - used);
-						len -= SAVE_BLOCK_LEN - used;
-						l += SAVE_BLOCK_LEN - used;
+	const int fd = mkstemp(tmp_name);
+	if (fd < 0) {
+		free(tmp_name);
+		return NOT_FOUND;
+	}
 
-						used = 0;
+	/* The new file must look like the one it replaces. */
+	bool ok;
+	if (exists) {
+		struct stat tmp_st;
+		ok = fstat(fd, &tmp_st) == 0
+			&& (tmp_st.st_uid == st.st_uid && tmp_st.st_gid == st.st_gid || fchown(fd, st.st_uid, st.st_gid) == 0)
+			&& fchmod(fd, st.st_mode & 07777) == 0;
+	}
+	else {
+		const mode_t mask = umask(0);
+		umask(mask);
+		ok = fchmod(fd, 0666 & ~mask) == 0;
+	}
 
-						if (write(fd, p, SAVE_BLOCK_LEN) < SAVE_BLOCK_LEN) {
-							error = CANNOT_SAVE_DISK_FULL;
-							break;
-						}
-					}
-				}
+	if (!ok) {
+		close(fd);
+		unlink(tmp_name);
+		free(tmp_name);
+		return NOT_FOUND;
+	}
 
-				if (error) break;
+	int error = write_buffer_lines(b, fd);
+	if (error == OK && sync_save && fsync(fd)) error = IO_ERROR;
+	if (close(fd) && error == OK) error = IO_ERROR;
+	if (error == OK && rename(tmp_name, name)) error = IO_ERROR;
+
+	if (error) unlink(tmp_name);
+	else if (sync_save) {
+		/* Make the rename itself durable. */
+		tmp_name[dir_len] = 0;
+		const int dir_fd = open(dir_len ? tmp_name : ".", O_RDONLY);
+		if (dir_fd >= 0) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
 
-				ld = (line_desc *)ld->ld_node.next;
+	free(tmp_name);
+	return error;
+}
 
-				/* Note that the two previous blocks never leave used == SAVE_BLOCK_LEN.
-				Thus, we can always assume there are two free bytes at p+used. */
 
-				if (ld->ld_node.next) {
-					if (b->opt.binary) p[used++] = 0;
-					else {
-						if (b->is_CRLF) p[used++] = '\r';
-						p[used++] = '\n';
-					}
-				}
+/* Here we write a buffer to a given file. If no file is specified, the
+   buffer filename field is used. The is_modified flag is set to 0,
+   and the file stamp is updated. Whenever possible, the file is replaced
+   atomically, so that a failure during the save leaves the previous
+   contents untouched; otherwise, it is rewritten in place. Symbolic
+   links are followed, so the file they point to is replaced. */
 
-				if (used >= SAVE_BLOCK_LEN) {
-					if (write(fd, p, used) < used) {
-						error = IO_ERROR;
-						break;
-					}
-					else used = 0;
-				}
-			}
 
-			if (!error && used && write(fd, p, used) < used) error = IO_ERROR;
+static int write_buffer_to_file(buffer *b, const char *name) {
+	if (!b) return ERROR;
 
-			free(p);
-		}
-		else {
+	assert_buffer(b);
 
-			/* If the buffer is not available, just save line by line. */
+	if (name == NULL) name = b->filename;
 
-			while(ld->ld_node.next) {
+	if (!name) return ERROR;
 
-				if (ld->line) {
-					if (write(fd, ld->line, ld->line_len) < ld->line_len) {
-						error = IO_ERROR;
-						break;
-					}
-				}
+	name = tilde_expand(name);
 
-				ld = (line_desc *)ld->ld_node.next;
+	if (is_directory(name)) return FILE_IS_DIRECTORY;
+	if (is_migrated(name)) return FILE_IS_MIGRATED;
 
-				if (ld->ld_node.next) {
-					if (!b->opt.binary && b->is_CRLF && write(fd, "\r", 1) < 1) {
-						error = IO_ERROR;
-						break;
-					}
-					if (write(fd, b->opt.binary ? "\0" : "\n", 1) < 1) {
-						error = IO_ERROR;
-						break;
-					}
-				}
-			}
+	block_signals();
+
+	/* realpath() fails on new files (and on dangling links, which we
+	write through in place). */
+	char * const real_name = realpath(name, NULL);
+	struct stat st;
+	int error = NOT_FOUND;
+
+	if (real_name || lstat(name, &st) != 0) error = save_buffer_atomically(b, real_name ? real_name : name);
+	free(real_name);
+
+	if (error == NOT_FOUND) {
+		const int fd = open(name, WRITE_FLAGS, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd >= 0) {
+			error = write_buffer_lines(b, fd);
+			if (error == OK && sync_save && fsync(fd) && errno != EINVAL) error = IO_ERROR;
+			if (close(fd)) error = IO_ERROR;
 		}
+		else error = CANT_OPEN_FILE;
+	}
 
-		if (close(fd)) error = IO_ERROR;
-		if (error == OK) b->is_modified = 0;
-		b->mtime = file_mod_time(name);
+	if (error != CANT_OPEN_FILE) {
+		if (error == OK) b->is_modified = b->changed_on_disk = 0;
+		get_file_stamp(name, &b->stamp);
 	}
-	else error = CANT_OPEN_FILE;
 
 	release_signals();
 	return error;
 }
 
 
+/* Saves a buffer to a given file (or to its own file, if name is NULL), as
+   write_buffer_to_file() does. If the save is successful, it is recorded in
+   the undo history and in the undo journal. */
+
+int save_buffer_to_file(buffer *b, const char *name) {
+	const file_stamp stamp = b->stamp;
+	const int error = write_buffer_to_file(b, name);
+
+	if (error == OK) {
+		b->undo.last_save_step = b->undo.cur_step;
+		save_undo_journal(b, name ? name : b->filename, &stamp);
+	}
+	return error;
+}
+
+
 /* Autosaves a given buffer. If the buffer has a name, a '#' is prefixed to
    it. If the buffer has no name, a fake name is generated using the PID of ne
    and the pointer to the buffer structure. This ensures uniqueness. Autosave
@@ -1657,7 +2097,7 @@ void auto_save(buffer *b) {
 			}
 		}
 		else if (p = malloc(MAX_INT_LEN * 2)) sprintf(p, "%p.%x", b, getpid());
-		save_buffer_to_file(b, p);
+		write_buffer_to_file(b, p);
 		free(p);
 	}
 }
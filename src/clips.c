@@ -30,6 +30,13 @@
    be pasted only in buffers with a compatible encoding. 
 
    Note that pasting a clip in an ASCII buffer may change its encoding.
+
+   A clip copied from a (non-vertical) block is not filled immediately: it
+   just refers to the text of the block, so copying takes time proportional
+   to the number of lines and needs no additional memory. The text is copied
+   into the clip by materialize_clip(), which must be called before accessing
+   the stream of a clip, and which is called by unshare_clips() when the
+   source document is about to be modified or freed.
 */
 
 
@@ -50,6 +57,16 @@ clip_desc *alloc_clip_desc(int n, int64_t size) {
 
 
 
+/* Makes a clip forget the document it refers to, if any, leaving it empty. */
+
+static void release_clip(clip_desc * const cd) {
+	if (cd->src) {
+		cd->src->shared_clips--;
+		cd->src = NULL;
+	}
+}
+
+
 /* Reallocates a clip descriptor of the given size. If cd is NULL, this is
    equivalent to calling alloc_clip_desc. */
 
@@ -63,6 +80,7 @@ clip_desc *realloc_clip_desc(clip_desc *cd, int n, int64_t size) {
 
 	if (cd->n != n) return NULL;
 
+	release_clip(cd);
 	char_stream * const cs = realloc_char_stream(cd->cs, size);
 	if (cs) {
 		cd->cs = cs;
@@ -81,6 +99,7 @@ void free_clip_desc(clip_desc *cd) {
 
 	assert_clip_desc(cd);
 
+	release_clip(cd);
 	free_char_stream(cd->cs);
 	free(cd);
 }
@@ -99,12 +118,74 @@ clip_desc *get_nth_clip(int n) {
 }
 
 
+/* Makes the nth clip refer to the len bytes of b starting at position pos
+   of the line ld. The clip descriptor cd is the current nth clip, or
+   NULL. */
+
+static int share_clip(buffer * const b, const int n, clip_desc * const cd, line_desc * const ld, const int64_t pos, const int64_t len) {
+	clip_desc * const new_cd = realloc_clip_desc(cd, n, 0);
+	if (!new_cd) return OUT_OF_MEMORY;
+	if (!cd) add_head(&clips, &new_cd->cd_node);
+
+	new_cd->src = b;
+	new_cd->ld = ld;
+	new_cd->pos = pos;
+	new_cd->len = len;
+	new_cd->encoding = b->encoding;
+	b->shared_clips++;
+	return OK;
+}
+
+
+/* Copies the text a clip refers to into its stream. If there is not enough
+   memory, the clip is left unchanged. */
+
+int materialize_clip(clip_desc * const cd) {
+	if (!cd->src) return OK;
+
+	char_stream * const cs = realloc_char_stream(cd->cs, cd->len);
+	if (!cs) return OUT_OF_MEMORY;
+
+	const line_desc *ld = cd->ld;
+	char *p = cs->stream;
+	int64_t pos = cd->pos, left = cd->len;
+
+	for(;;) {
+		const int64_t len = min(left, ld->line_len - pos);
+		if (len) memcpy(p, ld->line + pos, len);
+		p += len;
+		if (!(left -= len)) break;
+		*p++ = 0;
+		left--;
+		ld = (const line_desc *)ld->ld_node.next;
+		pos = 0;
+	}
+
+	cs->len = cd->len;
+	set_stream_encoding(cs, cd->encoding);
+	release_clip(cd);
+	assert_clip_desc(cd);
+	return OK;
+}
+
+
+/* Materializes all clips referring to the text of b. It must be called
+   before modifying or freeing b. A clip that cannot be materialized
+   becomes empty. */
+
+void unshare_clips(buffer * const b) {
+	for(clip_desc *cd = (clip_desc *)clips.head; b->shared_clips && cd->cd_node.next; cd = (clip_desc *)cd->cd_node.next)
+		if (cd->src == b && materialize_clip(cd)) release_clip(cd);
+}
+
+
 
 /* Copies the characters between the cursor and the block marker of the given
    buffer to the nth clip. If the cut flag is true, the characters are also
    removed from the text. The code scans the text two times: the first time in
    order to determine the exact length of the text, the second time in order to
-   actually copy it. */
+   actually copy it. If we are not cutting, the clip just refers to the text
+   after the first scan (see share_clip()). */
 
 int copy_to_clip(buffer *b, int n, bool cut) {
 	if (!b->marking) return MARK_BLOCK_FIRST;
@@ -173,6 +254,11 @@ int copy_to_clip(buffer *b, int n, bool cut) {
 				ld = (line_desc *)ld->ld_node.prev;
 			}
 
+			if (!cut) {
+				line_desc * const top_ld = (line_desc *)ld->ld_node.next;
+				return share_clip(b, n, cd, top_ld, min(top_ld->line_len, b->block_start_pos), clip_len);
+			}
+
 			if (pass) {
 				cd->cs->len = clip_len;
 				set_stream_encoding(cd->cs, b->encoding);
@@ -236,6 +322,8 @@ int copy_to_clip(buffer *b, int n, bool cut) {
 				ld = (line_desc *)ld->ld_node.next;
 			}
 
+			if (!cut) return share_clip(b, n, cd, b->cur_line_desc, min(b->cur_line_desc->line_len, b->cur_pos), clip_len);
+
 			if (pass) {
 				cd->cs->len = clip_len;
 				set_stream_encoding(cd->cs, b->encoding);
@@ -339,6 +427,8 @@ int paste_to_buffer(buffer *b, int n) {
 	clip_desc * const cd = get_nth_clip(n);
 	if (!cd) return CLIP_DOESNT_EXIST;
 
+	const int error = materialize_clip(cd);
+	if (error) return error;
 	if (!cd->cs->len) return OK;
 	if (cd->cs->encoding == ENC_ASCII || b->encoding == ENC_ASCII || cd->cs->encoding == b->encoding) {
 		line_desc * const ld = b->cur_line_desc, * const end_ld = (line_desc *)b->cur_line_desc->ld_node.next;
@@ -360,182 +450,228 @@ int paste_to_buffer(buffer *b, int n) {
 }
 
 
+/* Inserts a stream typed in by the user as a whole, as it happens with a
+   bracketed paste, and moves the cursor after it. Contrarily to a sequence of
+   InsertChar/InsertLine actions, no automatic indentation or word wrapping
+   takes place, the insertion is a single undo step, and the display is
+   updated just once. The stream must be followed by a NUL (see
+   get_paste_stream()). If we are recording, the stream is recorded as a
+   sequence of InsertString and InsertLine commands. */
 
-/* Works like copy_to_clip(), but the region to copy is the rectangle defined
-   by the cursor and the marker. Same comments apply. Note that in case of a
-   cut we use start_undo_chain() in order to make the various deletions a
-   single undo operation. */
+int paste_stream_to_buffer(buffer *b, const char *stream, const int64_t len) {
+	if (b->opt.read_only) return DOCUMENT_IS_READ_ONLY;
+	if (!len) return OK;
 
-int copy_vert_to_clip(buffer *b, int n, bool cut) {
-	if (!b->marking) return MARK_BLOCK_FIRST;
-	if (b->block_start_line >= b->num_lines) return MARK_OUT_OF_BUFFER;
+	const encoding_type encoding = detect_encoding(stream, len);
+	if (encoding != ENC_ASCII && b->encoding != ENC_ASCII && encoding != b->encoding) return INCOMPATIBLE_CLIP_ENCODING;
+	if (b->encoding == ENC_ASCII) b->encoding = encoding;
 
-	int64_t y = b->cur_line;
-	line_desc *ld = b->cur_line_desc;
-	clip_desc *cd = get_nth_clip(n);
+	if (b->recording) {
+		for(int64_t pos = 0; pos < len; pos += strlen(stream + pos) + 1) {
+			if (stream[pos]) record_action(b->cur_macro, INSERTSTRING_A, -1, stream + pos, verbose_macros);
+			if (pos + strlen(stream + pos) < len) record_action(b->cur_macro, INSERTLINE_A, -1, NULL, verbose_macros);
+		}
+	}
 
-	if (b->cur_pos == b->block_start_pos ||
-		 y == b->block_start_line && b->cur_pos >= ld->line_len && 
-		 b->block_start_pos >= ld->line_len) {
+	/* We compute the final cursor position: the number of lines
+	   in the stream, and the length of the last one. */
 
-		clip_desc * const new_cd = realloc_clip_desc(cd, n, 0);
-		if (!new_cd) return OUT_OF_MEMORY;
-		set_stream_encoding(new_cd->cs, ENC_ASCII);
-		if (!cd) add_head(&clips, &new_cd->cd_node);
-		return OK;
-	}
+	int64_t line_count = 0, last_len = len;
+	for(int64_t i = 0; i < len; i++)
+		if (!stream[i]) {
+			line_count++;
+			last_len = len - i - 1;
+		}
 
-	int64_t start_x = calc_width(nth_line_desc(b, b->block_start_line), b->block_start_pos, b->opt.tab_size, b->encoding);
-	int64_t end_x = b->win_x + b->cur_x;
+	line_desc * const ld = b->cur_line_desc, * const end_ld = (line_desc *)b->cur_line_desc->ld_node.next;
 
-	if (end_x < start_x) {
-		const uint64_t t = start_x;
-		start_x = end_x;
-		end_x = t;
-	}
+	delay_update();
+	start_undo_chain(b);
+	if (b->cur_pos > ld->line_len)
+		insert_spaces(b, ld, b->cur_line, ld->line_len, b->win_x + b->cur_x - calc_width(ld, ld->line_len, b->opt.tab_size, b->encoding));
 
-	const int64_t cur_pos = b->cur_pos;
-	if (cut) {
-		b->cur_pos = -1;
-		start_undo_chain(b);
-	}
+	const int64_t pos = b->cur_pos;
+	const int error = insert_stream(b, ld, b->cur_line, pos, stream, len);
+	end_undo_chain(b);
 
-	char *p = NULL;
-	if (y > b->block_start_line) {
-		int64_t clip_len = 0;
-		for(int pass = 0; pass < 2; pass++) {
+	update_syntax_states_delay(b, ld, end_ld);
+	if (error) return error;
 
-			ld = b->cur_line_desc;
+	goto_line_pos(b, b->cur_line + line_count, line_count ? last_len : pos + len);
+	return OK;
+}
 
-			for(int64_t i = y; i >= b->block_start_line; i--) {
 
-				const int64_t start_pos = calc_pos(ld, start_x, b->opt.tab_size, b->encoding);
-				const int64_t len = calc_pos(ld, end_x, b->opt.tab_size, b->encoding) - start_pos;
 
-				if (pass) {
-					*--p = 0;
-					p -= len;
-					if (len) memcpy(p, ld->line + start_pos, len);
-					if (cut) delete_stream(b, ld, i, start_pos, len);
-				}
+/* The rectangle engine. A vertical block is the rectangle defined by the
+   cursor and the marker: a range of lines, and a range of columns from
+   start_x (included) to end_x (excluded). Vertical operations walk the range
+   of lines once, from top to bottom, resolving both column bounds of each
+   line in a single scan, so that the cost is linear in the size of the
+   block. */
 
-				else clip_len += len + 1;
-				ld = (line_desc *)ld->ld_node.prev;
-			}
+typedef struct {
+	line_desc *top_ld;
+	int64_t top_line, bottom_line, start_x, end_x;
+} rectangle;
 
-			if (pass) {
-				cd->cs->len = clip_len;
-				set_stream_encoding(cd->cs, b->encoding);
-				assert_clip_desc(cd);
-				if (cut) {
-					update_syntax_states_delay(b, (line_desc *)ld->ld_node.next, b->cur_line_desc);
-					goto_line_pos(b, min(b->block_start_line, b->cur_line), min(b->block_start_pos, cur_pos));
-					end_undo_chain(b);
-				}
-				return OK;
-			}
 
-			clip_desc * const new_cd = realloc_clip_desc(cd, n, clip_len);
-			if (!new_cd) return OUT_OF_MEMORY;
-			if (!cd) add_head(&clips, &new_cd->cd_node);
-			cd = new_cd;
-			p = cd->cs->stream + clip_len;
-		}
+/* Fills r with the rectangle defined by the cursor and the marker of b.
+   Returns false if the rectangle is empty. */
+
+static bool get_rectangle(buffer * const b, rectangle * const r) {
+	const line_desc * const ld = b->cur_line_desc;
+
+	if (b->cur_pos == b->block_start_pos ||
+		b->cur_line == b->block_start_line && b->cur_pos >= ld->line_len &&
+		b->block_start_pos >= ld->line_len) return false;
+
+	line_desc * const mark_ld = nth_line_desc(b, b->block_start_line);
+
+	r->start_x = calc_width(mark_ld, b->block_start_pos, b->opt.tab_size, b->encoding);
+	r->end_x = b->win_x + b->cur_x;
+
+	if (r->end_x < r->start_x) {
+		const int64_t t = r->start_x;
+		r->start_x = r->end_x;
+		r->end_x = t;
+	}
+
+	if (b->cur_line > b->block_start_line) {
+		r->top_ld = mark_ld;
+		r->top_line = b->block_start_line;
+		r->bottom_line = b->cur_line;
 	}
 	else {
-		int64_t clip_len = 0;
-		for(int pass = 0; pass < 2; pass++) {
+		r->top_ld = b->cur_line_desc;
+		r->top_line = b->cur_line;
+		r->bottom_line = b->block_start_line;
+	}
 
-			ld = b->cur_line_desc;
+	return true;
+}
 
-			for(int64_t i = y; i <= b->block_start_line; i++) {
 
-				const int64_t start_pos = calc_pos(ld, start_x, b->opt.tab_size, b->encoding);
-				const int64_t len = calc_pos(ld, end_x, b->opt.tab_size, b->encoding) - start_pos;
+/* Stores in *start_pos and *end_pos the positions of ld corresponding to the
+   columns of the rectangle r (as computed by calc_pos()). The second bound
+   is found by resuming the scan from the first one. */
 
-				if (pass) {
-					if (len) memcpy(p, ld->line + start_pos, len);
-					p += len;
-					*(p++) = 0;
-					if (cut) delete_stream(b, ld, i, start_pos, len);
-				}
+static void rect_bounds(const buffer * const b, const line_desc * const ld, const rectangle * const r, int64_t * const start_pos, int64_t * const end_pos) {
+	col_checkpoint cp = { 0 };
+	if (ld->line_len >= COL_INDEX_MIN_LEN && r->start_x > COL_INDEX_STEP) col_index_by_col(ld, r->start_x, b->opt.tab_size, b->encoding, &cp);
 
-				else clip_len += len + 1;
-				ld = (line_desc *)ld->ld_node.next;
-			}
+	*start_pos = calc_pos_from(ld, r->start_x, b->opt.tab_size, b->encoding, cp.pos, &cp.width);
 
-			if (pass) {
-				cd->cs->len = clip_len;
-				set_stream_encoding(cd->cs, b->encoding);
-				assert_clip_desc(cd);
-				if (cut) {
-					update_syntax_states_delay(b, b->cur_line_desc, (line_desc *)ld->ld_node.prev);
-					goto_line_pos(b, min(b->block_start_line, b->cur_line), min(b->block_start_pos, cur_pos));
-					end_undo_chain(b);
-				}
-				return OK;
-			}
+	if (ld->line_len >= COL_INDEX_MIN_LEN && r->end_x - cp.width > COL_INDEX_STEP) *end_pos = calc_pos(ld, r->end_x, b->opt.tab_size, b->encoding);
+	else *end_pos = calc_pos_from(ld, r->end_x, b->opt.tab_size, b->encoding, *start_pos, &cp.width);
+}
 
-			clip_desc * const new_cd = realloc_clip_desc(cd, n, clip_len);
-			if (!new_cd) return OUT_OF_MEMORY;
-			if (!cd) add_head(&clips, &new_cd->cd_node);
-			cd = new_cd;
-			p = cd->cs->stream;
+
+/* Walks the lines of the rectangle r. If cs is not NULL, the part of each
+   line within the rectangle is appended to cs, followed by a NUL; if erase
+   is true, it is deleted. A part is deleted only after it has been copied
+   successfully, so even in case of error cs contains exactly the deleted
+   text. Returns the descriptor of the bottom line of the rectangle in
+   *bottom_ld. */
+
+static int rect_walk(buffer * const b, const rectangle * const r, char_stream * const cs, const bool erase, line_desc ** const bottom_ld) {
+	line_desc *ld = r->top_ld;
+
+	for(int64_t i = r->top_line; ; i++) {
+		int64_t start_pos, end_pos;
+		rect_bounds(b, ld, r, &start_pos, &end_pos);
+		const int64_t len = end_pos - start_pos;
+
+		if (cs) {
+			if (cs->size - cs->len <= len && !realloc_char_stream(cs, max(cs->size * 2, cs->len + len + 1))) {
+				*bottom_ld = ld;
+				return OUT_OF_MEMORY;
+			}
+			if (len) memcpy(cs->stream + cs->len, ld->line + start_pos, len);
+			cs->stream[cs->len + len] = 0;
+			cs->len += len + 1;
 		}
+
+		if (erase && len) delete_stream(b, ld, i, start_pos, len);
+
+		if (i == r->bottom_line) break;
+		ld = (line_desc *)ld->ld_node.next;
 	}
 
-	if (cut) end_undo_chain(b);
+	*bottom_ld = ld;
 	return OK;
 }
 
-/* Simply erases a vertical block, without putting it in a clip. Calls
-   update_syntax_states_delay() if update is true. */
 
-int erase_vert_block(buffer *b, const bool update) {
+/* Works like copy_to_clip(), but the region to copy is the rectangle defined
+   by the cursor and the marker. Note that in case of a cut we use
+   start_undo_chain() in order to make the various deletions a single undo
+   operation. */
 
+int copy_vert_to_clip(buffer *b, int n, bool cut) {
 	if (!b->marking) return MARK_BLOCK_FIRST;
 	if (b->block_start_line >= b->num_lines) return MARK_OUT_OF_BUFFER;
 
-	int64_t y = b->cur_line;
-	line_desc *ld = b->cur_line_desc;
+	clip_desc *cd = get_nth_clip(n);
+	rectangle r;
 
-	if (b->cur_pos == b->block_start_pos ||
-		y == b->block_start_line && b->cur_pos >= ld->line_len && 
-		b->block_start_pos >= ld->line_len) 
+	if (!get_rectangle(b, &r)) {
+		clip_desc * const new_cd = realloc_clip_desc(cd, n, 0);
+		if (!new_cd) return OUT_OF_MEMORY;
+		set_stream_encoding(new_cd->cs, ENC_ASCII);
+		if (!cd) add_head(&clips, &new_cd->cd_node);
 		return OK;
+	}
+
+	/* The clip is built in a single growing stream, starting with room for
+	   the line terminators. */
+
+	clip_desc * const new_cd = realloc_clip_desc(cd, n, r.bottom_line - r.top_line + 1);
+	if (!new_cd) return OUT_OF_MEMORY;
+	if (!cd) add_head(&clips, &new_cd->cd_node);
+	cd = new_cd;
+	cd->cs->len = 0;
 
 	const int64_t cur_pos = b->cur_pos;
-	b->cur_pos = -1;
+	if (cut) {
+		b->cur_pos = -1;
+		start_undo_chain(b);
+	}
 
-	int64_t start_x = calc_width(nth_line_desc(b, b->block_start_line), b->block_start_pos, b->opt.tab_size, b->encoding);
-	int64_t end_x = b->win_x + b->cur_x;
+	line_desc *bottom_ld;
+	const int error = rect_walk(b, &r, cd->cs, cut, &bottom_ld);
 
-	if (end_x < start_x) {
-		const uint64_t t = start_x;
-		start_x = end_x;
-		end_x = t;
+	set_stream_encoding(cd->cs, b->encoding);
+	assert_clip_desc(cd);
+
+	if (cut) {
+		update_syntax_states_delay(b, r.top_ld, bottom_ld);
+		goto_line_pos(b, min(b->block_start_line, b->cur_line), min(b->block_start_pos, cur_pos));
+		end_undo_chain(b);
 	}
 
+	return error;
+}
+
+/* Simply erases a vertical block, without putting it in a clip. Calls
+   update_syntax_states_delay() if update is true. */
+
+int erase_vert_block(buffer *b, const bool update) {
+
+	if (!b->marking) return MARK_BLOCK_FIRST;
+	if (b->block_start_line >= b->num_lines) return MARK_OUT_OF_BUFFER;
+
+	rectangle r;
+	if (!get_rectangle(b, &r)) return OK;
+
+	const int64_t cur_pos = b->cur_pos;
+	b->cur_pos = -1;
+
 	start_undo_chain(b);
 
-	if (y > b->block_start_line) {
-		for(int64_t i = y; i >= b->block_start_line; i--) {
-			const int64_t start_pos = calc_pos(ld, start_x, b->opt.tab_size, b->encoding);
-			const int64_t len = calc_pos(ld, end_x, b->opt.tab_size, b->encoding) - start_pos;
-			delete_stream(b, ld, i, start_pos, len);
-			ld = (line_desc *)ld->ld_node.prev;
-		}
-		if (update) update_syntax_states_delay(b, (line_desc *)ld->ld_node.next, b->cur_line_desc);
-	}
-	else {
-		for(int64_t i = y; i <= b->block_start_line; i++) {
-			const int64_t start_pos = calc_pos(ld, start_x, b->opt.tab_size, b->encoding);
-			const int64_t len = calc_pos(ld, end_x, b->opt.tab_size, b->encoding)-start_pos;
-			delete_stream(b, ld, i, start_pos, len);
-			ld = (line_desc *)ld->ld_node.next;
-		}
-		if (update) update_syntax_states_delay(b, b->cur_line_desc, (line_desc *)ld->ld_node.prev);
-	}
+	line_desc *bottom_ld;
+	rect_walk(b, &r, NULL, true, &bottom_ld);
+	if (update) update_syntax_states_delay(b, r.top_ld, bottom_ld);
 
 	end_undo_chain(b);
 
@@ -545,26 +681,66 @@ int erase_vert_block(buffer *b, const bool update) {
 }
 
 
+/* Returns the first position of ld at which the TAB-expanded width of the
+   line is at least x, or the line length if there is no such position; the
+   width up to the returned position is stored in *width. */
+
+static int64_t paste_pos(const buffer * const b, const line_desc * const ld, const int64_t x, int64_t * const width) {
+	col_checkpoint cp = { 0 };
+	if (ld->line_len >= COL_INDEX_MIN_LEN && x > COL_INDEX_STEP) col_index_by_width(ld, x, b->opt.tab_size, b->encoding, &cp);
+
+	int64_t pos = cp.pos, w = cp.width;
+	while(pos < ld->line_len && w < x) {
+		/* Characters in an US-ASCII run have width one. */
+		const int64_t run = ascii_run(ld->line + pos, min(ld->line_len - pos, x - w));
+		w += run;
+		if ((pos += run) >= ld->line_len || w >= x) break;
+		if (ld->line[pos] != '\t') w += get_char_width(&ld->line[pos], b->encoding);
+		else w += b->opt.tab_size - w % b->opt.tab_size;
+		pos = next_pos(ld->line, pos, b->encoding);
+	}
+
+	*width = w;
+	return pos;
+}
+
 
 /* Performs a vertical paste. It has to be done via an insert_stream() for each
-   string of the clip. Again, the undo linking feature makes all these
-   operations a single undo step. */
+   string of the clip; when a line is too short, the missing spaces are
+   inserted together with the string. Again, the undo linking feature makes
+   all these operations a single undo step. */
 
 int paste_vert_to_buffer(buffer *b, int n) {
 
 	line_desc * ld = b->cur_line_desc;
 	clip_desc * const cd = get_nth_clip(n);
 	if (!cd) return CLIP_DOESNT_EXIST;
+
+	int error = materialize_clip(cd);
+	if (error) return error;
 	if (!cd->cs->len) return OK;
 
 	if (cd->cs->encoding != ENC_ASCII && b->encoding != ENC_ASCII && cd->cs->encoding != b->encoding) return INCOMPATIBLE_CLIP_ENCODING;
 	if (b->encoding == ENC_ASCII) b->encoding = cd->cs->encoding;
 
 	char * const stream = cd->cs->stream;
-	char *p = stream;
+	char *p = stream, *padded = NULL;
 	const int64_t stream_len = cd->cs->len;
-	const uint64_t x = b->cur_x + b->win_x;
-	int64_t line = b->cur_line;
+	const int64_t x = b->cur_x + b->win_x;
+	int64_t line = b->cur_line, padded_size = 0;
+
+	/* If the lines we modify have no free space around them, they are moved
+	   elsewhere, so we reserve enough characters for all of them. */
+
+	int64_t reserve = 0;
+	const line_desc *t = ld;
+	for(const char *q = stream; q - stream < stream_len;) {
+		const int64_t len = strnlen_ne(q, stream_len - (q - stream));
+		if (len) reserve += max(t->ld_node.next ? t->line_len : 0, x) + len;
+		if (t->ld_node.next) t = (line_desc *)t->ld_node.next;
+		q += len + 1;
+	}
+	reserve_chars(b, reserve);
 
 	start_undo_chain(b);
 
@@ -576,31 +752,42 @@ int paste_vert_to_buffer(buffer *b, int n) {
 
 		const int64_t len = strnlen_ne(p, stream_len - (p - stream));
 		if (len) {
-			uint64_t pos, n;
-			for(n = pos = 0; pos < ld->line_len && n < x; pos = next_pos(ld->line, pos, b->encoding)) {
-				if (ld->line[pos] == '\t') n += b->opt.tab_size - n % b->opt.tab_size;
-				else n += get_char_width(&ld->line[pos], b->encoding);
+			int64_t width;
+			const int64_t pos = paste_pos(b, ld, x, &width);
+
+			if (pos == ld->line_len && width < x) {
+				/* We miss x - width characters after the end of the line. */
+				const int64_t spaces = x - width;
+				if (padded_size < spaces + len) {
+					char * const t = realloc(padded, spaces + len);
+					if (!t) {
+						error = OUT_OF_MEMORY;
+						break;
+					}
+					padded = t;
+					padded_size = spaces + len;
+				}
+				memset(padded, ' ', spaces);
+				memcpy(padded + spaces, p, len);
+				error = insert_stream(b, ld, line, pos, padded, spaces + len);
 			}
+			else error = insert_stream(b, ld, line, pos, p, len);
 
-			if (pos == ld->line_len && n < x) {
-				/* We miss x - n characters after the end of the line. */
-				insert_spaces(b, ld, line, ld->line_len, x - n);
-				insert_stream(b, ld, line, ld->line_len, p, len);
-			}
-			else insert_stream(b, ld, line, pos, p, len);
+			if (error) break;
 		}
 
 		p += len + 1;
 		ld = (line_desc *)ld->ld_node.next;
 		line++;
 	}
-	
+
+	free(padded);
+	reserve_chars(b, 0);
 	end_undo_chain(b);
 	update_syntax_states_delay(b, b->cur_line_desc, ld);
-	return OK;
+	return error;
 }
 
-
 /* Loads a clip. It is just a load_stream, plus an insertion in the clip
    list. If preserve_cr is true, CRs are preserved. */
 
@@ -611,6 +798,7 @@ int load_clip(int n, const char *name, const bool preserve_cr, const bool binary
 		add_head(&clips, &cd->cd_node);
 	}
 
+	release_clip(cd);
 	const int error = load_stream(cd->cs, name, preserve_cr, binary) ? OK : CANT_OPEN_FILE;
 
 	if (error == OK) set_stream_encoding(cd->cs, ENC_ASCII);
@@ -625,5 +813,7 @@ int load_clip(int n, const char *name, const bool preserve_cr, const bool binary
 int save_clip(int n, const char *name, const bool CRLF, const bool binary) {
 	clip_desc * const cd = get_nth_clip(n);
 	if (!cd) return CLIP_DOESNT_EXIST;
+	const int error = materialize_clip(cd);
+	if (error) return error;
 	return save_stream(cd->cs, name, CRLF, binary);
 }
@@ -68,6 +68,7 @@ static const command commands[ACTION_COUNT] = {
 	{ NAHL(AUTOINDENT    ),                           IS_OPTION                                   },
 	{ NAHL(AUTOMATCHBRACKET),                         IS_OPTION                                   },
 	{ NAHL(AUTOPREFS     ),                           IS_OPTION                                   },
+	{ NAHL(AUTORELOAD    ),                           IS_OPTION                                   },
 	{ NAHL(BACKSPACE     ),0                                                                      },
 	{ NAHL(BEEP          ), NO_ARGS                                                               },
 	{ NAHL(BINARY        ),                           IS_OPTION                                   },
@@ -97,6 +98,7 @@ static const command commands[ACTION_COUNT] = {
 	{ NAHL(FINDREGEXP    ),           ARG_IS_STRING                                               },
 	{ NAHL(FLAGS         ), NO_ARGS |                             DO_NOT_RECORD                   },
 	{ NAHL(FLASH         ), NO_ARGS                                                               },
+	{ NAHL(FOLLOW        ),0                                                                      },
 	{ NAHL(FREEFORM      ),                           IS_OPTION                                   },
 	{ NAHL(GOTOBOOKMARK  ),           ARG_IS_STRING |                             EMPTY_STRING_OK },
 	{ NAHL(GOTOCOLUMN    ),0                                                                      },
@@ -177,8 +179,10 @@ static const command commands[ACTION_COUNT] = {
 	{ NAHL(SETBOOKMARK   ),           ARG_IS_STRING |                             EMPTY_STRING_OK },
 	{ NAHL(SHIFT         ),           ARG_IS_STRING |                             EMPTY_STRING_OK },
 	{ NAHL(SHIFTTABS     ),                           IS_OPTION                                   },
+	{ NAHL(SORTLINES     ), NO_ARGS                                                               },
 	{ NAHL(STATUSBAR     ),                           IS_OPTION                                   },
 	{ NAHL(SUSPEND       ), NO_ARGS                                                               },
+	{ NAHL(SYNCSAVE      ),                           IS_OPTION                                   },
 	{ NAHL(SYNTAX        ),           ARG_IS_STRING | IS_OPTION                                   },
 	{ NAHL(SYSTEM        ),           ARG_IS_STRING                                               },
 	{ NAHL(TABS          ),                           IS_OPTION                                   },
@@ -191,6 +195,9 @@ static const command commands[ACTION_COUNT] = {
 	{ NAHL(TURBO         ),                           IS_OPTION                                   },
 	{ NAHL(UNDELLINE     ),0                                                                      },
 	{ NAHL(UNDO          ),0                                                                      },
+	{ NAHL(UNDOJOURNAL   ),                           IS_OPTION                                   },
+	{ NAHL(UNDOMEMORY    ),                           IS_OPTION                                   },
+	{ NAHL(UNIQLINES     ), NO_ARGS                                                               },
 	{ NAHL(UNLOADMACROS  ), NO_ARGS                                                               },
 	{ NAHL(UNSETBOOKMARK ),           ARG_IS_STRING |                             EMPTY_STRING_OK },
 	{ NAHL(UTF8          ),                           IS_OPTION                                   },
@@ -369,6 +376,7 @@ void free_macro_desc(macro_desc *md) {
 
 	free(md->name);
 	free_char_stream(md->cs);
+	release_compiled_macro(md->cm);
 	free(md);
 }
 
@@ -497,36 +505,129 @@ void optimize_macro(char_stream *cs, bool verbose) {
 }
 
 
-/* This function is the ultimate goal of this file. It plays a character
-   stream, considering each line as a command line. It polls the global stop
-   variable in order to check for the user interrupting. Note that the macro is
-   duplicated before execution: this is absolutely necessary, for otherwise a
-   call to CloseDoc, Record or UnloadMacros could free() the block of memory
-   which we are executing. */
+/* Compiles a macro: each command line is parsed once, so that repeated
+   executions need not parse it again. The source stream is duplicated: this
+   is absolutely necessary, for otherwise a call to CloseDoc, Record or
+   UnloadMacros could free() the block of memory which we are executing.
+   Command lines are always parsed as if all commands could be executed;
+   when this is not the case, run_compiled_macro() uses options_error. The
+   result has a reference count of one, and must be released with
+   release_compiled_macro(). Returns NULL if we run out of memory. */
 
-int play_macro(buffer *b, char_stream *cs) {
-	if (!cs) return ERROR;
+compiled_macro *compile_macro(const char_stream * const cs) {
+	compiled_macro * const cm = calloc(1, sizeof *cm);
+	if (!cm) return NULL;
+	cm->refs = 1;
 
 	/* If len is 0 or 1, the character stream does not contain anything. */
-	const int64_t len = cs->len;
-	if (len < 2) return OK;
+	const int64_t len = cs && cs->len >= 2 ? cs->len : 0;
+
+	if (!(cm->source = malloc(len + 1)) || !(cm->strings = alloc_char_stream(0))) {
+		release_compiled_macro(cm);
+		return NULL;
+	}
+	memcpy(cm->source, cs ? cs->stream : "", len);
+	cm->source[len] = 0;
+
+	for(int64_t pos = 0; pos < len; pos += strlen(&cm->source[pos]) + 1) cm->count++;
+	if (cm->count && !(cm->cmd = malloc(cm->count * sizeof *cm->cmd))) {
+		release_compiled_macro(cm);
+		return NULL;
+	}
+
+	int64_t pos = 0;
+	for(macro_cmd *mc = cm->cmd; mc < cm->cmd + cm->count; mc++) {
+		const char * const line = &cm->source[pos];
+		char *p;
+		mc->line = pos;
+		mc->string_arg = -1;
+		mc->encoding = detect_encoding(line, strlen(line));
+		mc->a = parse_command_line(line, &mc->num_arg, &p, false);
+
+		if (mc->a >= 0) {
+			const char *q = line;
+			while(isasciispace(*q)) q++;
+			/* Comments and empty lines are executed anyway. */
+			mc->options_error = isalpha((unsigned char)*q) && !(commands[mc->a].flags & IS_OPTION) ? CAN_EXECUTE_ONLY_OPTIONS : OK;
+		}
+		else {
+			int64_t n;
+			mc->options_error = -parse_command_line(line, &n, &p, true);
+			if (mc->options_error <= 0) mc->options_error = CAN_EXECUTE_ONLY_OPTIONS;
+		}
+
+		if (p) {
+			mc->string_arg = cm->strings->len;
+			const int error = add_to_stream(cm->strings, p, strlen(p) + 1);
+			free(p);
+			if (error) {
+				release_compiled_macro(cm);
+				return NULL;
+			}
+		}
+
+		pos += strlen(line) + 1;
+	}
+
+	return cm;
+}
+
+
+/* Releases a reference to a compiled macro, freeing it when no references
+   are left. */
+
+void release_compiled_macro(compiled_macro * const cm) {
+	if (!cm || --cm->refs > 0) return;
 
-	char * const stream = malloc(len);
-	if (!stream) return OUT_OF_MEMORY;
-	char * p = stream;
+	free(cm->cmd);
+	free(cm->source);
+	free_char_stream(cm->strings);
+	free(cm);
+}
+
+
+/* Executes a compiled command line. Standard error codes are returned. As
+   in execute_command_line(), if the command is unknown we try to execute a
+   macro with the same name. */
+
+static int execute_macro_cmd(buffer * const b, const compiled_macro * const cm, const macro_cmd * const mc) {
+	if (b->encoding != ENC_ASCII && mc->encoding != ENC_ASCII && b->encoding != mc->encoding) return INCOMPATIBLE_COMMAND_ENCODING;
+
+	const int error = b->exec_only_options ? mc->options_error : mc->a < 0 ? -mc->a : OK;
+	if (error == NO_SUCH_COMMAND) {
+		const int macro_error = execute_macro(b, &cm->source[mc->line]);
+		return macro_error == CANT_OPEN_MACRO ? NO_SUCH_COMMAND : macro_error;
+	}
+	if (error) return error;
+
+	/* do_action() consumes its string argument. */
+	char *p = NULL;
+	if (mc->string_arg >= 0 && !(p = str_dup(&cm->strings->stream[mc->string_arg]))) return OUT_OF_MEMORY;
+	return do_action(b, mc->a, mc->num_arg, p);
+}
+
+
+/* This function is the ultimate goal of this file. It plays a compiled
+   macro. It polls the global stop variable in order to check for the user
+   interrupting. We hold a reference to the compiled macro during its
+   execution, which happens in a deferred-display context. */
 
-	memcpy(stream, cs->stream, len);
+int run_compiled_macro(buffer *b, compiled_macro * const cm) {
+	if (!cm) return ERROR;
+
+	cm->refs++;
 
 	stop = false;
 
 	b->executing_macro = 1;
+	defer_display(true);
 	int error = OK;
-	while(!stop && p - stream < len) {	
+	for(const macro_cmd *mc = cm->cmd; !stop && mc < cm->cmd + cm->count; mc++) {
 #ifdef NE_TEST
-		fprintf(stderr, "%s\n", p); /* During tests, we output to stderr the current command. */
+		fprintf(stderr, "%s\n", &cm->source[mc->line]); /* During tests, we output to stderr the current command. */
 #endif
 
-		if (error = execute_command_line(b, p))
+		if (error = execute_macro_cmd(b, cm, mc))
 #ifndef NE_TEST
 			break /* During tests, we never interrupt a macro. */
 #endif
@@ -536,15 +637,32 @@ int play_macro(buffer *b, char_stream *cs) {
 		refresh_window(cur_buffer);
 		draw_status_bar();
 #endif
-		p += strlen(p) + 1;
 	}
 
-	free(stream);
+	defer_display(false);
+	release_compiled_macro(cm);
 
 	return stop ? STOPPED : error;
 }
 
 
+/* Plays a character stream, considering each line as a command line. The
+   stream is compiled and then executed just once; callers executing the
+   same stream repeatedly should use compile_macro() and
+   run_compiled_macro() directly. */
+
+int play_macro(buffer *b, char_stream *cs) {
+	if (!cs) return ERROR;
+
+	compiled_macro * const cm = compile_macro(cs);
+	if (!cm) return OUT_OF_MEMORY;
+
+	const int error = run_compiled_macro(b, cm);
+	release_compiled_macro(cm);
+	return error;
+}
+
+
 
 /* Loads a macro, and puts it in the global macro hash table.  file_part is
    applied to the name argument before storing it and hashing it.  Note that if
@@ -625,7 +743,8 @@ int execute_macro(buffer *b, const char *name) {
 			add_to_stream(b->cur_macro, "# include macro ", 16);
 			add_to_stream(b->cur_macro, md->name, strlen(md->name)+1);
 		}
-		h = play_macro(b, md->cs);
+		if (!md->cm) md->cm = compile_macro(md->cs);
+		h = md->cm ? run_compiled_macro(b, md->cm) : OUT_OF_MEMORY;
 		if (b->recording) {
 			add_to_stream(b->cur_macro, "# conclude macro ", 17);
 			add_to_stream(b->cur_macro, md->name, strlen(md->name)+1);
@@ -33,10 +33,25 @@
    function should be called whenever the screen has to be sync'd with its
    contents (for instance, whenever the user gets back in control). The
    mechanism allows for fast, responsive screen updates for short operations,
-   and one-in-all updates for long operations. */
+   and one-in-all updates for long operations.
 
+   While executing macros the display is deferred: TURBO is negative, so
+   updates just record the range of lines to be refreshed, and the screen is
+   repainted once, by the first call to refresh_window() after the outermost
+   macro has completed.
 
-#define TURBO (turbo ? turbo : ne_lines * 2)
+   Syntax states, on the contrary, are not deferred: update_syntax_states()
+   still propagates them eagerly, but only until they converge, which is
+   usually after a line or two. Recording a pending range instead would not
+   be safe, as the line descriptors delimiting it can be freed by later
+   edits, and actions rely on b->next_state being current. */
+
+
+/* The number of nested deferred-display contexts. */
+
+static int deferred_display;
+
+#define TURBO (deferred_display ? -1 : turbo ? turbo : ne_lines * 2)
 
 
 /* If true, the current line has changed and care must be taken to update the initial state of the following lines. */
@@ -65,6 +80,16 @@ void delay_update() {
 }
 
 
+/* Enters or leaves a deferred-display context. Contexts can be nested; no
+   update is performed until the outermost one is left. Requesters and
+   explicit calls to refresh_window() still update the screen. */
+
+void defer_display(const bool defer) {
+	if (defer) deferred_display++;
+	else if (deferred_display > 0) deferred_display--;
+}
+
+
 /* Compares two highlight states for equality. */
 
 int highlight_cmp(HIGHLIGHT_STATE *x, HIGHLIGHT_STATE *y) {
@@ -678,7 +703,7 @@ void reset_window(void) {
    interact, so that he is presented with a correctly updated display. */
 
 void refresh_window(buffer * const b) {
-	if (window_needs_refresh) {
+	if (window_needs_refresh && !batch_mode) {
 		line_desc *ld = b->top_line_desc;
 		for(int i = first_line; i-- != 0 && (line_desc *)ld->ld_node.next;) ld = (line_desc *)ld->ld_node.next;
 		if (ld->ld_node.next) update_window_lines(b, ld, first_line, last_line, true);
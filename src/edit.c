@@ -21,6 +21,8 @@
 
 #include "ne.h"
 #include "support.h"
+#include <pthread.h>
+#include <signal.h>
 
 /* The number of type of brackets we recognize. */
 #define NUM_BRACKETS 5
@@ -122,6 +124,128 @@ int capitalize(buffer *b) {
 
 
 
+/* The brackets we recognize, as opening/closing pairs. */
+
+static const unsigned char bracket_table[NUM_BRACKETS][2] = { { '(', ')'  },
+                                                              { '[', ']'  },
+                                                              { '{', '}'  },
+                                                              { '<', '>'  },
+                                                              { '`', '\'' } };
+
+
+/* The bracket index of a buffer. Finding the bracket matching a given one may
+   require scanning a large part of the buffer, so we divide the buffer into
+   blocks of BRACKET_BLOCK_LINES lines, and record for each block and each
+   kind of bracket the net depth change (opening minus closing brackets) and
+   the minimum depth reached within the block. A block in which the depth
+   cannot get back to zero is then skipped as a whole, in either direction.
+
+   Block summaries are computed lazily. Edits within a line just mark the
+   summary of its block as dirty, whereas edits changing the number of lines
+   invalidate the whole index, which is rebuilt (by a mere walk of the line
+   list) at the next search. Since brackets are US-ASCII, we can scan bytes
+   regardless of the encoding. */
+
+#define BRACKET_BLOCK_LINES 128
+
+/* The index is used only if the search spans at least this number of lines. */
+
+#define BRACKET_INDEX_MIN_LINES (16 * BRACKET_BLOCK_LINES)
+
+struct bracket_block {
+	line_desc *ld;                   /* The first line of the block. */
+	bool dirty;                      /* Whether net and min_depth must be recomputed. */
+	int64_t net[NUM_BRACKETS];       /* The net depth change across the block. */
+	int64_t min_depth[NUM_BRACKETS]; /* The minimum depth within the block (at most zero). */
+};
+
+struct bracket_index {
+	bool valid;
+	int64_t num_blocks, alloc_blocks;
+	struct bracket_block *block;
+};
+
+
+/* Records that line has been modified; lines_changed is true if lines have
+   been inserted or deleted. */
+
+void bracket_index_modify(buffer * const b, const int64_t line, const bool lines_changed) {
+	struct bracket_index * const bi = b->bracket_index;
+	if (!bi || !bi->valid) return;
+	if (lines_changed) bi->valid = false;
+	else bi->block[line / BRACKET_BLOCK_LINES].dirty = true;
+}
+
+
+void free_bracket_index(buffer * const b) {
+	if (!b->bracket_index) return;
+	free(b->bracket_index->block);
+	free(b->bracket_index);
+	b->bracket_index = NULL;
+}
+
+
+/* Returns the bracket index of b, (re)building it if necessary, or NULL if
+   we run out of memory. */
+
+static struct bracket_index *get_bracket_index(buffer * const b) {
+	struct bracket_index *bi = b->bracket_index;
+	if (!bi && !(bi = b->bracket_index = calloc(1, sizeof *bi))) return NULL;
+	if (bi->valid) return bi;
+
+	const int64_t num_blocks = (b->num_lines + BRACKET_BLOCK_LINES - 1) / BRACKET_BLOCK_LINES;
+	if (bi->alloc_blocks < num_blocks) {
+		struct bracket_block * const p = realloc(bi->block, num_blocks * sizeof *p);
+		if (!p) return NULL;
+		bi->block = p;
+		bi->alloc_blocks = num_blocks;
+	}
+
+	line_desc *ld = (line_desc *)b->line_desc_list.head;
+	for(int64_t k = 0; k < num_blocks; k++) {
+		bi->block[k].ld = ld;
+		bi->block[k].dirty = true;
+		for(int64_t i = 0; i < BRACKET_BLOCK_LINES && ld->ld_node.next; i++) ld = (line_desc *)ld->ld_node.next;
+	}
+
+	bi->num_blocks = num_blocks;
+	bi->valid = true;
+	return bi;
+}
+
+
+/* Returns the kth block of the given bracket index, computing its summary if
+   necessary. */
+
+static const struct bracket_block *get_bracket_block(struct bracket_index * const bi, const int64_t k) {
+	struct bracket_block * const bb = &bi->block[k];
+	if (!bb->dirty) return bb;
+
+	/* The kind of each byte: 0 for non-brackets, i + 1 for the opening bracket
+	   of the ith pair, -i - 1 for the closing one. */
+	static signed char kind[256];
+	if (!kind['(']) for(int i = 0; i < NUM_BRACKETS; i++) {
+		kind[bracket_table[i][0]] = i + 1;
+		kind[bracket_table[i][1]] = -i - 1;
+	}
+
+	int64_t depth[NUM_BRACKETS] = { 0 }, min_depth[NUM_BRACKETS] = { 0 };
+	const line_desc *ld = bb->ld;
+	for(int64_t i = 0; i < BRACKET_BLOCK_LINES && ld->ld_node.next; i++, ld = (line_desc *)ld->ld_node.next) {
+		for(int64_t pos = 0; pos < ld->line_len; pos++) {
+			const int t = kind[(unsigned char)ld->line[pos]];
+			if (t > 0) depth[t - 1]++;
+			else if (t < 0 && --depth[-t - 1] < min_depth[-t - 1]) min_depth[-t - 1] = depth[-t - 1];
+		}
+	}
+
+	memcpy(bb->net, depth, sizeof depth);
+	memcpy(bb->min_depth, min_depth, sizeof min_depth);
+	bb->dirty = false;
+	return bb;
+}
+
+
 /* Finds which bracket matches the bracket under the cursor, and moves it
    there. Various error codes can be returned. */
 
@@ -135,19 +259,18 @@ int match_bracket(buffer *b) {
 	return rc;
 }
 
-int find_matching_bracket(buffer *b, const int64_t min_line, int64_t max_line, int64_t *match_line, int64_t *match_pos, int *c, line_desc ** match_ld) {
 
-	static unsigned char bracket_table[NUM_BRACKETS][2] = { { '(', ')'  },
-	                                                        { '[', ']'  },
-	                                                        { '{', '}'  },
-	                                                        { '<', '>'  },
-	                                                        { '`', '\'' } };
+/* Finds the bracket matching the one under the cursor, searching only between
+   min_line and max_line. On long searches, the bracket index is used to skip
+   blocks of lines. */
+
+int find_matching_bracket(buffer *b, const int64_t min_line, int64_t max_line, int64_t *match_line, int64_t *match_pos, int *c, line_desc ** match_ld) {
 
 	line_desc *ld = b->cur_line_desc;
 
 	if (b->cur_pos >= ld->line_len) return NOT_ON_A_BRACKET;
 
-	int i, j, dir;
+	int i, j;
 	for(i = 0; i < NUM_BRACKETS; i++) {
 		for(j = 0; j < 2; j++)
 			if (ld->line[b->cur_pos] == bracket_table[i][j]) break;
@@ -156,20 +279,20 @@ int find_matching_bracket(buffer *b, const int64_t min_line, int64_t max_line, i
 
 	if (i == NUM_BRACKETS && j == 2) return NOT_ON_A_BRACKET;
 
-	if (j) dir = -1;
-	else dir = 1;
+	const int dir = j ? -1 : 1;
+	const char same = bracket_table[i][j], other = bracket_table[i][1 - j];
+	struct bracket_index * const bi = max_line - min_line >= BRACKET_INDEX_MIN_LINES ? get_bracket_index(b) : NULL;
 
-	int n = 0;
-	int64_t pos = b->cur_pos, y = b->cur_line;
+	int64_t n = 0, pos = b->cur_pos, y = b->cur_line;
 
 	while(ld->ld_node.next && ld->ld_node.prev && y >= min_line && y <= max_line) {
 
 		if (pos >= 0) {
-			char * const line = ld->line;
+			const char * const line = ld->line;
 			while(pos >= 0 && pos < ld->line_len) {
 
-				if (line[pos] == bracket_table[i][j]) n++;
-				else if (line[pos] == bracket_table[i][1 - j]) n--;
+				if (line[pos] == same) n++;
+				else if (line[pos] == other) n--;
 
 				if (n == 0) {
 					*match_line = y;
@@ -178,13 +301,40 @@ int find_matching_bracket(buffer *b, const int64_t min_line, int64_t max_line, i
 					if (match_ld) *match_ld = ld;
 					return OK;
 				}
-				if (dir > 0) pos = next_pos(line, pos, b->encoding);
-				else pos = prev_pos(line, pos, b->encoding);
+				pos += dir;
 			}
 		}
 
 		pos = -1;
 
+		/* When we are about to enter a block of the index that lies entirely
+		   within the search range, we skip it if the depth cannot get back to
+		   zero within it. In this case, ld and y are moved to the last line of
+		   the block in the search direction. */
+
+		if (bi) {
+			if (dir > 0) {
+				for(int64_t k = (y + 1) / BRACKET_BLOCK_LINES; (y + 1) % BRACKET_BLOCK_LINES == 0 && k < bi->num_blocks && y + BRACKET_BLOCK_LINES <= max_line; k++) {
+					const struct bracket_block * const bb = get_bracket_block(bi, k);
+					if (n + bb->min_depth[i] <= 0) break;
+					n += bb->net[i];
+					y += BRACKET_BLOCK_LINES;
+					ld = k + 1 < bi->num_blocks ? (line_desc *)bi->block[k + 1].ld->ld_node.prev : (line_desc *)b->line_desc_list.tail_pred;
+				}
+			}
+			else {
+				/* Scanning backwards, the depth (with respect to closing brackets)
+					decreases at most by net - min_depth. */
+				for(int64_t k = y / BRACKET_BLOCK_LINES - 1; y % BRACKET_BLOCK_LINES == 0 && k >= 0 && y - BRACKET_BLOCK_LINES >= min_line; k--) {
+					const struct bracket_block * const bb = get_bracket_block(bi, k);
+					if (n - (bb->net[i] - bb->min_depth[i]) <= 0) break;
+					n -= bb->net[i];
+					y -= BRACKET_BLOCK_LINES;
+					ld = bb->ld;
+				}
+			}
+		}
+
 		if (dir == 1) {
 			ld = (line_desc *)ld->ld_node.next;
 			if (ld->ld_node.next && ld->line) pos = 0;
@@ -564,13 +714,17 @@ int auto_indent_line(buffer * const b, const int64_t line, line_desc * const ld,
 }
 
 
-/* Shift a block of lines left or right with whitespace adjustments. */
+/* Shift a block of lines left or right with whitespace adjustments. The
+   block is scanned once (twice when shifting left, as we first check that
+   there is enough whitespace), without moving the cursor; the new
+   whitespace of each line is computed in advance, and applied with at most
+   one deletion and one insertion. */
 
 int shift(buffer * const b, char *p, char *msg, int msg_size) {
 	const bool use_tabs = b->opt.tabs && b->opt.shift_tabs;
-	const int64_t init_line = b->cur_line, init_pos = b->cur_pos, init_y = b->cur_y;
+	const int tab_size = b->opt.tab_size;
+	const int64_t init_line = b->cur_line, init_pos = b->cur_pos;
 
-	line_desc *ld = NULL, *start_line_desc = NULL;
 	int64_t shift_size = 1;
 	char dir = '>';
 	int shift_mag = b->opt.tab_size, rc = 0;
@@ -605,39 +759,35 @@ int shift(buffer * const b, char *p, char *msg, int msg_size) {
 		last_line  = max(b->block_start_line, b->cur_line);
 	}
 
+	line_desc * const start_line_desc = nth_line_desc(b, first_line);
+	line_desc *ld;
+	int64_t line;
+
 	/* If we're shifting left (dir=='<'), verify that we have sufficient white space
-	   to remove on all the relevant lines before making any changes, i. */
+	   to remove on all the relevant lines before making any changes. */
 
 	if (dir == '<') {
 		shift_size = -shift_size; /* signed shift_size now also indicates direction. */
-		for (int64_t line = first_line; !rc && line <= last_line; line++) {
-			int64_t pos;
-			goto_line(b, line);
-			pos = calc_pos(b->cur_line_desc, left_col, b->opt.tab_size, b->encoding);
-			while (pos < b->cur_line_desc->line_len &&
-			       left_col - calc_width(b->cur_line_desc, pos, b->opt.tab_size, b->encoding) > shift_size) {
-				if (isasciispace(b->cur_line_desc->line[pos]))
-					pos = next_pos(b->cur_line_desc->line, pos, b->encoding);
-				else {
+		for (line = first_line, ld = start_line_desc; !rc && line <= last_line; line++, ld = (line_desc *)ld->ld_node.next) {
+			int64_t pos = left_col ? calc_pos(ld, left_col, tab_size, b->encoding) : 0;
+			int64_t w = pos ? calc_width(ld, pos, tab_size, b->encoding) : 0;
+			while (pos < ld->line_len && w < left_col - shift_size) {
+				if (!isasciispace(ld->line[pos])) {
 					rc = INSUFFICIENT_WHITESPACE;
 					break;
 				}
+				w += ld->line[pos++] == '\t' ? tab_size - w % tab_size : 1;
 			}
 		}
 	}
 
-
 	if (!rc) {
+		char *ins = NULL;
+		int64_t ins_size = 0;
+
 		start_undo_chain(b);
-		for (int64_t line = first_line; line <= last_line; line++) {
-			int64_t pos, c_pos, c_col_orig, offset;
-			b->attr_len = -1;
-			goto_line(b, line);
-			b->cur_pos = -1;
-			ld = b->cur_line_desc;
-			if (line == first_line) start_line_desc = ld;
-			pos = calc_pos(ld, left_col, b->opt.tab_size, b->encoding);
-			/* If left_col is in the middle of a tab, pos will be on that tab. */
+		b->attr_len = -1;
+		for (line = first_line, ld = start_line_desc; !stop && line <= last_line; line++, ld = (line_desc *)ld->ld_node.next) {
 			/* whitespace adjustment strategy:
 			   1. Starting from left_col, advance to the right to the first non-blank character C.
 			   2. Note C's col. The desired new column is this value +/- shift_size.
@@ -647,71 +797,314 @@ int shift(buffer * const b, char *p, char *msg, int msg_size) {
 			        if C's col is too far to the right,
 			          if we're on a space, delete it;
 			          else if there's a tab to our left, delete it;
-			          else we should not have started, because it's not possible!
+			          else give up on this line;
 			        if C's col is too far to the left,
 			           if its needs to be beyond the next tab stop,
 			             insert a tab and move right;
-			           else insert a space. */
-			/* 1. */
-			while (pos < ld->line_len && isasciispace(ld->line[pos]))
-				pos = next_pos(ld->line, pos, b->encoding);
+			           else insert a space.
+			   Since only spaces lie between the transition point and C, we just keep track of
+			   the width at the transition point and of the number of spaces to delete. */
+			/* 1. If left_col is in the middle of a tab, pos will be on that tab. */
+			int64_t pos = left_col ? calc_pos(ld, left_col, tab_size, b->encoding) : 0;
+			int64_t w = pos ? calc_width(ld, pos, tab_size, b->encoding) : 0;
+			while (pos < ld->line_len && isasciispace(ld->line[pos])) w += ld->line[pos++] == '\t' ? tab_size - w % tab_size : 1;
 			if (pos >= ld->line_len) continue; /* We ran off the end of the line. */
-			/* line[pos] should be the first non-blank character. */
 			/* 2. */
-			c_pos = pos;
-			c_col_orig = calc_width(ld, c_pos, b->opt.tab_size, b->encoding);
+			const int64_t target = w + shift_size;
 			/* 3. */
-			while (pos && ld->line[pos-1] == ' ')
-				pos = prev_pos(ld->line, pos, b->encoding);
-			/* If pos is non-zero, it should be on a blank, with only blanks between here and c_pos. */
+			int64_t spaces = 0;
+			while (pos && ld->line[pos - 1] == ' ') pos--, spaces++;
+			w -= spaces;
 			/* 4. */
-			/* offset = how_far_we_have_moved - how_far_we_want_to_move. */
-			while (!stop && (offset = calc_width(ld, c_pos, b->opt.tab_size, b->encoding)-c_col_orig - shift_size)) {
-				if (offset > 0) { /* still too far right; remove whitespace */
-					if (ld->line[pos] == ' ') {
-						delete_stream(b, ld, b->cur_line, pos, 1);
-						c_pos--;
-					}
-					else if (pos) { /* should be a tab just to our left */
-						pos = prev_pos(ld->line, pos, b->encoding); /* now we're on the tab */
-						if (ld->line[pos] == '\t') {
-							delete_stream(b, ld, b->cur_line, pos, 1);
-							c_pos--;
-						}
-						else break; /* Should have been a tab. This should never happen! Give up on this line and go mangle the next one. */
-					}
-					else break; /* This should never happen; give up on this line and go mangle the next one. */
+			int64_t del_spaces = 0, del_tabs = 0, n = 0;
+			while (w + spaces - del_spaces > target) {
+				if (del_spaces < spaces) del_spaces++;
+				else if (pos - del_tabs > 0 && ld->line[pos - del_tabs - 1] == '\t') {
+					del_tabs++;
+					w = calc_width(ld, pos - del_tabs, tab_size, b->encoding);
 				}
-				else if (offset < 0) { /* too far left; insert whitespace */
-					char c = ' ';
-					if (use_tabs && (b->opt.tab_size - calc_width(ld, pos, b->opt.tab_size, b->encoding) % b->opt.tab_size) <= -offset )
-						c = '\t';
-					if (insert_one_char(b, ld, b->cur_line, pos, c)) {
+				else break; /* This should never happen; give up on this line and go mangle the next one. */
+			}
+			while (w + spaces - del_spaces < target) {
+				const int64_t tab_width = tab_size - w % tab_size;
+				if (n == ins_size) {
+					char * const t = realloc(ins, ins_size = ins_size * 2 + 64);
+					if (!t) {
+						rc = OUT_OF_MEMORY;
 						break;
 					}
-					pos++;
-					c_pos++;
+					ins = t;
+				}
+				if (use_tabs && tab_width <= target - (w + spaces - del_spaces)) {
+					ins[n++] = '\t';
+					w += tab_width;
+				}
+				else {
+					ins[n++] = ' ';
+					w++;
 				}
 			}
+			if (rc) break;
+
+			if (del_tabs + del_spaces) delete_stream(b, ld, line, pos - del_tabs, del_tabs + del_spaces);
+			if (n) insert_stream(b, ld, line, pos - del_tabs, ins, n);
 		}
 		end_undo_chain(b);
+		free(ins);
+
 		if (b->syn) {
-			b->attr_len = -1;
 			need_attr_update = true;
-			update_syntax_states(b, -1, start_line_desc, (line_desc *)ld->ld_node.next);
+			update_syntax_states(b, -1, start_line_desc, ld);
 		}
 		update_window_lines(b, b->top_line_desc, 0, ne_lines - 2, false);
 	}
 
-	/* put the screen back where way we found it. */
+	/* The cursor line might have changed. */
+	b->cur_pos = -1;
 	goto_line_pos(b, init_line, init_pos);
 	delay_update();
-	const int64_t avshift = b->cur_y - init_y;
-	if (avshift) {
-		snprintf(msg, msg_size, "%c%" PRId64, avshift > 0 ? 'T' :'B', avshift > 0 ? avshift : -avshift);
-		adjust_view(b, msg);
-	}
 
 	return rc;
 }
 
+
+
+/* SortLines works on an array of line descriptors, each paired with the
+   first bytes of its line, so that most comparisons do not need to look at
+   the line itself. Large arrays are sorted in parallel: the array is divided
+   into runs, which are sorted by worker threads using a merge sort, and then
+   pairs of adjacent runs are merged in parallel, halving the number of runs
+   at each round. */
+
+#define SORT_PARALLEL_MIN_LINES (64*1024)
+#define MAX_SORT_THREADS 8
+
+typedef struct {
+	uint64_t prefix;   /* The first bytes of the line, big endian, lower cased in dictionary order. */
+	line_desc *ld;
+} sort_key;
+
+static int (*linecmp)(const line_desc *, const line_desc *);
+
+static int linebytecmp(const line_desc * const a, const line_desc * const b) {
+	const int64_t len = min(a->line_len, b->line_len);
+	const int c = len ? memcmp(a->line, b->line, len) : 0;
+	if (c) return c;
+	return (a->line_len > b->line_len) - (a->line_len < b->line_len);
+}
+
+/* Compares lines ignoring case. */
+
+static int linefoldcmp(const line_desc * const a, const line_desc * const b) {
+	const int64_t len = min(a->line_len, b->line_len);
+	for(int64_t i = 0; i < len; i++) {
+		const int c = tolower((unsigned char)a->line[i]) - tolower((unsigned char)b->line[i]);
+		if (c) return c;
+	}
+	return (a->line_len > b->line_len) - (a->line_len < b->line_len);
+}
+
+/* The analogue of strdictcmp() for lines. */
+
+static int linedictcmp(const line_desc * const a, const line_desc * const b) {
+	const int c = linefoldcmp(a, b);
+	return c ? c : linebytecmp(a, b);
+}
+
+/* Prefixes are padded with zeroes, so different prefixes order lines as
+   linecmp does. */
+
+static uint64_t line_prefix(const line_desc * const ld, const bool fold_case) {
+	uint64_t prefix = 0;
+	for(int i = 0; i < 8; i++) prefix = prefix << 8 | (i < ld->line_len ? (fold_case ? tolower((unsigned char)ld->line[i]) : (unsigned char)ld->line[i]) : 0);
+	return prefix;
+}
+
+static inline int keycmp(const sort_key * const a, const sort_key * const b) {
+	if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+	return linecmp(a->ld, b->ld);
+}
+
+/* Merges the sorted runs a[l..m) and a[m..r), using tmp[l..r). */
+
+static void merge_keys(sort_key * const a, sort_key * const tmp, const int64_t l, const int64_t m, const int64_t r) {
+	if (l == m || m == r || keycmp(&a[m - 1], &a[m]) <= 0) return;
+	int64_t i = l, j = m, k = l;
+	while(i < m && j < r) tmp[k++] = keycmp(&a[j], &a[i]) < 0 ? a[j++] : a[i++];
+	/* What is left of the second run is already in place. */
+	memmove(a + k, a + i, (m - i) * sizeof *a);
+	memcpy(a + l, tmp + l, (k - l) * sizeof *a);
+}
+
+static void sort_keys(sort_key * const a, sort_key * const tmp, const int64_t l, const int64_t r) {
+	if (r - l <= 16) {
+		for(int64_t i = l + 1; i < r; i++) {
+			const sort_key x = a[i];
+			int64_t j = i;
+			for(; j > l && keycmp(&x, &a[j - 1]) < 0; j--) a[j] = a[j - 1];
+			a[j] = x;
+		}
+		return;
+	}
+	const int64_t m = l + (r - l) / 2;
+	sort_keys(a, tmp, l, m);
+	sort_keys(a, tmp, m, r);
+	merge_keys(a, tmp, l, m, r);
+}
+
+typedef struct {
+	sort_key *a, *tmp;
+	int64_t bound[MAX_SORT_THREADS + 1]; /* Run i is a[bound[i]..bound[i + 1]). */
+	int runs;
+	int width;         /* Zero to sort the runs, or the number of runs already merged. */
+	int tasks;
+	int next;          /* The next task to be executed. */
+	pthread_mutex_t mutex;
+} sort_job;
+
+static void *sort_worker(void * const arg) {
+	sort_job * const job = arg;
+	for(;;) {
+		pthread_mutex_lock(&job->mutex);
+		const int i = job->next++;
+		pthread_mutex_unlock(&job->mutex);
+		if (i >= job->tasks) return NULL;
+		if (job->width == 0) sort_keys(job->a, job->tmp, job->bound[i], job->bound[i + 1]);
+		else {
+			const int r = 2 * i * job->width;
+			merge_keys(job->a, job->tmp, job->bound[r], job->bound[min(r + job->width, job->runs)], job->bound[min(r + 2 * job->width, job->runs)]);
+		}
+	}
+}
+
+/* Runs the tasks of job using the current thread and, if there is more than
+   one task, some additional worker threads, which do not receive signals. */
+
+static void run_sort_job(sort_job * const job) {
+	pthread_t thread[MAX_SORT_THREADS];
+	int threads = 0;
+
+	job->next = 0;
+	if (job->tasks > 1) {
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		while(threads < job->tasks - 1 && !pthread_create(&thread[threads], NULL, sort_worker, job)) threads++;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	sort_worker(job);
+	for(int i = 0; i < threads; i++) pthread_join(thread[i], NULL);
+}
+
+/* Sorts stably the n line descriptors in lds, byte by byte or, if
+   fold_case is true, in dictionary order. */
+
+static int sort_line_descs(line_desc ** const lds, const int64_t n, const bool fold_case) {
+	sort_job job = { .a = malloc(n * sizeof *job.a), .tmp = malloc(n * sizeof *job.tmp) };
+	if (!job.a || !job.tmp) {
+		free(job.a);
+		free(job.tmp);
+		return OUT_OF_MEMORY;
+	}
+
+	linecmp = fold_case ? linedictcmp : linebytecmp;
+	for(int64_t i = 0; i < n; i++) {
+		job.a[i].prefix = line_prefix(lds[i], fold_case);
+		job.a[i].ld = lds[i];
+	}
+
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	job.runs = n >= SORT_PARALLEL_MIN_LINES && cpus > 1 ? min(cpus, MAX_SORT_THREADS) : 1;
+	for(int i = 0; i <= job.runs; i++) job.bound[i] = n * i / job.runs;
+
+	pthread_mutex_init(&job.mutex, NULL);
+	job.tasks = job.runs;
+	run_sort_job(&job);
+	for(job.width = 1; job.width < job.runs; job.width *= 2) {
+		job.tasks = (job.runs + 2 * job.width - 1) / (2 * job.width);
+		run_sort_job(&job);
+	}
+	pthread_mutex_destroy(&job.mutex);
+
+	for(int64_t i = 0; i < n; i++) lds[i] = job.a[i].ld;
+	free(job.a);
+	free(job.tmp);
+	return OK;
+}
+
+/* Sorts the lines between the mark and the cursor, or all lines if the mark
+   is not set. Lines are compared byte by byte if the CaseSearch flag is set,
+   and in dictionary order (see strdictcmp()) otherwise. If uniq is true,
+   the lines are not sorted, but the lines equal to the preceding one (with
+   the same comparison, but ignoring the tie break on case) are deleted. A final empty line is never considered, so that a document
+   ending with a newline keeps it at its end. The line list is just
+   relinked, and the change is a single undo step. */
+
+int sort_lines(buffer * const b, const bool uniq) {
+	int64_t first_line = 0, last_line = b->num_lines - 1;
+
+	if (b->marking) {
+		first_line = min(b->block_start_line, b->cur_line);
+		last_line  = max(b->block_start_line, b->cur_line);
+	}
+
+	if (last_line == b->num_lines - 1 && last_line > first_line && nth_line_desc(b, last_line)->line_len == 0) last_line--;
+	const int64_t n = last_line - first_line + 1;
+	if (n < 2) return OK;
+
+	line_desc ** const lds = malloc(n * sizeof *lds);
+	if (!lds) return OUT_OF_MEMORY;
+
+	line_desc * const start_line_desc = nth_line_desc(b, first_line);
+	line_desc *ld = start_line_desc;
+	for(int64_t i = 0; i < n; i++, ld = (line_desc *)ld->ld_node.next) lds[i] = ld;
+
+	int64_t m = n;
+	bool changed = false;
+	int error = OK;
+
+	if (uniq) {
+		/* Kept lines are compacted at the start, deleted ones moved after them. */
+		int (* const cmp)(const line_desc *, const line_desc *) = b->opt.case_search ? linebytecmp : linefoldcmp;
+		m = 1;
+		for(int64_t i = 1; i < n; i++) {
+			if (cmp(lds[m - 1], lds[i])) {
+				line_desc * const t = lds[m];
+				lds[m++] = lds[i];
+				lds[i] = t;
+			}
+		}
+		changed = m < n;
+	}
+	else {
+		error = sort_line_descs(lds, n, !b->opt.case_search);
+		ld = start_line_desc;
+		for(int64_t i = 0; i < n && !changed; i++, ld = (line_desc *)ld->ld_node.next) changed = lds[i] != ld;
+	}
+
+	if (!error && stop) error = STOPPED;
+
+	if (changed && !error) {
+		/* The state at the start of the range does not change. */
+		const HIGHLIGHT_STATE state = b->syn ? start_line_desc->highlight_state : (HIGHLIGHT_STATE){ 0 };
+
+		start_undo_chain(b);
+		error = reorder_lines(b, start_line_desc, first_line, lds, n, m);
+		end_undo_chain(b);
+
+		if (!error) {
+			if (b->syn) {
+				lds[0]->highlight_state = state;
+				need_attr_update = true;
+				update_syntax_states(b, -1, lds[0], (line_desc *)lds[m - 1]->ld_node.next);
+			}
+			update_window_lines(b, b->top_line_desc, 0, ne_lines - 2, false);
+			goto_line_pos(b, b->cur_line, 0);
+			delay_update();
+		}
+	}
+
+	free(lds);
+	return error;
+}
@@ -92,7 +92,8 @@ char *error_msg[ERROR_COUNT] = {
 	/* 64 */ "Document not saved.",
 	/* 65*/	"File is too large--syntax highlighting disabled (use SYNTAX to reactivate).",
 	/* 66*/	"Cannot save: disk full.",
-	/* 67*/	"Out of memory (insufficient disk space?). DANGER!"
+	/* 67*/	"Out of memory (insufficient disk space?). DANGER!",
+	/* 68*/	"No macro has been recorded."
 };
 
 char *info_msg[INFO_COUNT] = {
@@ -116,5 +117,7 @@ char *info_msg[INFO_COUNT] = {
 	"File has been modified since buffer was loaded or saved; are you sure?",
 	"A file with that name already exists; are you sure?",
 	"HELP cursor/Enter QUIT F1/Esc-Esc/Esc",
-	"BACK Enter QUIT F1/Esc-Esc/Esc"
+	"BACK Enter QUIT F1/Esc-Esc/Esc",
+	"The file of this document has been changed on disk.",
+	"Document reloaded (file changed on disk)."
 };
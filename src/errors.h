@@ -111,6 +111,7 @@ enum error {
 	/* 65 */ FILE_TOO_LARGE_SYNTAX_HIGHLIGHTING_DISABLED,
 	/* 66 */ CANNOT_SAVE_DISK_FULL,
 	/* 67 */ OUT_OF_MEMORY_DISK_FULL,
+	/* 68 */ NO_MACRO_RECORDED,
 
 	ERROR_COUNT
 };
@@ -137,6 +138,8 @@ enum info {
 	FILE_ALREADY_EXISTS,
 	HELP_KEYS,
 	HELP_COMMAND_KEYS,
+	FILE_CHANGED_ON_DISK,
+	DOCUMENT_RELOADED,
 
 	INFO_COUNT
 };
@@ -115,7 +115,8 @@ bool request_response(const buffer * const b, const char * const prompt, const b
 /* Prompts the user for a single character answer. The prompt is assumed not to
    be UTF-8 encoded. default_value has to be an ISO-8859-1 character which is
    used for the default answer. The character typed by the user (upper cased)
-   is returned. The default character is used if the user types RETURN. Note
+   is returned. The default character is used if the user types RETURN, and
+   0 is returned if the terminal goes away (see terminal_lost()). Note
    that the cursor is moved back to its current position. This offers a clear
    distinction between immediate and long inputs, and allows for interactive
    search and replace.
@@ -126,6 +127,9 @@ bool request_response(const buffer * const b, const char * const prompt, const b
 
 
 char request_char(const buffer * const b, const char * const prompt, const char default_value) {
+	/* In batch mode, we act as if the user typed RETURN. */
+	if (batch_mode) return (char)localised_up_case[(unsigned char)default_value];
+
 	print_prompt(prompt);
 
 	if (default_value) output_char(default_value, 0, false);
@@ -146,6 +150,7 @@ char request_char(const buffer * const b, const char * const prompt, const char
 			move_cursor(b->cur_y, b->cur_x);
 		}
 			
+		if (detaching) return 0; /* The terminal went away. */
 		if (c == INVALID_CHAR) continue; /* Window resizing. */
 
 		switch(ic) {
@@ -157,6 +162,15 @@ char request_char(const buffer * const b, const char * const prompt, const char
 
 			case COMMAND:
 				if (c < 0) c = -c - 1;
+
+				/* Pasted text must not answer the question. */
+
+				if (c == NE_KEY_PASTE) {
+					int64_t len;
+					free(get_paste_stream(&len));
+					break;
+				}
+
 				const int a = parse_command_line(key_binding[c], NULL, NULL, false);
 				if (a >= 0) {
 					switch(a) {
@@ -522,26 +536,33 @@ static void input_prev_word(void) {
 }
 
 
-static void input_paste(void) {
-	const clip_desc * const cd = get_nth_clip(cur_buffer->opt.cur_clip);
+/* Inserts the first line of a stream with the given encoding at the
+   current position. */
 
-	if (cd) {
-		if (cd->cs->encoding != ENC_ASCII && encoding != ENC_ASCII && cd->cs->encoding != encoding) {
-			alert();
-			return;
-		}
-
-		int paste_len = strnlen_ne(cd->cs->stream, cd->cs->len);
-		if (len + paste_len > MAX_INPUT_LINE_LEN) paste_len = MAX_INPUT_LINE_LEN - len;
-		memmove(&input_buffer[pos + paste_len], &input_buffer[pos], len - pos + 1);
-		strncpy(&input_buffer[pos], cd->cs->stream, paste_len);
-		len += paste_len;
-		if (!input_buffer_is_ascii() && cd->cs->encoding != ENC_ASCII) encoding = cd->cs->encoding;
-		input_refresh();
+static void input_paste_stream(const char * const stream, const int64_t stream_len, const encoding_type stream_encoding) {
+	if (stream_encoding != ENC_ASCII && encoding != ENC_ASCII && stream_encoding != encoding) {
+		alert();
+		return;
 	}
+
+	int paste_len = strnlen_ne(stream, stream_len);
+	if (len + paste_len > MAX_INPUT_LINE_LEN) paste_len = MAX_INPUT_LINE_LEN - len;
+	memmove(&input_buffer[pos + paste_len], &input_buffer[pos], len - pos + 1);
+	strncpy(&input_buffer[pos], stream, paste_len);
+	len += paste_len;
+	if (!input_buffer_is_ascii() && stream_encoding != ENC_ASCII) encoding = stream_encoding;
+	input_refresh();
+}
+
+
+static void input_paste(void) {
+	clip_desc * const cd = get_nth_clip(cur_buffer->opt.cur_clip);
+	if (cd && materialize_clip(cd) == OK) input_paste_stream(cd->cs->stream, cd->cs->len, cd->cs->encoding);
 }
 
 char *request(const buffer * const b, const char *prompt, const char * const default_string, const bool alpha_allowed, const int completion_type, const bool prefer_utf8) {
+	/* In batch mode, we act as if the user escaped. */
+	if (batch_mode) return NULL;
 
 	input_buffer[pos = len = offset = 0] = 0;
 	encoding = ENC_ASCII;
@@ -576,6 +597,7 @@ char *request(const buffer * const b, const char *prompt, const char * const def
 			input_and_prompt_refresh();
 		}
 
+		if (detaching) return NULL; /* The terminal went away. */
 		if (c == INVALID_CHAR) continue; /* Window resizing. */
 
 		/* ISO 10646 characters *above 256* can be added only to UTF-8 lines, or ASCII lines (making them, of course, UTF-8). */
@@ -689,6 +711,20 @@ char *request(const buffer * const b, const char *prompt, const char * const def
 
 		case COMMAND:
 			if (c < 0) c = -c - 1;
+
+			/* A bracketed paste is inserted up to its first line terminator. */
+
+			if (c == NE_KEY_PASTE) {
+				int64_t stream_len;
+				char * const stream = get_paste_stream(&stream_len);
+				if (stream) {
+					input_paste_stream(stream, stream_len, detect_encoding(stream, strlen(stream)));
+					free(stream);
+				}
+				else alert();
+				break;
+			}
+
 			const int a = parse_command_line(key_binding[c], NULL, NULL, false);
 			if (a >= 0) {
 				switch(a) {
@@ -90,6 +90,10 @@ onto an unused function key capability. */
 
 #define NE_KEY_IGNORE      0x126
 
+/* Start of a bracketed paste (the terminal sends ESC [ 200 ~). */
+
+#define NE_KEY_PASTE       0x127
+
 /* Tab keys (never used in the standard configuration) */
 
 #define	NE_KEY_CLEAR_ALL_TABS	0x128
@@ -373,6 +373,11 @@ void read_key_capabilities(void) {
 	key_may_set("\x1b[[D",  NE_KEY_F(4));
 	key_may_set("\x1b[[E",  NE_KEY_F(5));
 
+	/* Bracketed paste (see set_terminal_modes()). A stray end marker is ignored. */
+
+	key_may_set("\x1b[200~", NE_KEY_PASTE);
+	key_may_set("\x1b[201~", NE_KEY_IGNORE);
+
 	/* If at this point any sequence of the form ESC+ASCII character is free, we bind
 		it to the simulated META key. */
 
@@ -413,6 +418,12 @@ static void set_termios_timeout(const int timeout) {
 }
 
 
+/* The keyboard buffer, shared by get_key_code() and get_paste_stream(). */
+
+static int cur_len = 0;
+static char kbd_buffer[KBD_BUF_SIZE];
+
+
 /* Reads in characters, and tries to match them with the sequences
    corresponding to special keys. Returns a positive number, denoting
    a character (possibly INVALID_CHAR), or a negative number denoting a key
@@ -425,16 +436,19 @@ static void set_termios_timeout(const int timeout) {
    string. If a new character does not match, we can just increment the key
    counter (because the array is sorted). When we get out of the array, we give
    back the first char in the keyboard buffer (the next call will retry a match
-   on the following chars). */
+   on the following chars).
 
+   If the terminal goes away while we are serving a client, we return
+   INVALID_CHAR with detaching set (see terminal_lost()), and keep doing so
+   until the session ends. */
 
-int get_key_code(void) {
-	static int cur_len = 0;
-	static char kbd_buffer[KBD_BUF_SIZE];
 
+int get_key_code(void) {
 	int c, e, last_match = 0, cur_key = 0;
 	bool partial_match = false, partial_is_utf8 = false;
 
+	if (detaching) return INVALID_CHAR;
+
 	while(true) {
 
 		if (cur_len) {
@@ -527,7 +541,11 @@ int get_key_code(void) {
 		/* This is necessary to circumvent the slightly different behaviour of getc() in Linux and BSD. */
 		clearerr(stdin);
 
-		if (c == EOF && (!partial_match || e) && e != EINTR) kill(getpid(), SIGTERM);
+		if (c == EOF && (!partial_match || e) && e != EINTR) {
+			cur_len = 0;
+			terminal_lost();
+			return INVALID_CHAR;
+		}
 
 		partial_match = false;
 
@@ -552,3 +570,103 @@ int get_key_code(void) {
 		}
 	}
 }
+
+
+/* The end marker of a bracketed paste, and the number of tenths of second we
+   are willing to wait for the next byte of a paste before giving up. */
+
+#define PASTE_END "\x1b[201~"
+#define PASTE_TIMEOUT 20
+
+/* Returns the next byte of a bracketed paste, draining first the keyboard
+   buffer, or EOF on timeout. */
+
+static int get_paste_byte(void) {
+	if (cur_len) {
+		const int c = kbd_buffer[0];
+		if (--cur_len) memmove(kbd_buffer, kbd_buffer + 1, cur_len);
+		return (unsigned char)c;
+	}
+
+	int c;
+	do {
+		errno = 0;
+		c = getchar();
+		clearerr(stdin);
+	} while(c == EOF && errno == EINTR);
+
+	return c;
+}
+
+
+/* Reads the body of a bracketed paste, that is, everything up to the
+   terminating ESC [ 201 ~ sequence, which get_key_code() leaves unread after
+   returning NE_KEY_PASTE. The body is returned as a stream suitable for
+   insert_stream(): CR, LF and CR/LF line terminators are turned into NULs,
+   and NULs in the input are discarded. The length of the stream is stored in
+   *len, and the stream is followed by an additional NUL, so that its last
+   line is a C string, too. If we run out of memory the paste is drained anyway and NULL is
+   returned. */
+
+char *get_paste_stream(int64_t * const len) {
+	const int end_len = strlen(PASTE_END);
+	int64_t size = 4096, l = 0;
+	char *stream = malloc(size);
+	int c, matched = 0;
+
+	set_termios_timeout(PASTE_TIMEOUT);
+
+	while(matched < end_len && (c = get_paste_byte()) != EOF) {
+		if (c == PASTE_END[matched]) {
+			matched++;
+			continue;
+		}
+
+		/* We must give back the partially matched terminator (which
+		   cannot contain c, unless c is ESC). */
+
+		for(int i = -matched; i <= 0; i++) {
+			if (stream && l == size) {
+				char * const p = realloc(stream, size *= 2);
+				if (!p) {
+					free(stream);
+					stream = NULL;
+				}
+				else stream = p;
+			}
+			if (stream) stream[l++] = i ? PASTE_END[matched + i] : c;
+		}
+
+		if (c == PASTE_END[0]) {
+			l--;
+			matched = 1;
+		}
+		else matched = 0;
+	}
+
+	set_termios_timeout(0);
+
+	if (!stream) return NULL;
+
+	int64_t j = 0;
+	for(int64_t i = 0; i < l; i++) {
+		if (stream[i] == '\r') {
+			stream[j++] = 0;
+			if (i + 1 < l && stream[i + 1] == '\n') i++;
+		}
+		else if (stream[i] == '\n') stream[j++] = 0;
+		else if (stream[i]) stream[j++] = stream[i];
+	}
+
+	if (j == size) {
+		char * const p = realloc(stream, size + 1);
+		if (!p) {
+			free(stream);
+			return NULL;
+		}
+		stream = p;
+	}
+
+	stream[*len = j] = 0;
+	return stream;
+}
@@ -581,6 +581,7 @@ char *gen_flag_string(const buffer * const b) {
 	string[i++] = io_utf8               ? '@' : '-';
 	string[i++] = b->encoding != ENC_8_BIT? (b->encoding == ENC_UTF8 ? 'U' : 'A') : '8';
 	string[i++] = b->is_modified        ? '*' : '-';
+	string[i++] = b->changed_on_disk    ? 'D' : (b->following ? 'F' : '-');
 
 	if (b->opt.hex_code && !fast_gui) {
 		string[i++] = ' ';
@@ -625,6 +626,8 @@ void draw_status_bar(void) {
 	static int64_t x = -1, y = -1;
 	static int percent = -1;
 
+	if (batch_mode) return;
+
 	if (showing_msg) {
 		showing_msg = false;
 		bar_gone = true;
@@ -742,6 +745,8 @@ void draw_status_bar(void) {
 void print_message(const char * const message) {
 	static char msg_cache[MAX_MESSAGE_LENGTH];
 
+	if (batch_mode) return;
+
 	resume_status_bar = (void (*)(const char *message))&print_message;
 	if (message) {
 		strncpy(msg_cache, message, MAX_MESSAGE_LENGTH);
@@ -805,6 +810,7 @@ void print_info(const int info_num) {
 /* Rings a bell or flashes the screen, depending on the user preference. */
 
 void alert(void) {
+	if (batch_mode) return;
 	if (cur_buffer->opt.visual_bell) do_flash();
 	else ring_bell();
 }
@@ -819,6 +825,7 @@ void alert(void) {
    shortcuts while using menus. */
 
 void handle_menus(void) {
+	if (batch_mode) return;
 	draw_first_menu();
 
 	while(true) {
@@ -834,6 +841,7 @@ void handle_menus(void) {
 
 		switch(ic) {
 		case INVALID:
+			if (detaching) return; /* The terminal went away. */
 			alert();
 			break;
 
@@ -858,6 +866,14 @@ void handle_menus(void) {
 			if (c < 0) c = -c - 1;
 			int64_t n;
 			char *p;
+
+			/* Pasted text means nothing in a menu: we just discard it. */
+
+			if (c == NE_KEY_PASTE) {
+				free(get_paste_stream(&n));
+				break;
+			}
+
 			const int a = parse_command_line(key_binding[c], &n, &p, false);
 			if (a >= 0) {
 				switch(a) {
@@ -93,8 +93,11 @@ void resync_pos(buffer * const b) {
 	}
 
 	line_desc *ld = b->cur_line_desc;
+	col_checkpoint cp = { 0 };
+	if (ld->line_len >= COL_INDEX_MIN_LEN && x > COL_INDEX_STEP) col_index_by_width(ld, x, b->opt.tab_size, b->encoding, &cp);
+
 	int64_t i, pos, width, last_char_width;
-	for(i = pos = width = 0; pos < ld->line_len; pos = next_pos(ld->line, pos, b->encoding), i++) {
+	for(i = cp.chars, pos = cp.pos, width = cp.width; pos < ld->line_len; pos = next_pos(ld->line, pos, b->encoding), i++) {
 
 		if (ld->line[pos] != '\t') width += (last_char_width = get_char_width(&ld->line[pos], b->encoding));
 		else width += (last_char_width = b->opt.tab_size - width % b->opt.tab_size);
@@ -762,13 +765,12 @@ in the middle of a UTF-8 character. */
 
 void goto_pos(buffer * const b, const int64_t pos) {
 	const line_desc * const ld = b->cur_line_desc;
-	const int64_t last_pos = min(pos, ld->line_len);
-	int64_t col, real_pos;
+	int64_t real_pos = min(pos, ld->line_len);
 
-	for(col = real_pos = b->cur_char = 0; real_pos < last_pos; b->cur_char++, real_pos = next_pos(ld->line, real_pos, b->encoding)) {
-		if (ld->line[real_pos] != '\t') col += get_char_width(&ld->line[real_pos], b->encoding);
-		else col += b->opt.tab_size - col % b->opt.tab_size;
-	}
+	if (b->encoding == ENC_UTF8) while(real_pos < ld->line_len && (ld->line[real_pos] & 0xC0) == 0x80) real_pos++;
+
+	int64_t col = calc_width(ld, real_pos, b->opt.tab_size, b->encoding);
+	b->cur_char = calc_char_len(ld, real_pos, b->encoding);
 
 	b->x_wanted = 0;
 
@@ -841,7 +843,10 @@ void move_to_eol(buffer * const b) {
 		return;
 	}
 
-	for(int64_t i = 0, pos = 0, width = 0; pos < ld->line_len; pos = next_pos(ld->line, pos, b->encoding), i++)  {
+	col_checkpoint cp = { 0 };
+	if (ld->line_len >= COL_INDEX_MIN_LEN) col_index_by_width(ld, total_width - ne_columns + b->opt.tab_size, b->opt.tab_size, b->encoding, &cp);
+
+	for(int64_t i = cp.chars, pos = cp.pos, width = cp.width; pos < ld->line_len; pos = next_pos(ld->line, pos, b->encoding), i++)  {
 		if (ld->line[pos] != '\t') width += get_char_width(&ld->line[pos], b->encoding);
 		else width += b->opt.tab_size - width % b->opt.tab_size;
 
@@ -77,7 +77,10 @@ char ARG_HELP[] = ABOUT_MSG "\n"
 						"--prefs EXT   set autoprefs for the provided extension before loading the first file.\n"
 						"--keys FILE   use this file for keyboard configuration.\n"
 						"--menus FILE  use this file for menu configuration.\n"
-						"--macro FILE  exec this macro after start.\n\n"
+						"--macro FILE  exec this macro after start.\n"
+						"--batch FILE  exec this macro on each file, saving it, without a terminal.\n"
+						"--server      keep documents resident, and serve later invocations of ne.\n"
+						"--no-server   do not attach to a running server.\n\n"
 						"             *These options may appear multiple times.\n";
 
 
@@ -85,6 +88,11 @@ char ARG_HELP[] = ABOUT_MSG "\n"
 
 #define LOCALE_REGEX "\\(UTF-?8\\)\\|\\(ISO-?8859-?\\)\\(1?[0-9]\\)"
 
+/* The size of the (invisible) window used in batch mode. */
+
+#define BATCH_LINES   (25)
+#define BATCH_COLUMNS (80)
+
 /* These lists contain the existing buffers, clips and macros.
    cur_buffer denotes the currently displayed buffer. */
 
@@ -103,11 +111,16 @@ bool req_order = true;
 bool fast_gui;
 bool status_bar = true;
 bool verbose_macros = true;
+bool sync_save;
+bool auto_reload;
+int undo_memory = DEFAULT_UNDO_MEMORY;
+bool undo_journal;
 /* end of global prefs */
 
 buffer *cur_buffer;
 int turbo;
 bool do_syntax = true;
+bool batch_mode;
 
 /* Whether we are currently displaying an about message. */
 static bool displaying_info;
@@ -162,6 +175,230 @@ void about(void) {
 	print_message(t);
 }
 
+/* Processes the files specified on the command line with --batch. Each file
+   is loaded into a new document, the given macro is executed, and the
+   document is saved if it has been modified. The terminal is never used:
+   display updates are deferred forever, and requesters behave as if the
+   user escaped. A line reporting the outcome is printed on standard error
+   for each file. Returns the exit status of ne. */
+
+static int batch(const char * const macro_name, const int argc, char ** const argv, const char * const skiplist) {
+	buffer * const scratch = cur_buffer;
+	bool binary = false;
+	int failures = 0;
+
+	defer_display(true);
+
+	for(int i = 1; i < argc; i++) {
+		if (skiplist[i]) continue;
+		if (!strcmp(argv[i], "--binary")) {
+			binary = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "--") && ++i == argc) break;
+
+		const char * const name = argv[i];
+		buffer * const b = new_buffer();
+		int error = OUT_OF_MEMORY;
+		bool saved = false;
+
+		if (b) {
+			b->opt.binary = binary;
+			if ((error = load_file_in_buffer(b, name)) == OK) {
+				change_filename(b, str_dup(name));
+				if (b->opt.auto_prefs && load_auto_prefs(b, NULL) == HAS_NO_EXTENSION) load_auto_prefs(b, DEF_PREFS_NAME);
+				stop = false;
+				error = execute_macro(b, macro_name);
+
+				/* The macro might have closed the document. */
+				bool still_open = false;
+				for(buffer *d = (buffer *)buffers.head; d->b_node.next; d = (buffer *)d->b_node.next) still_open |= d == b;
+
+				if (error == OK && still_open && b->is_modified) {
+					error = save_buffer_to_file(b, NULL);
+					saved = error == OK;
+				}
+			}
+		}
+		binary = false;
+
+		if (error) failures++;
+		fprintf(stderr, "%s: %s\n", name, error > 0 ? error_msg[error] : error ? "Error." : saved ? info_msg[SAVED] : "Unchanged.");
+
+		/* The macro might have created or switched documents. */
+		for(buffer *d = (buffer *)buffers.head, *next; d->b_node.next; d = next) {
+			next = (buffer *)d->b_node.next;
+			if (d != scratch) {
+				rem(&d->b_node);
+				free_buffer(d);
+			}
+		}
+		cur_buffer = scratch;
+	}
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/* Loads the files specified by the arguments not marked in skiplist,
+   applying the +N,M, --binary and --read-only options, and the options for
+   the piped stdin_buffer (which might be NULL) named by "-". If *first_file
+   is true, the first file is loaded into the current document. When serving
+   a client, a file which is already loaded by a previous session is not loaded
+   again: its document is just made current (see resident_buffer()). Returns
+   the document of the first file, or NULL. Note that file loading can be
+   interrupted (wildcarding can sometimes produce unwanted results). */
+
+buffer *load_files(const int argc, char * const * const argv, const char * const skiplist, buffer *stdin_buffer, bool * const first_file) {
+	uint64_t first_line = 0, first_col = 0;
+	bool binary = false, skip_plus = false, read_only = false;
+	buffer *first = NULL;
+	stop = false;
+
+	for(int i = 1; i < argc && !stop; i++) {
+		if (argv[i] && !skiplist[i]) {
+			if (argv[i][0] == '+' && !skip_plus) {       /* looking for "+", or "+N" or "+N,M"  */
+				uint64_t tmp_l = INT64_MAX, tmp_c = 0;
+				char *d;
+				errno = 0;
+				if (argv[i][1]) {
+					if (isdigit((unsigned char)argv[i][1])) {
+						tmp_l = strtoll(argv[i]+1, &d, 10);
+						if (!errno) {
+							if (*d) {  /* separator between N and M */
+								if (isdigit((unsigned char)d[1])) {
+									tmp_c = strtoll(d+1, &d, 10);
+									if (*d) errno = ERANGE;
+								}
+								else errno = ERANGE;
+							}
+						}
+					}
+					else errno = ERANGE;
+				}
+				if (!errno) {
+					first_line = tmp_l;
+					first_col  = tmp_c;
+				}
+				else {
+					skip_plus = true;
+					i--;
+				}
+			}
+			else if (!strcmp(argv[i], "--binary")) {
+				binary = true;
+			}
+			else if (!strcmp(argv[i], "--read-only") || !strcmp(argv[i], "--readonly") || !strcmp(argv[i], "--ro")) {
+				read_only = true;
+			}
+			else {
+				if (!strcmp(argv[i], "-") && stdin_buffer) {
+					stdin_buffer->opt.binary = binary;
+					if (read_only) stdin_buffer->opt.read_only = read_only;
+					if (first_line) do_action(stdin_buffer, GOTOLINE_A, first_line, NULL);
+					if (first_col)  do_action(stdin_buffer, GOTOCOLUMN_A, first_col, NULL);
+					stdin_buffer = NULL;
+				}
+				else {
+					if (!strcmp(argv[i], "--")) i++;
+					buffer * const resident = i < argc ? resident_buffer(argv[i]) : NULL;
+					if (resident) cur_buffer = resident;
+					else {
+						if (!*first_file) do_action(cur_buffer, NEWDOC_A, -1, NULL);
+						else *first_file = false;
+						cur_buffer->opt.binary = binary;
+						if (i < argc) do_action(cur_buffer, OPEN_A, 0, str_dup(argv[i]));
+					}
+					if (!first) first = cur_buffer;
+					if (first_line) do_action(cur_buffer, GOTOLINE_A, first_line, NULL);
+					if (first_col)  do_action(cur_buffer, GOTOCOLUMN_A, first_col, NULL);
+					if (read_only) cur_buffer->opt.read_only = read_only;
+				}
+				first_line =
+				first_col  = 0;
+				skip_plus  =
+				binary    =
+				read_only  = false;
+			}
+		}
+	}
+
+	return first;
+}
+
+
+/* The event loop: we read keys and execute the corresponding actions. When
+   serving a client, we return at the end of the session (see leave_ne()). */
+
+void main_loop(void) {
+	while(!detaching) {
+		check_watched_files();
+
+		/* If we are displaying the "NO WARRANTY" info, we should not refresh the
+		   window now */
+		if (!displaying_info) {
+			refresh_window(cur_buffer);
+			if (cur_buffer->opt.automatch) automatch_bracket(cur_buffer, true);
+		}
+
+		draw_status_bar();
+		move_cursor(cur_buffer->cur_y, cur_buffer->cur_x);
+
+		wake_on_file_change(true);
+		int c = get_key_code();
+		wake_on_file_change(false);
+
+		if (window_changed_size) {
+			print_error(do_action(cur_buffer, REFRESH_A, 0, NULL));
+			window_changed_size = displaying_info = false;
+			cur_buffer->automatch.shown = 0;
+		}
+
+		if (c == INVALID_CHAR) continue; /* Window resizing or file change. */
+		const input_class ic = CHAR_CLASS(c);
+
+		if (displaying_info) {
+			refresh_window(cur_buffer);
+			displaying_info = false;
+		}
+
+		if (cur_buffer->automatch.shown) automatch_bracket(cur_buffer, false);
+
+		switch(ic) {
+		case INVALID:
+			print_error(INVALID_CHARACTER);
+			break;
+
+		case ALPHA:
+			print_error(do_action(cur_buffer, INSERTCHAR_A, c, NULL));
+			break;
+
+		case TAB:
+			print_error(do_action(cur_buffer, INSERTTAB_A, 1, NULL));
+			break;
+
+		case RETURN:
+			print_error(do_action(cur_buffer, INSERTLINE_A, -1, NULL));
+			break;
+
+		case COMMAND:
+			if (c < 0) c = -c - 1;
+			if (c == NE_KEY_PASTE) {
+				int64_t len;
+				char * const stream = get_paste_stream(&len);
+				print_error(stream ? paste_stream_to_buffer(cur_buffer, stream, len) : OUT_OF_MEMORY);
+				free(stream);
+			}
+			else if (key_binding[c]) print_error(execute_command_line(cur_buffer, key_binding[c]));
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+
 /* The main() function. It is responsible for argument parsing, calling
    some terminal and signal initialization functions, and entering the
    event loop. */
@@ -186,8 +423,8 @@ int main(int argc, char **argv) {
 		free(re_reg.end);
 	}
 
-	bool no_config = false;
-	char *macro_name = NULL, *key_bindings_name = NULL, *menu_conf_name = NULL, *startup_prefs_name = DEF_PREFS_NAME;
+	bool no_config = false, server = false;
+	char *macro_name = NULL, *batch_macro_name = NULL, *key_bindings_name = NULL, *menu_conf_name = NULL, *startup_prefs_name = DEF_PREFS_NAME;
 
 	char * const skiplist = calloc(argc, 1);
 	if (!skiplist) exit(1);  /* We need this many flags. */
@@ -241,6 +478,21 @@ int main(int argc, char **argv) {
 					skiplist[i] = skiplist[i+1] = 1; /* argv[i] = argv[i+1] = NULL; */
 				}
 			}
+			else if (!strcmp(&argv[i][2], "batch")) {
+				if (i < argc-1) {
+					batch_macro_name = argv[i+1];
+					batch_mode = true;
+					do_syntax = false; /* Nobody will see it. */
+					skiplist[i] = skiplist[i+1] = 1; /* argv[i] = argv[i+1] = NULL; */
+				}
+			}
+			else if (!strcmp(&argv[i][2], "server")) {
+				server = true;
+				skiplist[i] = 1; /* argv[i] = NULL; */
+			}
+			else if (!strcmp(&argv[i][2], "no-server")) {
+				skiplist[i] = 1; /* argv[i] = NULL; */
+			}
 			else if (!strcmp(&argv[i][2], "keys")) {
 				if (i < argc-1) {
 					key_bindings_name = argv[i+1];
@@ -256,6 +508,12 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	/* If there are only file names, +N,M, --binary and --read-only options, a
+	   running server might serve us (see server.c). In that case, we do not
+	   return. */
+
+	if (!memchr(skiplist, 1, argc)) attach_to_server(argc, argv);
+
 #ifdef NE_TEST
 	/* Dump the builtin menu and key bindings to compare to
 	   doc/default.menus and doc/default.keys. */
@@ -296,18 +554,26 @@ int main(int argc, char **argv) {
 
 	add_head(&clips, &cd->cd_node);
 
-	/* General terminfo and cursor motion initalization. From here onwards,
-	   we cannot exit() lightly. */
+	if (batch_mode) {
+		/* There is no terminal, but window-related computations still need
+		   a window. */
+		ne_lines = BATCH_LINES;
+		ne_columns = BATCH_COLUMNS;
+	}
+	else {
+		/* General terminfo and cursor motion initalization. From here onwards,
+		   we cannot exit() lightly. */
 
-	term_init();
+		term_init();
 
-	/* We will be always using the last line for the status bar. */
+		/* We will be always using the last line for the status bar. */
 
-	set_terminal_window(ne_lines-1);
+		set_terminal_window(ne_lines-1);
 
-	/* We read in all the key capabilities. */
+		/* We read in all the key capabilities. */
 
-	read_key_capabilities();
+		read_key_capabilities();
+	}
 
 	/* Some initializations of other modules... */
 
@@ -323,6 +589,9 @@ int main(int argc, char **argv) {
 	load_virtual_extensions();
 	load_auto_prefs(cur_buffer, startup_prefs_name);
 
+	if (batch_mode) exit(batch(batch_macro_name, argc, argv, skiplist));
+	if (server) exit(serve(argc, argv, skiplist));
+
 	buffer *stdin_buffer = NULL;
 	if (!isatty(fileno(stdin))) {
 		first_file = false;
@@ -348,87 +617,16 @@ int main(int argc, char **argv) {
 	set_fatal_code();
 
 	if (argc > 1) {
-
-		/* The first file opened does not need a NEWDOC_A action. Note that
-		   file loading can be interrupted (wildcarding can sometimes produce
-		   unwanted results). */
-
-		uint64_t first_line = 0, first_col = 0;
-		bool binary = false, skip_plus = false, read_only = false;
-		stop = false;
-
-		for(int i = 1; i < argc && !stop; i++) {
-			if (argv[i] && !skiplist[i]) {
-				if (argv[i][0] == '+' && !skip_plus) {       /* looking for "+", or "+N" or "+N,M"  */
-					uint64_t tmp_l = INT64_MAX, tmp_c = 0;
-					char *d;
-					errno = 0;
-					if (argv[i][1]) {
-						if (isdigit((unsigned char)argv[i][1])) {
-							tmp_l = strtoll(argv[i]+1, &d, 10);
-							if (!errno) {
-								if (*d) {  /* separator between N and M */
-									if (isdigit((unsigned char)d[1])) {
-										tmp_c = strtoll(d+1, &d, 10);
-										if (*d) errno = ERANGE;
-									}
-									else errno = ERANGE;
-								}
-							}
-						}
-						else errno = ERANGE;
-					}
-					if (!errno) {
-						first_line = tmp_l;
-						first_col  = tmp_c;
-					}
-					else {
-						skip_plus = true;
-						i--;
-					}
-				}
-				else if (!strcmp(argv[i], "--binary")) {
-					binary = true;
-				}
-				else if (!strcmp(argv[i], "--read-only") || !strcmp(argv[i], "--readonly") || !strcmp(argv[i], "--ro")) {
-					read_only = true;
-				}
-				else {
-					if (!strcmp(argv[i], "-") && stdin_buffer) {
-						stdin_buffer->opt.binary = binary;
-						if (read_only) stdin_buffer->opt.read_only = read_only;
-						if (first_line) do_action(stdin_buffer, GOTOLINE_A, first_line, NULL);
-						if (first_col)  do_action(stdin_buffer, GOTOCOLUMN_A, first_col, NULL);
-						stdin_buffer = NULL;
-					}
-					else {
-						if (!strcmp(argv[i], "--")) i++;
-						if (!first_file) do_action(cur_buffer, NEWDOC_A, -1, NULL);
-						else first_file = false;
-						cur_buffer->opt.binary = binary;
-						if (i < argc) do_action(cur_buffer, OPEN_A, 0, str_dup(argv[i]));
-						if (first_line) do_action(cur_buffer, GOTOLINE_A, first_line, NULL);
-						if (first_col)  do_action(cur_buffer, GOTOCOLUMN_A, first_col, NULL);
-						if (read_only) cur_buffer->opt.read_only = read_only;
-					}
-					first_line =
-					first_col  = 0;
-					skip_plus  =
-					binary    =
-					read_only  = false;
-				}
-			}
-		}
-
-		free(skiplist);
+		load_files(argc, argv, skiplist, stdin_buffer, &first_file);
 
 		/* This call makes current the first specified file. It is called
 		   only if more than one buffer exist. */
 
 		if (get_nth_buffer(1)) do_action(cur_buffer, NEXTDOC_A, -1, NULL);
-
 	}
 
+	free(skiplist);
+
 	/* We delay updates. In this way the macro activity does not cause display activity. */
 
 	reset_window();
@@ -441,59 +639,5 @@ int main(int argc, char **argv) {
 		about();
 	}
 
-	while(true) {
-		/* If we are displaying the "NO WARRANTY" info, we should not refresh the
-		   window now */
-		if (!displaying_info) {
-			refresh_window(cur_buffer);
-			if (cur_buffer->opt.automatch) automatch_bracket(cur_buffer, true);
-		}
-
-		draw_status_bar();
-		move_cursor(cur_buffer->cur_y, cur_buffer->cur_x);
-
-		int c = get_key_code();
-
-		if (window_changed_size) {
-			print_error(do_action(cur_buffer, REFRESH_A, 0, NULL));
-			window_changed_size = displaying_info = false;
-			cur_buffer->automatch.shown = 0;
-		}
-
-		if (c == INVALID_CHAR) continue; /* Window resizing. */
-		const input_class ic = CHAR_CLASS(c);
-
-		if (displaying_info) {
-			refresh_window(cur_buffer);
-			displaying_info = false;
-		}
-
-		if (cur_buffer->automatch.shown) automatch_bracket(cur_buffer, false);
-
-		switch(ic) {
-		case INVALID:
-			print_error(INVALID_CHARACTER);
-			break;
-
-		case ALPHA:
-			print_error(do_action(cur_buffer, INSERTCHAR_A, c, NULL));
-			break;
-
-		case TAB:
-			print_error(do_action(cur_buffer, INSERTTAB_A, 1, NULL));
-			break;
-
-		case RETURN:
-			print_error(do_action(cur_buffer, INSERTLINE_A, -1, NULL));
-			break;
-
-		case COMMAND:
-			if (c < 0) c = -c - 1;
-			if (key_binding[c]) print_error(execute_command_line(cur_buffer, key_binding[c]));
-			break;
-
-		default:
-			break;
-		}
-	}
+	main_loop();
 }
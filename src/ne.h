@@ -175,6 +175,9 @@ typedef struct {
 	int cur_chars;
 	int alloc_chars;
 	char *chars;
+
+	int appended;         /* number of entries added by req_list_append() since the last req_list_sort(). */
+	int appended_chars;   /* offset in chars of the first of those entries. */
 } req_list;
 
 /* These are the list and node structures used throughout ne. See the exec.c
@@ -248,6 +251,20 @@ typedef struct {
 	int64_t line_len;
 } no_syntax_line_desc;
 
+/* A checkpoint of the column index of a long line (see col_index_by_pos()
+   in support.c): a byte position, the number of characters and the
+   TAB-expanded width of the line up to that position, and the minimum column
+   for which calc_pos() gets past it. Lines shorter than COL_INDEX_MIN_LEN
+   bytes are never indexed, and checkpoints are about COL_INDEX_STEP bytes
+   apart. */
+
+#define COL_INDEX_MIN_LEN (16 * 1024)
+#define COL_INDEX_STEP    1024
+
+typedef struct {
+	int64_t pos, chars, width, need;
+} col_checkpoint;
+
 #ifndef NDEBUG
 #define assert_line_desc(ld, encoding) {if ((ld)) { \
 	assert((ld)->line_len >= 0);\
@@ -318,14 +335,44 @@ typedef struct {
 #endif
 
 
+/* A compiled command line. a is the action, or an error index with sign
+   inverted if the line could not be parsed; options_error is the error
+   returned instead when only options can be executed. num_arg is the
+   numerical argument (-1 if missing), string_arg the offset of the string
+   argument in the string pool (-1 if missing), and line the offset of the
+   command line in the macro source. */
+
+typedef struct {
+	int64_t num_arg, string_arg, line;
+	int a, options_error;
+	encoding_type encoding;
+} macro_cmd;
+
+
+/* A compiled macro: a private copy of the macro source, the array of its
+   compiled command lines, and a pool containing their string arguments. It
+   is reference counted, so that it can be freed (e.g., by UnloadMacros)
+   while it is being executed. */
+
+typedef struct {
+	int refs;
+	int64_t count;
+	macro_cmd *cmd;
+	char *source;
+	char_stream *strings;
+} compiled_macro;
+
+
 /* This structure defines a macro. A macro is just a stream plus a node, a
    file name and a hash code relative to the filename (it is used to make the
-   search for a given macro quicker). */
+   search for a given macro quicker). The compiled form of the stream is
+   built the first time the macro is executed. */
 
 typedef struct struct_macro_desc {
 	struct struct_macro_desc *next;
 	char *name;
 	char_stream *cs;
+	compiled_macro *cm;
 } macro_desc;
 
 #ifndef NDEBUG
@@ -335,24 +382,6 @@ typedef struct struct_macro_desc {
 #endif
 
 
-/* This structure defines a clip. Clip are numbered from 0 onwards, and
-   contain a stream of characters. The stream may be optionally marked as UTF-8. */
-
-typedef struct {
-	node cd_node;
-	int n;
-	char_stream *cs;
-} clip_desc;
-
-#ifndef NDEBUG
-#define assert_clip_desc(cd) {if ((cd)) {\
-	assert((cd)->n >= 0);\
-	assert_char_stream((cd)->cs);\
-}}
-#else
-#define assert_clip_desc(cd) ;
-#endif
-
 /* An undo step is given by a position, a transformation which can be
    INSERT_CHAR or DELETE_CHAR and the length of the stream to which the
    transformation applies. For compactness reasons, the transformation is
@@ -370,37 +399,67 @@ typedef struct {
 
 
 
-/* This structure defines an undo buffer. steps points to an array of
-   steps_size undo_steps, used up to cur_step. last_step represent the undo step
-   which is the next to be redone in case some undo had place. Note that the
-   characters stored in streams, which are used when executing an insertion undo
-   step, are not directly pointed to by the undo step. The correct position is
-   calculated incrementally, and kept in cur_stream and last_stream.  Redo
-   contains the stream of characters necessary to perform the redo
-   steps. last_save_step is the step (if any) corresponding to the last successful
-   buffer save operation. */
+/* This structure defines a byte array used by the undo system. Only the
+   window of offsets [base..top) is kept in memory, in data, which has size
+   bytes allocated; the rest, if any, has been moved to the spill file (see
+   undo.c). */
+
+typedef struct {
+	char *data;
+	int64_t size;
+	int64_t base;
+	int64_t top;
+	FILE *spill;
+} undo_array;
+
+#ifndef NDEBUG
+#define assert_undo_array(ua) {\
+	assert((ua)->base<=(ua)->top);\
+	assert((ua)->top-(ua)->base<=(ua)->size);\
+}
+#else
+#define assert_undo_array(ua) ;
+#endif
+
+
+/* This structure defines an undo buffer. Undo steps are not kept as an array
+   of undo_steps: they are encoded in a compact log (see undo.c), used up to
+   cur_offset, which is the offset at which step cur_step starts. last_step
+   represent the undo step which is the next to be redone in case some undo had
+   place, and last_offset the end of its encoding. cur_line is the line of the
+   step preceding cur_step (0 if there is no such step), since lines are
+   recorded as differences. Note that the characters stored in streams, which
+   are used when executing an insertion undo step, are not directly pointed to
+   by the undo step. The correct position is calculated incrementally, and kept
+   in cur_stream and last_stream.  Redo contains the stream of characters
+   necessary to perform the redo steps. last_save_step is the step (if any)
+   corresponding to the last successful buffer save operation. journal_checked
+   is true if we already looked for an undo journal (see undo.c). */
 
 typedef struct {
-	undo_step *steps;
-	char *streams;
+	undo_array steps;
+	undo_array streams;
 	char_stream redo;
-	int64_t steps_size;
-	int64_t streams_size;
 	int64_t cur_step;
 	int64_t cur_stream;
 	int64_t last_step;
 	int64_t last_stream;
 	int64_t last_save_step;
+	int64_t cur_offset;
+	int64_t last_offset;
+	int64_t cur_line;
+	bool journal_checked;
 } undo_buffer;
 
 #ifndef NDEBUG
 #define assert_undo_buffer(ub) {if ((ub)) {\
 	assert((ub)->cur_step<=(ub)->last_step);\
 	assert((ub)->cur_stream<=(ub)->last_stream);\
-	assert((ub)->cur_step<=(ub)->steps_size);\
-	assert((ub)->cur_stream<=(ub)->streams_size);\
-	assert((ub)->last_step<=(ub)->steps_size);\
-	assert((ub)->last_stream<=(ub)->streams_size);\
+	assert((ub)->cur_offset<=(ub)->last_offset);\
+	assert((ub)->steps.top<=(ub)->last_offset);\
+	assert((ub)->streams.top<=(ub)->last_stream);\
+	assert_undo_array(&(ub)->steps);\
+	assert_undo_array(&(ub)->streams);\
 	assert_char_stream(&(ub)->redo);\
 }}
 #else
@@ -445,6 +504,16 @@ typedef struct {
 #define assert_options(o) ;
 #endif
 
+/* The identity of the on-disk version of a file: a file has changed if its
+   modification time (with full precision), inode or size differ. A zeroed
+   stamp denotes a file that does not exist (or a buffer never loaded or saved). */
+
+typedef struct {
+	struct timespec mtime;
+	ino_t ino;
+	off_t size;
+} file_stamp;
+
 /* This structure defines a buffer node; a buffer is composed by two lists,
    the list of line descriptor pools and the list of character pools, plus some
    data as the current window and cursor position. The line descriptors are
@@ -468,7 +537,9 @@ typedef struct {
 	char *find_string;
 	char *replace_string;
 	char *command_line;
-	unsigned long mtime;      /* mod time of on-disk file when it was last loaded/saved, or 0 */
+	file_stamp stamp;         /* stamp of the on-disk file when it was last loaded/saved, or zeroed */
+	int watch;                /* The inotify watch on the directory of filename, or 0 (see watch.c). */
+	char *watch_name;         /* The name of the watched file within that directory, or NULL. */
 	int64_t win_x, win_y;     /* line and pos of upper left-most visible character. */
 	int cur_x, cur_y;         /* position of cursor within the window */
 	int64_t wanted_x;         /* desired x position modulo short lines, tabs, etc. Valid only if x_wanted is true. */
@@ -486,6 +557,8 @@ typedef struct {
 	} automatch;
 	int64_t allocated_chars;
 	int64_t free_chars;
+	int64_t reserved_chars;   /* minimum size of the next character pool (see reserve_chars()) */
+	int shared_clips;         /* number of clips referring to the text of this buffer (see materialize_clip()) */
 	encoding_type encoding;
 	undo_buffer undo;
 	struct {
@@ -497,6 +570,8 @@ typedef struct {
 	int cur_bookmark;           /* For Goto(Next|Prev)Bookmark. */
 
 	struct high_syntax *syn;    /* Syntax loaded for this buffer. */
+	struct word_index *word_index; /* Index of the words of this buffer for autocompletion, or NULL. */
+	struct bracket_index *bracket_index; /* Index of the brackets of this buffer for MatchBracket, or NULL. */
 	uint32_t *attr_buf;              /* If attr_len >= 0, a pointer to the list of *current* attributes of the *current* line. */ 
 	int64_t attr_size;              /* attr_buf size. */
 	int64_t attr_len;               /* attr_buf valid number of characters, or -1 to denote that attr_buf is not valid. */
@@ -519,7 +594,9 @@ typedef struct {
 		atomic_undo:1,           /* subsequent commands undo as a block */
 		executing_macro:1,       /* We are currently executing a macro. */
 		executing_internal_macro:1,  /* We are currently executing the internal macro of the current buffer */
-		is_CRLF:1;               /* Buffer should be saved with CR/LF terminators */
+		is_CRLF:1,               /* Buffer should be saved with CR/LF terminators */
+		changed_on_disk:1,       /* The file has been changed by someone else since last load/save */
+		following:1;             /* Text appended to the file is appended to the buffer (see follow_file()) */
 
 	unsigned int find_string_changed; /* 0 = unset; 1 = force; else prior search's serial number */
 
@@ -562,6 +639,32 @@ typedef struct {
 #define assert_buffer_content(b);
 #endif
 
+/* This structure defines a clip. Clip are numbered from 0 onwards, and
+   contain a stream of characters. The stream may be optionally marked as UTF-8.
+   A clip that has not been materialized yet refers instead to the len bytes
+   of the document src starting at position pos of the line ld (see
+   materialize_clip()); its stream is empty. */
+
+typedef struct {
+	node cd_node;
+	int n;
+	char_stream *cs;
+	buffer *src;              /* the document the clip refers to, or NULL if the clip has been materialized */
+	line_desc *ld;
+	int64_t pos, len;
+	encoding_type encoding;   /* the encoding of src when the clip was copied */
+} clip_desc;
+
+#ifndef NDEBUG
+#define assert_clip_desc(cd) {if ((cd)) {\
+	assert((cd)->n >= 0);\
+	assert_char_stream((cd)->cs);\
+	assert((cd)->src == NULL || (cd)->cs->len == 0);\
+}}
+#else
+#define assert_clip_desc(cd) ;
+#endif
+
 #include "syntax.h"
 
 extern const char *key_binding[];
@@ -608,6 +711,40 @@ extern bool fast_gui;
 extern bool verbose_macros;
 
 
+/* Saved files are committed to disk with fsync() */
+
+extern bool sync_save;
+
+
+/* Unmodified documents are reloaded when their file changes on disk */
+
+extern bool auto_reload;
+
+
+/* The memory budget of each undo buffer, in kilobytes (0 means no limit).
+   Older undo history exceeding the budget is spilled to disk. */
+
+#define DEFAULT_UNDO_MEMORY (64 * 1024)
+
+extern int undo_memory;
+
+
+/* Undo history is saved in a journal and restored across sessions */
+
+extern bool undo_journal;
+
+
+/* If true, we are processing files with --batch, and there is no terminal. */
+
+extern bool batch_mode;
+
+
+/* If true, the session of the client served by a server is over (see
+   server.c). */
+
+extern bool detaching;
+
+
 /* If true, we want syntax highlighting. */
 
 extern bool do_syntax;
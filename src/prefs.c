@@ -194,6 +194,10 @@ int save_prefs(buffer * const b, const char * const name) {
 			if (fast_gui)        record_action(cs, FASTGUI_A,       fast_gui,       NULL, verbose_macros);
 			if (!status_bar)     record_action(cs, STATUSBAR_A,     status_bar,     NULL, verbose_macros);
 			if (!verbose_macros) record_action(cs, VERBOSEMACROS_A, verbose_macros, NULL, verbose_macros);
+			if (sync_save)       record_action(cs, SYNCSAVE_A,      sync_save,      NULL, verbose_macros);
+			if (auto_reload)     record_action(cs, AUTORELOAD_A,    auto_reload,    NULL, verbose_macros);
+			if (undo_journal)    record_action(cs, UNDOJOURNAL_A,   undo_journal,   NULL, verbose_macros);
+			if (undo_memory != DEFAULT_UNDO_MEMORY) record_action(cs, UNDOMEMORY_A, undo_memory, NULL, verbose_macros);
 			saving_defaults = false;
 		}
 
@@ -26,6 +26,10 @@ int do_action(buffer *b, action a, int64_t c, char *p);
 
 /* autocomp.c */
 char *autocomplete(char *p, char *req_msg, const int ext, int * const error);
+void word_index_modify(buffer *b, const line_desc *ld);
+void word_index_add(buffer *b, const line_desc *ld);
+void word_index_remove(buffer *b, const line_desc *ld);
+void free_word_index(buffer *b);
 
 /* buffer.c */
 encoding_type detect_buffer_encoding(const buffer *b);
@@ -46,6 +50,7 @@ int save_all_modified_buffers(void);
 line_desc *alloc_line_desc(buffer *b);
 void free_line_desc(buffer *b, line_desc *ld);
 char *alloc_chars(buffer *b, int64_t len);
+void reserve_chars(buffer *b, int64_t len);
 int64_t alloc_chars_around(buffer *b, line_desc *ld, int64_t n, bool check_first_before);
 void free_chars(buffer *b, char *p, int64_t len);
 int insert_one_line(buffer *b, line_desc *ld, int64_t line, int64_t pos);
@@ -57,10 +62,12 @@ int insert_one_char(buffer *b, line_desc *ld, int64_t line, int64_t pos, int c);
 int insert_spaces(buffer *b, line_desc *ld, int64_t line, int64_t pos, int64_t n);
 int delete_stream(buffer *b, line_desc *ld, int64_t line, int64_t pos, int64_t len);
 int delete_one_char(buffer *b, line_desc *ld, int64_t line, int64_t pos);
+int reorder_lines(buffer *b, line_desc *ld, int64_t line, line_desc **lds, int64_t n, int64_t m);
 void change_filename(buffer *b, char *name);
 void ensure_attr_buf(buffer * const b, const int64_t capacity);
 int load_file_in_buffer(buffer *b, const char *name);
 int load_fd_in_buffer(buffer *b, int fd);
+int append_fd_to_buffer(buffer *b, int fd, off_t *pos);
 int save_buffer_to_file(buffer *b, const char *name);
 void auto_save(buffer *b);
 void reset_syntax_states(buffer *b);
@@ -71,9 +78,12 @@ clip_desc *realloc_clip_desc(clip_desc *cd, int n, int64_t size);
 void free_clip_desc(clip_desc *cd);
 int is_encoding_neutral(clip_desc *cd);
 clip_desc *get_nth_clip(int n);
+int materialize_clip(clip_desc *cd);
+void unshare_clips(buffer *b);
 int copy_to_clip(buffer *b, int n, bool cut);
 int erase_block(buffer *b, const bool update);
 int paste_to_buffer(buffer *b, int n);
+int paste_stream_to_buffer(buffer *b, const char *stream, int64_t len);
 int copy_vert_to_clip(buffer *b, int n, bool cut);
 int erase_vert_block(buffer *b, const bool update);
 int paste_vert_to_buffer(buffer *b, int n);
@@ -88,6 +98,9 @@ int execute_command_line(buffer *b, const char *command_line);
 macro_desc *alloc_macro_desc(void);
 void free_macro_desc(macro_desc *md);
 void record_action(char_stream *cs, action a, int64_t c, const char *p, bool verbose);
+compiled_macro *compile_macro(const char_stream *cs);
+void release_compiled_macro(compiled_macro *cm);
+int run_compiled_macro(buffer *b, compiled_macro *cm);
 int play_macro(buffer *b, char_stream *cs);
 macro_desc *load_macro(const char *name);
 int execute_macro(buffer *b, const char *name);
@@ -101,6 +114,7 @@ void optimize_macro(char_stream *cs, bool verbose);
 void update_syntax_states(buffer *b, int row, line_desc *ld, line_desc *end_ld);
 int highlight_cmp(HIGHLIGHT_STATE *x, HIGHLIGHT_STATE *y);
 void delay_update();
+void defer_display(bool defer);
 void output_line_desc(int row, int col, const line_desc *ld, int64_t start, int64_t len, int tab_size, bool cleared_at_end, bool utf8, const uint32_t * const attr, const uint32_t * const diff, const int64_t diff_size);
 void update_line(buffer *b, line_desc *ld, int n, int64_t start_x, bool cleared_at_end);
 void update_window_lines(buffer *b, line_desc *ld, int start_line, int end_line, bool doit);
@@ -120,6 +134,8 @@ void automatch_bracket(buffer * const b, const bool show);
 int to_upper(buffer *b);
 int to_lower(buffer *b);
 int capitalize(buffer *b);
+void bracket_index_modify(buffer *b, int64_t line, bool lines_changed);
+void free_bracket_index(buffer *b);
 int match_bracket(buffer *b);
 int find_matching_bracket(buffer *b, const int64_t min_line, const int64_t max_line, int64_t *match_line, int64_t *match_pos, int *c, line_desc ** ld);
 int64_t word_wrap(buffer *b);
@@ -128,6 +144,7 @@ int center(buffer *b);
 int auto_indent_line(buffer * const b, const int64_t line, line_desc * const ld, const int64_t up_to_col);
 int backtab(buffer *b);
 int shift(buffer *b, char *p, char *msg, int msg_size);
+int sort_lines(buffer *b, bool uniq);
 
 /* errors.c */
 
@@ -152,6 +169,7 @@ void read_key_capabilities(void);
 void set_escape_time(int new_escape_time);
 int get_key_code(void);
 int key_may_set(const char * const cap_string, int code);
+char *get_paste_stream(int64_t * const len);
 
 /* menu.c */
 void print_message(const char *message);
@@ -203,6 +221,8 @@ void move_inc_up(buffer *b);
 buffer *new_buffer(void);
 bool delete_buffer(void);
 void about(void);
+buffer *load_files(int argc, char * const *argv, const char *skiplist, buffer *stdin_buffer, bool *first_file);
+void main_loop(void);
 void automatch_bracket(buffer *b, bool show);
 
 /* prefs.c */
@@ -238,6 +258,8 @@ int   req_list_del(req_list * const rl, int nth);
 void  req_list_free(req_list * const rl);
 int   req_list_init(req_list * const rl, int cmpfnc(const char *, const char *), const bool allow_dupes, const bool allow_reorder, const char suffix);
 char *req_list_add(req_list * const rl, char * const str, const int suffix);
+int   req_list_append(req_list * const rl, const char * const str, const int suffix);
+void  req_list_sort(req_list * const rl);
 void  req_list_finalize(req_list * const rl);
 
 
@@ -269,6 +291,7 @@ char_stream *load_stream(char_stream *cs, const char *name, bool preserve_cr, bo
 char_stream *load_stream_from_fd(char_stream *cs, int fd, bool preserve_cr, bool binary);
 int save_stream(const char_stream *cs, const char *name, bool CRLF, bool binary);
 int save_stream_to_fd(const char_stream *cs, int fd, bool CRLF, bool binary);
+int filter_stream(const char_stream *in, char_stream *out, const char *command, bool CRLF, bool binary, bool preserve_cr);
 
 int delete_from_stream(char_stream *cs, int64_t p, int64_t len);
 int insert_in_stream(char_stream *cs, const char *s, int64_t p, int64_t len);
@@ -278,10 +301,12 @@ bool same_str(const char *p, const char *q);
 char *ne_getcwd(const int bufsize);
 char *relative_file_path(const char *a, const char *b);
 char *absolute_file_path(const char *a, const char *b);
+void normalize_path(char *c);
 const char *get_global_dir(void);
 const char *tilde_expand(const char *filename);
 const char *file_part(const char *pathname);
-unsigned long file_mod_time(const char *filename);
+bool get_file_stamp(const char *filename, file_stamp *stamp);
+bool same_file_stamp(const file_stamp *s, const file_stamp *t);
 ssize_t read_safely(const int fd, void * const buf, const int64_t len);
 bool buffer_file_modified(const buffer *b, const char *name);
 char *str_dup(const char *s);
@@ -301,14 +326,36 @@ bool is_directory(const char *name);
 encoding_type detect_encoding(const char *s, int64_t len);
 int context_prefix(const buffer *b, char **p, int64_t *prefix_pos);
 line_desc *nth_line_desc(const buffer *b, const int64_t n);
+bool col_index_by_pos(const line_desc *ld, int64_t pos, int tab_size, encoding_type encoding, col_checkpoint *cp);
+bool col_index_by_width(const line_desc *ld, int64_t width, int tab_size, encoding_type encoding, col_checkpoint *cp);
+bool col_index_by_col(const line_desc *ld, int64_t col, int tab_size, encoding_type encoding, col_checkpoint *cp);
+void col_index_invalidate(const line_desc *ld);
 const char *cur_bookmarks_string(const buffer *b);
 
+/* server.c */
+void attach_to_server(int argc, char * const *argv);
+bool serving_client(void);
+bool suspend_client(void);
+buffer *resident_buffer(const char *name);
+void leave_ne(void);
+void terminal_lost(void);
+int serve(int argc, char * const *argv, const char *skiplist);
+
 /* undo.c */
 void start_undo_chain(buffer *b);
-void end_undo_chain(buffer *b);
-int add_undo_step(buffer *b, int64_t line, int64_t pos, int64_t len);
+int end_undo_chain(buffer *b);
+int add_undo_step(buffer *b, int64_t line, int64_t pos, int64_t len, bool extendable);
 void fix_last_undo_step(buffer *b, int64_t delta);
 int add_to_undo_stream(undo_buffer *ub, const char *p, int64_t len);
 void reset_undo_buffer(undo_buffer *ub);
+int save_undo_journal(buffer *b, const char *filename, const file_stamp *stamp);
 int undo(buffer *b);
 int redo(buffer *b);
+
+/* watch.c */
+void watch_buffer(buffer *b);
+void unwatch_buffer(buffer *b);
+void wake_on_file_change(bool wake);
+void check_watched_files(void);
+int follow_file(buffer *b);
+int set_following(buffer *b, bool follow);
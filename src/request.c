@@ -22,6 +22,7 @@
 #include "ne.h"
 #include "termchar.h"
 #include <dirent.h>
+#include <time.h>
 
 
 /* request_strings() prompts the user to choose one between several (cur_entries) strings,
@@ -261,6 +262,134 @@ static void request_move_right(void) {
 	}
 }
 
+/* Fuzzy matching uses an index of rl0->entries sorted by case-folded
+   contents. Entries sharing a prefix form a contiguous range of the index,
+   so the range matching one more character can be found by binary search
+   within the current one. For the highlighted entry we keep the ranges
+   matching each of its prefixes, so counting matches is a subtraction. The
+   index is built on the first keystroke, and discarded whenever rl0 is
+   modified. */
+
+static int *fuzz_index, *fuzz_mark;
+static int *range_lo, *range_hi;
+static const char *range_p0;
+
+static int fold_cmp(const char *s, const char *t) {
+	for(;; s++, t++) {
+		const int c = localised_up_case[(unsigned char)*s], d = localised_up_case[(unsigned char)*t];
+		if (c != d || !c) return c - d;
+	}
+}
+
+static int intcmpp(const void *a, const void *b) {
+	const int i = *(const int *)a, j = *(const int *)b;
+	return (i > j) - (i < j);
+}
+
+static int fuzz_index_cmp(const void *a, const void *b) {
+	const int i = *(const int *)a, j = *(const int *)b;
+	const int cmp = fold_cmp(rl0->entries[i], rl0->entries[j]);
+	return cmp ? cmp : i - j;
+}
+
+static void free_fuzz_index(void) {
+	free(fuzz_index);
+	free(fuzz_mark);
+	free(range_lo);
+	free(range_hi);
+	fuzz_index = fuzz_mark = range_lo = range_hi = NULL;
+	range_p0 = NULL;
+}
+
+static bool build_fuzz_index(void) {
+	if (fuzz_index) return true;
+	const int n = rl0->cur_entries;
+	fuzz_index = malloc(sizeof *fuzz_index * n);
+	fuzz_mark = malloc(sizeof *fuzz_mark * n);
+	range_lo = malloc(sizeof *range_lo * (rl0->max_entry_len + 2));
+	range_hi = malloc(sizeof *range_hi * (rl0->max_entry_len + 2));
+	if (!fuzz_index || !fuzz_mark || !range_lo || !range_hi) {
+		free_fuzz_index();
+		return false;
+	}
+	for(int i = 0; i < n; i++) fuzz_index[i] = i;
+	qsort(fuzz_index, n, sizeof *fuzz_index, fuzz_index_cmp);
+	return true;
+}
+
+/* Narrows *lo and *hi, a range of entries sharing their first len characters,
+   to the entries whose next character folds to c. */
+
+static void narrow_range(int * const lo, int * const hi, const int len, const int c) {
+	int l = *lo, r = *hi;
+	while(l < r) {
+		const int m = (l + r) / 2;
+		if (localised_up_case[(unsigned char)rl0->entries[fuzz_index[m]][len]] < c) l = m + 1;
+		else r = m;
+	}
+	*lo = l;
+	r = *hi;
+	while(l < r) {
+		const int m = (l + r) / 2;
+		if (localised_up_case[(unsigned char)rl0->entries[fuzz_index[m]][len]] <= c) l = m + 1;
+		else r = m;
+	}
+	*hi = l;
+}
+
+/* Sets up range_lo[len] and range_hi[len] so that they delimit the entries
+   matching the first len characters of p0, for each len up to strlen(p0). */
+
+static void set_prefix_ranges(const char * const p0) {
+	if (p0 == range_p0) return;
+	range_lo[0] = 0;
+	range_hi[0] = rl0->cur_entries;
+	for(int len = 0; p0[len]; len++) {
+		range_lo[len + 1] = range_lo[len];
+		range_hi[len + 1] = range_hi[len];
+		narrow_range(&range_lo[len + 1], &range_hi[len + 1], len, localised_up_case[(unsigned char)p0[len]]);
+	}
+	range_p0 = p0;
+}
+
+/* Sets rl.entries[] to the entries in a range of the index, in their
+   original order, and returns the index of p0 in rl (or 0 if it is not
+   there). Small ranges are sorted; large ones are marked and collected by
+   a scan of rl0. */
+
+static int set_rl_entries(const int lo, const int hi, const char * const p0) {
+	const int k = hi - lo, n0 = rl0->cur_entries;
+	int n = 0;
+	if ((int64_t)k * 32 < n0) {
+		memcpy(fuzz_mark, fuzz_index + lo, k * sizeof *fuzz_mark);
+		qsort(fuzz_mark, k, sizeof *fuzz_mark, intcmpp);
+		for(int i = 0; i < k; i++) {
+			if ((rl.entries[i] = rl0->entries[fuzz_mark[i]]) == p0) n = i;
+		}
+	}
+	else {
+		memset(fuzz_mark, 0, n0 * sizeof *fuzz_mark);
+		for(int i = lo; i < hi; i++) fuzz_mark[fuzz_index[i]] = 1;
+		for(int i = 0, j = 0; i < n0; i++)
+			if (fuzz_mark[i]) {
+				if ((rl.entries[j] = rl0->entries[i]) == p0) n = j;
+				j++;
+			}
+	}
+	rl.cur_entries = k;
+	return n;
+}
+
+/* Returns the length of the prefix common to all entries in a range of
+   the index, that is, to its first and last entry. */
+
+static int range_prefix_len(const int lo, const int hi) {
+	const char * const s = rl0->entries[fuzz_index[lo]], * const t = rl0->entries[fuzz_index[hi - 1]];
+	int len;
+	for(len = 0; s[len] && localised_up_case[(unsigned char)s[len]] == localised_up_case[(unsigned char)t[len]]; len++);
+	return len;
+}
+
 /* Reorder (i.e. swap) the current entry n with entry n+dir. dir should be
    either 1 or -1. */
 static bool request_reorder(const int dir) {
@@ -289,6 +418,7 @@ static bool request_reorder(const int dir) {
 
 	rl0->entries[i0] = p1;
 	rl0->entries[i1] = p0;
+	free_fuzz_index();
 
 	page = -1; /* causes normalize() to call print_strings() */
 	normalize(n1);
@@ -303,6 +433,10 @@ static bool request_reorder(const int dir) {
 
 static int reset_rl_entries() {
 	const char * const p0 = rl.entries[PXY2N(page, x, y)];
+	if (prune && build_fuzz_index()) {
+		set_prefix_ranges(p0);
+		return set_rl_entries(range_lo[fuzz_len], range_hi[fuzz_len], p0);
+	}
 	int i, n;
 	for (int j = n = i = 0; j < rl0->cur_entries; j++) {
 		char * const p1 = rl0->entries[j];
@@ -322,6 +456,10 @@ static int count_fuzz_matches(const int len) {
 	const char * const p0 = rl.entries[n0];
 	if (len <= 0) return rl.cur_entries;
 	if (len > strlen(p0)) return 1;
+	if (build_fuzz_index()) {
+		set_prefix_ranges(p0);
+		return range_hi[len] - range_lo[len];
+	}
 	int c;
 	for (int i = c = 0; i < rl.cur_entries; i++) {
 		if ( ! strncasecmp(p0, rl.entries[i], len)) c++;
@@ -355,7 +493,12 @@ static void fuzz_back() {
 	const char * const p0 = rl.entries[PXY2N(page, x, y)];
 	int n1 = n0;
 	if (fuzz_len == 0) return;
-	if (prune) {
+	if (prune && build_fuzz_index()) {
+		set_prefix_ranges(p0);
+		do fuzz_len--; while (fuzz_len > 0 && range_hi[fuzz_len] - range_lo[fuzz_len] == orig_entries);
+		n1 = set_rl_entries(range_lo[fuzz_len], range_hi[fuzz_len], p0);
+	}
+	else if (prune) {
 		while (rl.cur_entries == orig_entries && fuzz_len > 0) {
 			fuzz_len = max(0, fuzz_len-1);
 			n1 = reset_rl_entries();
@@ -405,7 +548,17 @@ static void fuzz_forward(const int c) {
 
 	assert(fuzz_len >= 0);
 
-	if (prune) {
+	if (prune && build_fuzz_index()) {
+		set_prefix_ranges(p0);
+		int lo = range_lo[fuzz_len], hi = range_hi[fuzz_len];
+		narrow_range(&lo, &hi, fuzz_len, c);
+		if (lo < hi) {
+			const int n1 = set_rl_entries(lo, hi, p0);
+			fuzz_len = range_prefix_len(lo, hi);
+			page = -1; /* causes normalize() to call print_strings() */
+			normalize(n1);
+		}
+	} else if (prune) {
 		int i = 0, n1 = 0;
 		for (int j = 0; j < rl.cur_entries; j++) {
 			char * const p1 = rl.entries[j];
@@ -422,6 +575,25 @@ static void fuzz_forward(const int c) {
 			page = -1; /* causes normalize() to call print_strings() */
 			normalize(n1);
 		}
+	} else if (build_fuzz_index()) {
+		/* find the next matching string, possibly wrapping around; here
+		   rl.entries[] is a copy of rl0->entries[] */
+		set_prefix_ranges(p0);
+		int lo = range_lo[fuzz_len], hi = range_hi[fuzz_len], n = -1, dist = 0;
+		narrow_range(&lo, &hi, fuzz_len, c);
+		for(int i = lo; i < hi; i++) {
+			const int d = (fuzz_index[i] - n0 + rl.cur_entries) % rl.cur_entries;
+			if (n < 0 || d < dist) {
+				n = fuzz_index[i];
+				dist = d;
+			}
+		}
+		if (n >= 0) {
+			fuzz_len++;
+			page = -1;
+			normalize(n);
+		}
+		shift_fuzz(1);
 	} else {
 		/* find the next matching string, possibly wrapping around */
 		for (int n=n0, i=rl.cur_entries; i; i--, n=(n+1)%rl.cur_entries) {
@@ -459,6 +631,7 @@ static int request_strings_init(req_list *rlp0) {
 	rl.reordered = rl0->reordered;
 	rl.cur_chars = rl.alloc_chars = 0;
 	rl.chars = NULL;
+	free_fuzz_index();
 	fuzz_len = common_prefix_len(&rl);
 	/* prune = false; */
 	return rl.cur_entries;
@@ -475,6 +648,7 @@ static int request_strings_cleanup(bool reordered) {
 	}
 	if (rl.entries) free(rl.entries);
 	rl.entries = NULL;
+	free_fuzz_index();
 	rl0->reordered = reordered;
 	return n;
 }
@@ -498,6 +672,9 @@ int request_strings(req_list *rlp0, int n) {
 
 	assert(rlp0->cur_entries > 0);
 
+	/* In batch mode, we act as if the user escaped. */
+	if (batch_mode) return -1;
+
 	int ne_lines0 = 0, ne_columns0 = 0;
 	bool reordered = false;
 	max_names_per_line = max_names_per_col = x = y = page = fuzz_len = 0;
@@ -543,6 +720,10 @@ int request_strings(req_list *rlp0, int n) {
 
 		switch(ic) {
 			case INVALID:
+				if (detaching) { /* The terminal went away. */
+					request_strings_cleanup(reordered);
+					return -1;
+				}
 				/* ignore and move on */
 				break;
 
@@ -570,6 +751,21 @@ int request_strings(req_list *rlp0, int n) {
 
 			case COMMAND:
 				if (c < 0) c = -c - 1;
+
+				/* A bracketed paste is typed into the filter up to its first line
+				   terminator. */
+
+				if (c == NE_KEY_PASTE) {
+					int64_t len;
+					char * const stream = get_paste_stream(&len);
+					if (stream) {
+						for(const char *s = stream; *s; s++) fuzz_forward(localised_up_case[(unsigned char)*s]);
+						free(stream);
+					}
+					else alert();
+					break;
+				}
+
 				const int a = parse_command_line(key_binding[c], NULL, NULL, false);
 				if (a >= 0) {
 					switch(a) {
@@ -759,7 +955,7 @@ static void load_syntax_names(req_list *rl, DIR *d, int flag) {
 		if (len > extlen && !strcmp(de->d_name+len - extlen, SYNTAX_EXT)) {
 			char ch = de->d_name[len-extlen];
 			de->d_name[len-extlen] = '\0';
-			if (!req_list_add(rl, de->d_name, flag)) break;
+			if (req_list_append(rl, de->d_name, flag) != OK) break;
 			de->d_name[len-extlen] = ch;
 		}
 	}
@@ -794,6 +990,8 @@ char *request_syntax() {
 			closedir(d);
 		}
 	}
+	/* Names from the user's directory come first, so they take precedence. */
+	req_list_sort(&rl);
 	req_list_finalize(&rl);
 	p = NULL;
 	int result;
@@ -813,6 +1011,137 @@ char *request_syntax() {
 }
 
 
+/* The file requester keeps a small cache of directory listings, so that
+   moving back and forth between directories does not require reading them
+   again. A listing is identified by the device and inode of its directory,
+   and it is valid as long as the modification and change times of the
+   directory are the same. Each entry is stored in names as a flag byte
+   (true for directories) followed by the NUL-terminated name; entries are
+   sorted using filenamecmp(). */
+
+#define DIR_CACHE_SIZE 8
+
+static struct dir_listing {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime, ctime;
+	bool valid;
+	unsigned int age;
+	int n;
+	int64_t len;
+	char *names;
+} dir_cache[DIR_CACHE_SIZE];
+
+static unsigned int dir_cache_clock;
+
+static int dir_entry_cmp(const void *a, const void *b) {
+	return filenamecmp(*(const char **)a + 1, *(const char **)b + 1);
+}
+
+/* Reads the directory d and stores in dl a sorted listing. Directories are
+   recognized using d_type; only when the file system does not provide it,
+   or the entry is a symbolic link, we fstatat() the entry. Returns false on
+   lack of memory or if the user interrupted the operation. */
+
+static bool read_dir_listing(DIR * const d, struct dir_listing * const dl) {
+	int64_t len = 0, size = 16 * 1024;
+	int n = 0;
+	char *names = malloc(size);
+	if (!names) return false;
+
+	const int fd = dirfd(d);
+	stop = false;
+	for(struct dirent * de; !stop && (de = readdir(d)); n++) {
+		bool is_dir = false;
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (de->d_type == DT_DIR) is_dir = true;
+		else if (de->d_type == DT_LNK || de->d_type == DT_UNKNOWN)
+#endif
+		{
+			struct stat st;
+			is_dir = fstatat(fd, de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		const int64_t l = strlen(de->d_name) + 2;
+		if (len + l > size) {
+			char * const p = realloc(names, size = size * 2 + l);
+			if (!p) {
+				free(names);
+				return false;
+			}
+			names = p;
+		}
+		names[len] = is_dir;
+		strcpy(names + len + 1, de->d_name);
+		len += l;
+	}
+
+	char ** const entry = malloc(sizeof *entry * (n + 1));
+	char * const sorted = malloc(len + 1);
+	if (stop || !entry || !sorted) {
+		free(entry);
+		free(sorted);
+		free(names);
+		return false;
+	}
+
+	char *p = names;
+	for(int i = 0; i < n; i++, p += strlen(p + 1) + 2) entry[i] = p;
+	qsort(entry, n, sizeof *entry, dir_entry_cmp);
+
+	p = sorted;
+	for(int i = 0; i < n; i++) {
+		const int l = strlen(entry[i] + 1) + 2;
+		memcpy(p, entry[i], l);
+		p += l;
+	}
+
+	free(entry);
+	free(names);
+	free(dl->names);
+	dl->names = sorted;
+	dl->n = n;
+	dl->len = len;
+	return true;
+}
+
+/* Returns a listing of d, either from the cache or by reading the directory,
+   or NULL on failure. */
+
+static const struct dir_listing *get_dir_listing(DIR * const d) {
+	struct stat st;
+	if (fstat(dirfd(d), &st)) return NULL;
+
+	struct dir_listing *dl = dir_cache;
+	for(int i = 0; i < DIR_CACHE_SIZE; i++) {
+		struct dir_listing * const c = &dir_cache[i];
+		if (c->valid && c->dev == st.st_dev && c->ino == st.st_ino) {
+			if (c->mtime.tv_sec == st.st_mtim.tv_sec && c->mtime.tv_nsec == st.st_mtim.tv_nsec
+				&& c->ctime.tv_sec == st.st_ctim.tv_sec && c->ctime.tv_nsec == st.st_ctim.tv_nsec) {
+				c->age = ++dir_cache_clock;
+				return c;
+			}
+			dl = c;
+			break;
+		}
+		if (!c->valid || c->age < dl->age) dl = c;
+	}
+
+	dl->valid = false;
+	if (!read_dir_listing(d, dl)) return NULL;
+
+	/* A directory modified within the granularity of its time stamps might
+	   change again without any visible effect, so we do not trust it. */
+	dl->valid = time(NULL) > st.st_mtim.tv_sec + 1 && time(NULL) > st.st_ctim.tv_sec + 1;
+	dl->dev = st.st_dev;
+	dl->ino = st.st_ino;
+	dl->mtime = st.st_mtim;
+	dl->ctime = st.st_ctim;
+	dl->age = ++dir_cache_clock;
+	return dl;
+}
+
+
 /* This is the file requester. It reads the directory in which the filename
    lives, builds an array of strings and calls request_strings(). If a directory
    name is returned, it enters the directory. Returns NULL on error or escaping, a
@@ -846,17 +1175,18 @@ char *request_files(const char * const filename, bool use_prefix) {
 	char *result = NULL;
 	do {
 		next_dir = false;
-		if (req_list_init(&rl, filenamecmp, true, false, '/') != OK) break;
+		/* Listings come already sorted, so we just append entries. */
+		if (req_list_init(&rl, NULL, true, false, '/') != OK) break;
 
 		DIR * const d = opendir(CURDIR);
 		if (d) {
-
-			stop = false;
-			for(struct dirent * de; !stop && (de = readdir(d)); ) {
-				const bool is_dir = is_directory(de->d_name);
-				if (use_prefix && !is_prefix(file_part(filename), de->d_name)) continue;
-				if (!req_list_add(&rl, de->d_name, is_dir)) break;
+			const struct dir_listing * const dl = get_dir_listing(d);
+			const char *p = dl ? dl->names : NULL;
+			for(int i = 0; dl && i < dl->n; i++, p += strlen(p + 1) + 2) {
+				if (use_prefix && !is_prefix(file_part(filename), p + 1)) continue;
+				if (req_list_append(&rl, p + 1, *p) != OK) break;
 			}
+			req_list_sort(&rl);
 
 			req_list_finalize(&rl);
 
@@ -934,11 +1264,13 @@ static int handle_closedoc(int n) {
 
 	if (o == rl0->cur_entries) return n; /* This should never happen. */
 
+	const int pos = o;
 	if (rl0->orig_order) o = rl0->orig_order[o];
 
 	buffer *bp = get_nth_buffer(o);
 
 	if (!bp || bp->is_modified) return n; /* We don't close modified buffers here. */
+	if (serving_client() && !get_nth_buffer(1)) return n; /* Nor the last one of a server (see leave_ne()). */
 
 	/* We've determined we are going to close document *bp. */
 
@@ -954,7 +1286,18 @@ static int handle_closedoc(int n) {
 	if (PXY2N(page, x, y) == rl.cur_entries - 1 && rl.cur_entries > 1)
 		normalize(rl.cur_entries - 2);
 
-	req_list_del(rl0, o);
+	/* After the deletion the pointers in rl.entries are stale, so we record
+	   which entry of rl0 must be highlighted: the current one or, if it is
+	   being deleted, the following one. */
+	n = PXY2N(page, x, y);
+	if (rl.entries[n] == p && n < rl.cur_entries - 1) n++;
+	int h;
+	for (h = 0; h < rl0->cur_entries && rl0->entries[h] != rl.entries[n]; h++) /* empty loop */ ;
+
+	req_list_del(rl0, pos);
+	free_fuzz_index();
+	if (h > pos) h--;
+	if (rl0->cur_entries) rl.entries[PXY2N(page, x, y)] = rl0->entries[h < rl0->cur_entries ? h : 0];
 	n = reset_rl_entries();
 
 	buffer *nextb = (buffer *)bp->b_node.next;
@@ -963,11 +1306,7 @@ static int handle_closedoc(int n) {
 	free_buffer(bp);
 
 	if (! nextb->b_node.next) nextb = (buffer *)buffers.head;
-	if (nextb == (buffer *)&buffers.tail) {
-		close_history();
-		unset_interactive_mode();
-		exit(0);
-	}
+	if (nextb == (buffer *)&buffers.tail) leave_ne();
 
 	if (bp == cur_buffer) cur_buffer = nextb;
 
@@ -1039,6 +1378,8 @@ int request_document(void) {
 
 int req_list_del(req_list * const rl, int nth) {
 
+	assert(!rl->appended);
+
 	if (nth < 0 || nth >= rl->cur_entries ) return ERROR;
 	char * const str = rl->entries[nth];
 	const int len0 = strlen(str);
@@ -1054,7 +1395,7 @@ int req_list_del(req_list * const rl, int nth) {
 	if (rl->orig_order) {
 		int nth0 = rl->orig_order[nth];
 		int skip = 0;
-		for (int i = 0; i < rl->cur_entries; i++) {
+		for (int i = 0; i < rl->cur_entries - 1; i++) {
 			if (i >= nth) skip = 1;
 			int i0 = rl->orig_order[i+skip];
 			rl->orig_order[i] = (i0 >= nth0) ? i0 - 1 : i0;
@@ -1062,7 +1403,7 @@ int req_list_del(req_list * const rl, int nth) {
 	}
 
 	rl->cur_chars -= len;
-	memmove(&rl->entries[nth], &rl->entries[nth+1], sizeof(char *)*(rl->cur_entries - nth));
+	memmove(&rl->entries[nth], &rl->entries[nth+1], sizeof(char *)*(rl->cur_entries - nth - 1));
 	rl->cur_entries--;
 	/* did we just delete longest string? */
 
@@ -1085,6 +1426,7 @@ void req_list_free(req_list * const rl) {
 	rl->allow_reorder = false;
 	rl->cur_entries = rl->alloc_entries = rl->max_entry_len = 0;
 	rl->cur_chars = rl->alloc_chars = 0;
+	rl->appended = rl->appended_chars = 0;
 }
 
 /* Initialize a request list. A comparison function may be provided; if it is provided,
@@ -1104,6 +1446,7 @@ int req_list_init( req_list * const rl, int cmpfnc(const char *, const char *),
 	rl->suffix = suffix;
 	rl->cur_entries = rl->alloc_entries = rl->max_entry_len = 0;
 	rl->cur_chars = rl->alloc_chars = 0;
+	rl->appended = rl->appended_chars = 0;
 	if (rl->entries = malloc(sizeof(char *) * DEF_ENTRIES_ALLOC_SIZE)) {
 		if (rl->chars = malloc(sizeof(char) * DEF_CHARS_ALLOC_SIZE)) {
 			rl->alloc_entries = DEF_ENTRIES_ALLOC_SIZE;
@@ -1128,6 +1471,7 @@ int req_list_init( req_list * const rl, int cmpfnc(const char *, const char *),
    false rather than returning an error. */
 
 void req_list_finalize(req_list * const rl) {
+	assert(!rl->appended);
 	for (int i = 0; i < rl->cur_entries; i++) {
 		const int len = strlen(rl->entries[i]);
 		*(rl->entries[i]+len) = *(rl->entries[i]+len+1);
@@ -1151,6 +1495,7 @@ void req_list_finalize(req_list * const rl) {
    by strcmp if there is not comparison function), then the conflicting entry
    is returned. */
 char *req_list_add(req_list * const rl, char * const str, const int suffix) {
+	assert(!rl->appended);
 	const int len = strlen(str);
 	const int lentot = len + ((rl->suffix && suffix) ? 3 : 2); /* 'a b c \0 Suffix \0' or 'a b c \0 \0' */
 
@@ -1221,3 +1566,103 @@ char *req_list_add(req_list * const rl, char * const str, const int suffix) {
 	return newstr;
 }
 
+/* Lists with many entries should be built by appending all of them with
+   req_list_append(), and then calling req_list_sort(), which sorts the
+   entries with the comparison function (if any) and removes duplicates (if
+   they are not allowed) once; req_list_add() would instead move entries or
+   look for duplicates at each addition. Appended entries are stored
+   consecutively in rl->chars, and their pointers are computed by
+   req_list_sort() starting from their offset, so that growing rl->chars
+   does not require adjusting them. req_list_add() and req_list_del() must
+   not be called between req_list_append() and req_list_sort().
+
+   Returns OK, or OUT_OF_MEMORY. */
+
+int req_list_append(req_list * const rl, const char * const str, const int suffix) {
+	const int len = strlen(str);
+	const int lentot = len + ((rl->suffix && suffix) ? 3 : 2);
+
+	if (rl->cur_chars + lentot > rl->alloc_chars) {
+		/* Only entries preceding the appended ones have pointers; we copy
+		   rl->chars instead of reallocating it, so that they can be rebased
+		   while the old block is still valid. */
+		char * const p = malloc(sizeof(char) * (rl->alloc_chars * 2 + lentot));
+		if (!p) return OUT_OF_MEMORY;
+		memcpy(p, rl->chars, rl->cur_chars);
+		for (int i = 0; i < rl->cur_entries - rl->appended; i++)
+			rl->entries[i] = p + (rl->entries[i] - rl->chars);
+		free(rl->chars);
+		rl->alloc_chars = rl->alloc_chars * 2 + lentot;
+		rl->chars = p;
+	}
+	if (rl->cur_entries >= rl->alloc_entries) {
+		char ** const t = realloc(rl->entries, sizeof(char *) * (rl->alloc_entries * 2 + 1));
+		if (!t) return OUT_OF_MEMORY;
+		rl->alloc_entries = rl->alloc_entries * 2 + 1;
+		rl->entries = t;
+	}
+
+	if (rl->appended++ == 0) rl->appended_chars = rl->cur_chars;
+	if (len > rl->max_entry_len) rl->max_entry_len = len;
+
+	char * p = strcpy(&rl->chars[rl->cur_chars], str) + len + 1;
+	if (rl->suffix && suffix) *p++ = rl->suffix;
+	*p = '\0';
+	rl->cur_chars += lentot;
+	rl->cur_entries++;
+	return OK;
+}
+
+/* Entries that compare equal are kept in order of addition, which is the
+   order of their addresses in rl->chars. */
+
+static int (*sort_cmpfnc)(const char *, const char *);
+
+static int req_list_cmpp(const void *a, const void *b) {
+	const char * const s = *(const char **)a, * const t = *(const char **)b;
+	const int cmp = sort_cmpfnc(s, t);
+	return cmp ? cmp : (s > t) - (s < t);
+}
+
+void req_list_sort(req_list * const rl) {
+	char *p = rl->chars + rl->appended_chars;
+	for(int i = rl->cur_entries - rl->appended; i < rl->cur_entries; i++) {
+		rl->entries[i] = p;
+		p += strlen(p) + 1;
+		p += strlen(p) + 1;
+	}
+	rl->appended = 0;
+	if (rl->cur_entries < 2) return;
+
+	if (rl->cmpfnc) {
+		int i;
+		for(i = 1; i < rl->cur_entries && rl->cmpfnc(rl->entries[i - 1], rl->entries[i]) < 0; i++);
+		if (i == rl->cur_entries) return; /* Already sorted, and without duplicates. */
+
+		sort_cmpfnc = rl->cmpfnc;
+		qsort(rl->entries, rl->cur_entries, sizeof *rl->entries, req_list_cmpp);
+		if (rl->allow_dupes) return;
+
+		int n = 1;
+		for(i = 1; i < rl->cur_entries; i++)
+			if (rl->cmpfnc(rl->entries[n - 1], rl->entries[i])) rl->entries[n++] = rl->entries[i];
+		rl->cur_entries = n;
+	}
+	else if (!rl->allow_dupes) {
+		/* We keep the first occurrence of each string in a sorted copy of the entries. */
+		char ** const sorted = malloc(sizeof *sorted * rl->cur_entries);
+		if (!sorted) return;
+		memcpy(sorted, rl->entries, sizeof *sorted * rl->cur_entries);
+		sort_cmpfnc = strcmp;
+		qsort(sorted, rl->cur_entries, sizeof *sorted, req_list_cmpp);
+
+		int n = 0;
+		for(int i = 0; i < rl->cur_entries; i++) {
+			const char ** const q = bsearch(&rl->entries[i], sorted, rl->cur_entries, sizeof *sorted, req_list_cmpp);
+			if (q == (const char **)sorted || strcmp(q[-1], rl->entries[i])) rl->entries[n++] = rl->entries[i];
+		}
+		rl->cur_entries = n;
+		free(sorted);
+	}
+}
+
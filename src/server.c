@@ -0,0 +1,582 @@
+/* Resident server mode.
+
+   Copyright (C) 1993-1998 Sebastiano Vigna
+   Copyright (C) 1999-2018 Todd M. Lewis and Sebastiano Vigna
+
+   This file is part of ne, the nice editor.
+
+   This library is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   This library is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.  */
+
+
+#include "ne.h"
+#include "version.h"
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* When started with --server, ne becomes a resident process that keeps
+   documents, clips, macros, syntax definitions and preferences in memory,
+   and serves the invocations of ne started later on a terminal. Such an
+   invocation (the client, see attach_to_server()) connects to a Unix domain
+   socket in the preferences directory and passes to the server its terminal
+   file descriptors, its current directory and its arguments. The server
+   then runs the editor on the terminal of the client, opening the named
+   files or making current the documents that are already resident, until
+   the user leaves (see leave_ne()). At that point the server detaches from
+   the terminal, and the client exits.
+
+   One client is served at a time. A client that is not accepted within
+   ACCEPT_TIMEOUT milliseconds (e.g., because the server is busy with
+   another terminal) starts as a standalone editor, as it does if there is
+   no server or if the server uses a different terminal type.
+
+   The terminal is not the controlling terminal of the server, so the client
+   forwards to the server the signals generated by the terminal (SIGINT for
+   the interrupt key, SIGWINCH for window resizing), and suspends itself on
+   behalf of the server (see suspend_client()). */
+
+/* The name of the socket in the preferences directory. The host name is
+   appended, as home directories are often shared among hosts. */
+
+#define SOCKET_NAME ".server-"
+
+/* The number of milliseconds a client waits for the server to accept it.
+   A server busy with another terminal does not answer at all, and every
+   invocation of ne would be delayed by this amount, so it is short. */
+
+#define ACCEPT_TIMEOUT 100
+
+/* The number of milliseconds we wait for the other side during the rest of
+   the handshake. */
+
+#define CLIENT_TIMEOUT 1000
+
+/* The maximum length of the request of a client. */
+
+#define MAX_REQUEST_LEN (1024 * 1024)
+
+/* The request of a client starts with this string, so that clients and
+   servers of different versions do not talk to each other. */
+
+#define PROTOCOL PROGRAM_NAME " " VERSION
+
+/* The messages exchanged after the request. The server accepts (sending
+   its pid) or refuses the request, and the client acknowledges the
+   acceptance. Then, the server may ask the client to suspend itself, which
+   the client acknowledges when continued, and finally tells the client to
+   quit with a given exit status. */
+
+#define MSG_ACCEPTED 'Y'
+#define MSG_REFUSED  'N'
+#define MSG_ACK      'A'
+#define MSG_SUSPEND  'S'
+#define MSG_CONTINUE 'C'
+#define MSG_QUIT     'Q'
+
+/* Whether the session with the current client is over. */
+
+bool detaching;
+
+/* The socket connected to the client being served, or -1. */
+
+static int client = -1;
+
+/* Whether the terminal of the client went away during the session (see
+   terminal_lost()). */
+
+static bool lost;
+
+/* A descriptor of /dev/null, replacing the terminal between sessions. */
+
+static int null_fd = -1;
+
+/* The pid of the server, when we are an attached client. */
+
+static pid_t server_pid;
+
+
+/* Fills sa with the address of the server socket. Returns false if there is
+   no preferences directory, or if the resulting name is too long. */
+
+static bool socket_address(struct sockaddr_un * const sa) {
+	const char * const prefs_dir = exists_prefs_dir();
+	char host[256];
+	if (!prefs_dir || gethostname(host, sizeof host)) return false;
+	host[sizeof host - 1] = 0;
+
+	memset(sa, 0, sizeof *sa);
+	sa->sun_family = AF_UNIX;
+	return snprintf(sa->sun_path, sizeof sa->sun_path, "%s" SOCKET_NAME "%s", prefs_dir, host) < (int)sizeof sa->sun_path;
+}
+
+
+/* Waits at most timeout milliseconds for data on fd. */
+
+static bool wait_for_input(const int fd, const int timeout) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int n;
+	while((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+	return n > 0;
+}
+
+
+/* Reads exactly len bytes from fd, waiting at most timeout milliseconds for
+   each chunk, or indefinitely if timeout is negative. */
+
+static bool read_fully(const int fd, void * const p, const size_t len, const int timeout) {
+	for(size_t done = 0; done < len;) {
+		if (timeout >= 0 && !wait_for_input(fd, timeout)) return false;
+		const ssize_t n = read(fd, (char *)p + done, len - done);
+		if (n == 0 || n < 0 && errno != EINTR) return false;
+		if (n > 0) done += n;
+	}
+	return true;
+}
+
+
+static bool write_fully(const int fd, const void * const p, const size_t len) {
+	for(size_t done = 0; done < len;) {
+		const ssize_t n = write(fd, (const char *)p + done, len - done);
+		if (n < 0 && errno != EINTR) return false;
+		if (n > 0) done += n;
+	}
+	return true;
+}
+
+
+static bool send_message(const int fd, const char message) {
+	return write_fully(fd, &message, 1);
+}
+
+
+/* The client side. */
+
+static void forward_signal(const int sig) {
+	kill(server_pid, sig);
+}
+
+
+/* Sends the length of the request together with our terminal descriptors,
+   and then the request. */
+
+static bool send_request(const int fd, const char * const request, const uint32_t len) {
+	const int fds[3] = { 0, 1, 2 };
+	union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof fds)]; } control;
+	memset(&control, 0, sizeof control);
+
+	struct iovec iov = { .iov_base = (void *)&len, .iov_len = sizeof len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof control.buf };
+	struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+	ssize_t n;
+	while((n = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR);
+	return n == sizeof len && write_fully(fd, request, len);
+}
+
+
+/* Builds the request: a sequence of NUL-terminated strings containing the
+   protocol, the terminal type, whether we use UTF-8 I/O, the current
+   directory and the arguments. Returns NULL on failure. */
+
+static char *build_request(const int argc, char * const * const argv, uint32_t * const len) {
+	const char * const term = getenv("TERM");
+	char * const cwd = ne_getcwd(CUR_DIR_MAX_SIZE);
+	char *request = NULL;
+
+	if (term && cwd) {
+		size_t l = sizeof PROTOCOL + strlen(term) + 1 + 2 + strlen(cwd) + 1;
+		for(int i = 1; i < argc; i++) l += strlen(argv[i]) + 1;
+
+		if (l <= MAX_REQUEST_LEN && (request = malloc(l))) {
+			char *p = stpcpy(request, PROTOCOL) + 1;
+			p = stpcpy(p, term) + 1;
+			p = stpcpy(p, io_utf8 ? "1" : "0") + 1;
+			p = stpcpy(p, cwd) + 1;
+			for(int i = 1; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+			*len = l;
+		}
+	}
+
+	free(cwd);
+	return request;
+}
+
+
+/* Tries to have the editing session run by a server. If no server accepts
+   us, we just return, and the caller proceeds as a standalone editor.
+   Otherwise, we wait for the session to end, forwarding signals to the
+   server, and exit with the status provided by the server. */
+
+void attach_to_server(const int argc, char * const * const argv) {
+	struct sockaddr_un sa;
+	if (!isatty(0) || !isatty(1) || !socket_address(&sa)) return;
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return;
+
+	uint32_t len;
+	char *request = NULL;
+	int32_t pid;
+	char message;
+	struct termios termios;
+
+	/* If the server goes away, we want to get an error, not a signal. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* If the backlog of the server is full, a blocking connection would
+	   wait for it to drain. */
+	const int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	const bool connected = ! connect(fd, (struct sockaddr *)&sa, sizeof sa);
+	fcntl(fd, F_SETFL, flags);
+
+	const bool accepted = connected
+		&& ! tcgetattr(0, &termios)
+		&& (request = build_request(argc, argv, &len))
+		&& send_request(fd, request, len)
+		&& read_fully(fd, &message, 1, ACCEPT_TIMEOUT) && message == MSG_ACCEPTED
+		&& read_fully(fd, &pid, sizeof pid, CLIENT_TIMEOUT)
+		&& send_message(fd, MSG_ACK);
+
+	free(request);
+
+	if (!accepted) {
+		close(fd);
+		signal(SIGPIPE, SIG_DFL);
+		return;
+	}
+
+	server_pid = pid;
+	signal(SIGINT, forward_signal);
+#ifdef SIGWINCH
+	signal(SIGWINCH, forward_signal);
+#endif
+
+	while(read_fully(fd, &message, 1, -1)) {
+		switch(message) {
+		case MSG_SUSPEND:
+			kill(0, SIGTSTP);
+			send_message(fd, MSG_CONTINUE);
+			break;
+
+		case MSG_QUIT:
+			exit(read_fully(fd, &message, 1, -1) ? message : EXIT_FAILURE);
+		}
+	}
+
+	/* The server died while serving us. */
+
+	tcsetattr(0, TCSADRAIN, &termios);
+	fprintf(stderr, "\nThe ne server has terminated.\n");
+	exit(EXIT_FAILURE);
+}
+
+
+/* The server side. */
+
+bool serving_client(void) {
+	return client >= 0;
+}
+
+
+/* If we are serving a client, asks it to suspend itself, and waits until it
+   is continued. Returns false if we are not serving a client. */
+
+bool suspend_client(void) {
+	if (client < 0) return false;
+	char message;
+	if (send_message(client, MSG_SUSPEND)) read_fully(client, &message, 1, -1);
+	return true;
+}
+
+
+/* Returns the document of a previous session whose file is the given one,
+   if we are serving a client, or NULL. Documents are left with absolute
+   file names at the end of a session (see detach()). */
+
+buffer *resident_buffer(const char * const name) {
+	if (client < 0) return NULL;
+
+	char * const cwd = ne_getcwd(CUR_DIR_MAX_SIZE);
+	char * const path = name[0] == '/' ? str_dup(name) : absolute_file_path(name, cwd);
+	free(cwd);
+	if (!path) return NULL;
+	normalize_path(path);
+
+	buffer *b = (buffer *)buffers.head;
+	while(b->b_node.next && !(b->filename && !strcmp(b->filename, path))) b = (buffer *)b->b_node.next;
+	free(path);
+	return b->b_node.next ? b : NULL;
+}
+
+
+/* Makes sure that there is a current document after the last one has been
+   closed, as a server outlives its documents. */
+
+static void ensure_buffer(void) {
+	if (buffers.head->next) return;
+	cur_buffer = NULL;
+	if (!new_buffer()) exit(EXIT_FAILURE);
+}
+
+
+/* Leaves ne, or ends the current session if we are serving a client. */
+
+void leave_ne(void) {
+	close_history();
+	if (client < 0) {
+		unset_interactive_mode();
+		exit(0);
+	}
+
+	detaching = stop = true;
+	ensure_buffer();
+}
+
+
+/* Called by get_key_code() when the terminal goes away. A standalone ne
+   dies, autosaving the modified documents (see fatal_code()). A server
+   abandons the session, so that it survives a closed terminal window:
+   get_key_code() keeps returning INVALID_CHAR, and the loops reading keys
+   give up when they find detaching set, so that the stack unwinds normally.
+   The modified documents are autosaved by detach(). */
+
+void terminal_lost(void) {
+	if (client < 0) kill(getpid(), SIGTERM);
+	else lost = detaching = stop = true;
+}
+
+
+/* Receives the length of a request and the terminal descriptors of the
+   client. */
+
+static bool receive_request(const int c, uint32_t * const len, int * const fds) {
+	union { struct cmsghdr h; char buf[CMSG_SPACE(3 * sizeof *fds)]; } control;
+	memset(&control, 0, sizeof control);
+
+	struct iovec iov = { .iov_base = len, .iov_len = sizeof *len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof control.buf };
+
+	if (!wait_for_input(c, CLIENT_TIMEOUT)) return false;
+	ssize_t n;
+	while((n = recvmsg(c, &msg, 0)) < 0 && errno == EINTR);
+
+	struct cmsghdr * const cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return false;
+
+	const int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof *fds;
+	memcpy(fds, CMSG_DATA(cmsg), min(received, 3) * sizeof *fds);
+	if (received == 3 && n == sizeof *len && !(msg.msg_flags & MSG_CTRUNC)) return true;
+
+	for(int i = 0; i < min(received, 3); i++) close(fds[i]);
+	return false;
+}
+
+
+/* Ends a session: the terminal is released, unsaved documents (which the
+   user chose to discard, or which are autosaved if the terminal went away)
+   are freed, and file names are made absolute, as the next client might
+   have a different current directory. */
+
+static void detach(void) {
+	wake_on_file_change(false);
+	unset_interactive_mode();
+
+	char * const cwd = ne_getcwd(CUR_DIR_MAX_SIZE);
+	for(buffer *b = (buffer *)buffers.head, *next; b->b_node.next; b = next) {
+		next = (buffer *)b->b_node.next;
+		if (b->is_modified) {
+			if (lost) auto_save(b);
+			rem(&b->b_node);
+			free_buffer(b);
+		}
+		else if (b->filename && b->filename[0] != '/' && cwd) {
+			char * const name = absolute_file_path(b->filename, cwd);
+			if (name) change_filename(b, name);
+		}
+	}
+	free(cwd);
+
+	cur_buffer = (buffer *)buffers.head;
+	ensure_buffer();
+
+	for(int i = 0; i < 3; i++) dup2(null_fd, i);
+
+	const char quit[] = { MSG_QUIT, EXIT_SUCCESS };
+	write_fully(client, quit, sizeof quit);
+	client = -1;
+}
+
+
+/* Serves a client connected on socket c: we read its request, and if we
+   accept it we run the editor on its terminal until the user leaves. */
+
+static void serve_client(const int c) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t cred_len = sizeof cred;
+	if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) || cred.uid != getuid()) return;
+#endif
+
+	uint32_t len;
+	int fds[3];
+	if (!receive_request(c, &len, fds)) return;
+
+	/* We split the request into strings, making argv[0] point at the
+	   terminal type, which is not used as an argument. */
+
+	char * const request = len <= MAX_REQUEST_LEN ? malloc(len) : NULL;
+	char **argv = NULL;
+	int argc = 0;
+
+	if (request && read_fully(c, request, len, CLIENT_TIMEOUT) && len && !request[len - 1]) {
+		for(char *p = request; p < request + len; p += strlen(p) + 1) argc++;
+		if (argc >= 4 && (argv = malloc(argc * sizeof *argv))) {
+			argc = 0;
+			for(char *p = request; p < request + len; p += strlen(p) + 1) argv[argc++] = p;
+		}
+	}
+
+	const char * const term = getenv("TERM");
+	char message;
+	bool accepted = false;
+
+	if (!argv || strcmp(argv[0], PROTOCOL) || !term || strcmp(argv[1], term) || chdir(argv[3])) send_message(c, MSG_REFUSED);
+	else {
+		const int32_t pid = getpid();
+		char reply[1 + sizeof pid] = { MSG_ACCEPTED };
+		memcpy(reply + 1, &pid, sizeof pid);
+
+		accepted = write_fully(c, reply, sizeof reply) && read_fully(c, &message, 1, CLIENT_TIMEOUT) && message == MSG_ACK;
+		if (accepted) for(int i = 0; i < 3; i++) dup2(fds[i], i);
+	}
+
+	for(int i = 0; i < 3; i++) close(fds[i]);
+
+	if (accepted) {
+		clearerr(stdin);
+		io_utf8 = argv[2][0] == '1';
+		client = c;
+
+		stop = detaching = lost = window_changed_size = false;
+		set_interactive_mode();
+		ttysize();
+		clear_entire_screen();
+
+		/* The arguments start after the current directory. If the current
+		   document is empty, the first file is loaded into it. */
+
+		char * const skiplist = calloc(argc - 3, 1);
+		if (skiplist) {
+			bool first_file = !cur_buffer->filename && !cur_buffer->is_modified && cur_buffer->num_lines == 1;
+			buffer * const first = load_files(argc - 3, argv + 3, skiplist, NULL, &first_file);
+			if (first) cur_buffer = first;
+			free(skiplist);
+		}
+
+		keep_cursor_on_screen(cur_buffer);
+		reset_window();
+		main_loop();
+		detach();
+	}
+
+	free(argv);
+	free(request);
+}
+
+
+/* Starts a server, returning the exit status of ne. The process forks, and
+   the parent returns as soon as the server socket is ready, leaving the
+   child in its own session, with no terminal, waiting for clients. Files
+   cannot be loaded at this time, as there is no terminal to display
+   errors. */
+
+int serve(const int argc, char * const * const argv, const char * const skiplist) {
+	for(int i = 1; i < argc; i++)
+		if (!skiplist[i]) {
+			fprintf(stderr, "The server does not load files; name them when you invoke ne.\n");
+			return EXIT_FAILURE;
+		}
+
+	struct sockaddr_un sa;
+	if (!socket_address(&sa)) {
+		fprintf(stderr, "Cannot find a name for the server socket.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* If we can connect, a server is already running. Otherwise, the socket
+	   (if any) has been left by a server that died. */
+
+	const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe >= 0) {
+		const bool running = !connect(probe, (struct sockaddr *)&sa, sizeof sa);
+		close(probe);
+		if (running) {
+			fprintf(stderr, "A server is already running.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	unlink(sa.sun_path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	const mode_t mask = umask(077);
+	const bool bound = fd >= 0 && !bind(fd, (struct sockaddr *)&sa, sizeof sa);
+	umask(mask);
+
+	if (!bound || listen(fd, 8) || (null_fd = open("/dev/null", O_RDWR)) < 0) {
+		perror(sa.sun_path);
+		return EXIT_FAILURE;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(null_fd, F_SETFD, FD_CLOEXEC);
+
+	/* The terminal might hang up before the child leaves its session. */
+
+	signal(SIGHUP, SIG_IGN);
+
+	switch(fork()) {
+	case -1:
+		perror("fork");
+		unlink(sa.sun_path);
+		return EXIT_FAILURE;
+	case 0:
+		break;
+	default:
+		return EXIT_SUCCESS;
+	}
+
+	setsid();
+	for(int i = 0; i < 3; i++) dup2(null_fd, i);
+
+	set_fatal_code();
+	signal(SIGPIPE, SIG_IGN);
+
+	while(true) {
+		const int c = accept(fd, NULL, NULL);
+		if (c < 0) {
+			if (errno != EINTR) sleep(1);
+			continue;
+		}
+		fcntl(c, F_SETFD, FD_CLOEXEC);
+		serve_client(c);
+		close(c);
+	}
+}
@@ -27,7 +27,8 @@
 /* These variables remember if we are already in a signal handling
 code. In this case, the arrival of another signal must kill us. */
 
-static bool fatal_code_in_progress, fatal_error_code;
+static bool fatal_code_in_progress;
+static int fatal_error_code;
 
 
 
@@ -59,11 +60,11 @@ static void fatal_code(const int sig) {
 /* The next function handles the suspend/restart system. When stopped,
 we reset the terminal status, set up the continuation handler and let the
 system stop us by sending again a TSTP signal, this time using the default
-handler. */
+handler. A server asks its client to stop instead. */
 
 void stop_ne(void) {
 	unset_interactive_mode();
-	kill(0, SIGTSTP);
+	if (!suspend_client()) kill(0, SIGTSTP);
 	set_interactive_mode();
 	clear_entire_screen();
 	ttysize();
@@ -20,6 +20,10 @@
 
 
 #include "ne.h"
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
 
 /* This is the least increment with which a char_stream is reallocated. */
 
@@ -58,7 +62,7 @@ void free_char_stream(char_stream * const cs) {
 /* Reallocates a stream. If cs is NULL, it is equivalent to
    alloc_char_stream(). Otherwise, the memory pointed by stream is
    realloc()ated to size bytes. If the reallocation is successfull, cs is
-   returned, otherwise NULL. */
+   returned, otherwise NULL and the stream is left untouched. */
 
 char_stream *realloc_char_stream(char_stream * const cs, const int64_t size) {
 
@@ -73,7 +77,9 @@ char_stream *realloc_char_stream(char_stream * const cs, const int64_t size) {
 		return cs;
 	}
 
-	if (cs->stream = realloc(cs->stream, size * sizeof *cs->stream)) {
+	char * const stream = realloc(cs->stream, size * sizeof *cs->stream);
+	if (stream) {
+		cs->stream = stream;
 		cs->size = size;
 		if (cs->len > size) cs->len = size;
 		return cs;
@@ -178,6 +184,29 @@ void set_stream_encoding(char_stream * const cs, const encoding_type source) {
 }
 
 
+/* Converts in place the line terminators of a stream freshly read from a
+   file or a pipe (CR, LF or CR/LF pairs, or just LF if preserve_cr is true)
+   into NULs. */
+
+static void terminators_to_nul(char_stream * const cs, const bool preserve_cr) {
+	char terminators[] = { 0x0d, 0x0a };
+	if (preserve_cr) terminators[0] = 0;
+
+	const int64_t len = cs->len;
+	int64_t j;
+	for(int64_t i = j = 0; i < len; i++, j++) {
+		if (i < len - 1 && !preserve_cr && cs->stream[i] == '\r' && cs->stream[i + 1] == '\n') i++;
+		cs->stream[j] = cs->stream[i];
+
+		if (cs->stream[j] == terminators[0] || cs->stream[j] == terminators[1]) cs->stream[j] = 0;
+	}
+
+	memset(cs->stream + j, 0, len - j);
+
+	cs->len = j;
+}
+
+
 /* These two functions load a stream in memory. Carriage returns and line feeds
    are converted to NULLs. You can pass NULL for cs, and a char stream will be
    allocated for you. If preserve_cr is true, CRs are preserved. If binary 
@@ -203,9 +232,6 @@ char_stream *load_stream(char_stream * cs, const char *name, const bool preserve
 char_stream *load_stream_from_fd(char_stream *cs, const int fd, const bool preserve_cr, const bool binary) {
 	if (fd < 0) return NULL;
 
-	char terminators[] = { 0x0d, 0x0a };
-	if (preserve_cr) terminators[0] = 0;
-
 	assert_char_stream(cs);
 
 	off_t len = lseek(fd, 0, SEEK_END);
@@ -221,23 +247,8 @@ char_stream *load_stream_from_fd(char_stream *cs, const int fd, const bool prese
 		return NULL;
 	}
 
-	if (binary) {
-		cs->len = len;
-		assert_char_stream(cs);
-		return cs;
-	}
-
-	int64_t j;
-	for(int64_t i = j = 0; i < len; i++, j++) {
-		if (i < len - 1 && !preserve_cr && cs->stream[i] == '\r' && cs->stream[i + 1] == '\n') i++;
-		cs->stream[j] = cs->stream[i];
-
-		if (cs->stream[j] == terminators[0] || cs->stream[j] == terminators[1]) cs->stream[j] = 0;
-	}
-
-	memset(cs->stream + j, 0, len - j);
-
-	cs->len = j;
+	cs->len = len;
+	if (!binary) terminators_to_nul(cs, preserve_cr);
 
 	assert_char_stream(cs);
 
@@ -301,3 +312,224 @@ int save_stream_to_fd(const char_stream *const cs, const int fd, const bool CRLF
 	return OK;
 }
 
+
+/* The size of the buffer used to feed a filter, and the minimum number of
+   bytes we read at a time from it. */
+
+#define FILTER_BUF_SIZE (64 * 1024)
+
+/* The number of milliseconds a terminated filter is given to exit before
+   being killed. */
+
+#define FILTER_GRACE_PERIOD 2000
+
+
+/* Waits for the filter process pid, returning its status, or -1 on error.
+   If the filter has been terminated, or if the user interrupts the wait,
+   we kill the process group of the filter after FILTER_GRACE_PERIOD
+   milliseconds, as a command might ignore SIGTERM. *stopped is set if the
+   user interrupted the wait. */
+
+static int wait_filter(const pid_t pid, bool terminated, bool * const stopped) {
+	int status, waited = 0;
+
+	while(true) {
+		const pid_t r = waitpid(pid, &status, WNOHANG);
+		if (r == pid) return status;
+		if (r < 0 && errno != EINTR) return -1;
+
+		if (stop && !terminated) {
+			kill(-pid, SIGTERM);
+			terminated = *stopped = true;
+			waited = 0;
+		}
+
+		if (terminated && waited >= FILTER_GRACE_PERIOD) kill(-pid, SIGKILL);
+
+		poll(NULL, 0, 50);
+		waited += 50;
+	}
+}
+
+
+/* Pipes a stream through an external command, and stores the output of the
+   command in out. The input is written as in save_stream_to_fd(), and the
+   output is converted as in load_stream_from_fd().
+
+   The command is run by the shell in its own process group, with its
+   standard input and output connected to pipes and its standard error
+   discarded. We feed the input and collect the output concurrently, so no
+   temporary file is necessary and the command cannot deadlock on a full
+   pipe. In the meantime, we display the amount of data transferred, and
+   check the global stop variable: if the user interrupts us, the command is
+   terminated and STOPPED is returned. A command exiting with a nonzero status
+   causes an EXTERNAL_COMMAND_ERROR. */
+
+int filter_stream(const char_stream * const in, char_stream * const out, const char * const command, const bool CRLF, const bool binary, const bool preserve_cr) {
+	assert_char_stream(in);
+	assert_char_stream(out);
+
+	int in_pipe[2], out_pipe[2];
+	if (pipe(in_pipe)) return EXTERNAL_COMMAND_ERROR;
+	if (pipe(out_pipe)) {
+		close(in_pipe[0]);
+		close(in_pipe[1]);
+		return EXTERNAL_COMMAND_ERROR;
+	}
+
+	/* A command that does not read all its input would kill us. */
+
+	struct sigaction ignore = { .sa_handler = SIG_IGN }, old_sigpipe;
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, &old_sigpipe);
+
+	const pid_t pid = fork();
+
+	if (pid == 0) {
+		setpgid(0, 0);
+		signal(SIGPIPE, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+
+		const int null_fd = open("/dev/null", O_WRONLY);
+		dup2(in_pipe[0], 0);
+		dup2(out_pipe[1], 1);
+		if (null_fd >= 0) dup2(null_fd, 2);
+		close(in_pipe[0]);
+		close(in_pipe[1]);
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		if (null_fd > 2) close(null_fd);
+
+		/* The command must not inherit our descriptors (e.g., the undo spill
+		   files, or the sockets of a server). */
+
+		for(long fd = 3, max_fd = sysconf(_SC_OPEN_MAX); fd < max_fd; fd++) close(fd);
+
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+
+	close(in_pipe[0]);
+	close(out_pipe[1]);
+
+	if (pid < 0) {
+		close(in_pipe[1]);
+		close(out_pipe[0]);
+		sigaction(SIGPIPE, &old_sigpipe, NULL);
+		return EXTERNAL_COMMAND_ERROR;
+	}
+
+	setpgid(pid, pid);
+	fcntl(in_pipe[1], F_SETFL, fcntl(in_pipe[1], F_GETFL) | O_NONBLOCK);
+
+	char buf[FILTER_BUF_SIZE];
+	int64_t in_pos = 0, buf_start = 0, buf_end = 0, written = 0;
+	int in_fd = in_pipe[1], error = OK;
+	bool terminated = false;
+	time_t last_message = 0;
+
+	out->len = 0;
+	stop = false;
+
+	if (!in->len) {
+		close(in_fd);
+		in_fd = -1;
+	}
+
+	while(true) {
+		struct pollfd pfd[2] = { { out_pipe[0], POLLIN }, { in_fd, POLLOUT } };
+
+		if (poll(pfd, 2, 250) < 0 && errno != EINTR) {
+			error = EXTERNAL_COMMAND_ERROR;
+			break;
+		}
+
+		if (stop) {
+			kill(-pid, SIGTERM);
+			terminated = true;
+			error = STOPPED;
+			break;
+		}
+
+		if (in_fd >= 0 && (pfd[1].revents & (POLLOUT | POLLERR | POLLHUP))) {
+			/* We refill the buffer, converting NULs into line terminators. */
+			if (buf_start == buf_end) {
+				buf_start = buf_end = 0;
+				if (binary) {
+					buf_end = min(in->len - in_pos, FILTER_BUF_SIZE);
+					memcpy(buf, in->stream + in_pos, buf_end);
+					in_pos += buf_end;
+				}
+				else while(in_pos < in->len && buf_end < FILTER_BUF_SIZE - 1) {
+					const char c = in->stream[in_pos++];
+					if (c) buf[buf_end++] = c;
+					else {
+						if (CRLF) buf[buf_end++] = '\r';
+						buf[buf_end++] = '\n';
+					}
+				}
+			}
+
+			const ssize_t n = write(in_fd, buf + buf_start, buf_end - buf_start);
+			if (n > 0) {
+				buf_start += n;
+				written += n;
+			}
+
+			/* On EPIPE the command does not want any more input. */
+			if (n < 0 && errno != EAGAIN && errno != EINTR || buf_start == buf_end && in_pos == in->len) {
+				close(in_fd);
+				in_fd = -1;
+			}
+		}
+
+		if (pfd[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+			if (out->size - out->len < FILTER_BUF_SIZE && !realloc_char_stream(out, out->size * 2 + FILTER_BUF_SIZE)) {
+				kill(-pid, SIGTERM);
+				terminated = true;
+				error = OUT_OF_MEMORY;
+				break;
+			}
+
+			const ssize_t n = read(out_pipe[0], out->stream + out->len, out->size - out->len);
+			if (n == 0) break;
+			if (n > 0) out->len += n;
+			else if (errno != EAGAIN && errno != EINTR) {
+				error = EXTERNAL_COMMAND_ERROR;
+				break;
+			}
+		}
+
+		if (time(NULL) != last_message) {
+			char msg[128];
+			snprintf(msg, sizeof msg, "Filtering: %" PRId64 " bytes sent, %" PRId64 " bytes received (^\\ to stop)...", written, out->len);
+			print_message(msg);
+			last_message = time(NULL);
+		}
+	}
+
+	if (in_fd >= 0) close(in_fd);
+	close(out_pipe[0]);
+
+	/* If we stopped reading because of an error, the command might be
+	   blocked writing. */
+
+	if (error && !terminated) {
+		kill(-pid, SIGTERM);
+		terminated = true;
+	}
+
+	bool stopped = false;
+	const int status = wait_filter(pid, terminated, &stopped);
+	if (!error && stopped) error = STOPPED;
+	if (!error && (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status))) error = EXTERNAL_COMMAND_ERROR;
+
+	sigaction(SIGPIPE, &old_sigpipe, NULL);
+
+	if (!error && !binary && out->len) terminators_to_nul(out, preserve_cr);
+
+	assert_char_stream(out);
+
+	return error;
+}
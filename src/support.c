@@ -213,16 +213,23 @@ bool is_directory(const char * const name) {
 	return stat(tilde_expand(name), &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
 }
 
-/* Returns the mtime of the named file, or 0 on error.
-   If a file's mtime actually is 0, then this system probably doesn't keep
-   mtimes, so we can't distinguish that case,
-   but we probably don't care either, as that's also our sentinel value
-   for buffers which have not been saved. */
+/* Fills stamp with the stamp of the named file and returns true, or zeroes
+   stamp and returns false if the file cannot be stat()ed. */
 
-unsigned long file_mod_time(const char *filename) {
-	static struct stat statbuf;
-	if ( stat(filename, &statbuf) ) return false;
-	return statbuf.st_mtime;
+bool get_file_stamp(const char * const filename, file_stamp * const stamp) {
+	struct stat statbuf;
+	if (stat(filename, &statbuf)) {
+		memset(stamp, 0, sizeof *stamp);
+		return false;
+	}
+	stamp->mtime = statbuf.st_mtim;
+	stamp->ino = statbuf.st_ino;
+	stamp->size = statbuf.st_size;
+	return true;
+}
+
+bool same_file_stamp(const file_stamp * const s, const file_stamp * const t) {
+	return s->mtime.tv_sec == t->mtime.tv_sec && s->mtime.tv_nsec == t->mtime.tv_nsec && s->ino == t->ino && s->size == t->size;
 }
 
 /* Reads data from a file descriptors much as read() does, but never reads
@@ -249,11 +256,10 @@ ssize_t read_safely(const int fd, void * const buf, const int64_t len) {
 	return len;
 }
 
-/* Check a named file's mtime relative to a buffer's stored mtime.
-   Note that stat errors are treated like 0 mtime, which also is the value
-   for new buffers. Return values:
-     true:  if file's non-zero modification time differs from the buffer's mtime,
-     false: everything else, including if the files mtime couldn't be checked
+/* Check a named file's stamp relative to a buffer's stored stamp.
+   Return values:
+     true:  if the file exists and its stamp differs from the buffer's stamp,
+     false: everything else, including if the file's stamp couldn't be checked
             (for example: possibly no file or couldn't stat).
    Uses filename from the buffer unless passed a name. */
 
@@ -271,9 +277,8 @@ bool buffer_file_modified(const buffer *b, const char *name) {
 
 	name = tilde_expand(name);
 
-	unsigned long fmtime = file_mod_time(name);
-	if (fmtime && fmtime != b->mtime) return true;
-	return false;
+	file_stamp stamp;
+	return get_file_stamp(name, &stamp) && !same_file_stamp(&stamp, &b->stamp);
 }
 
 
@@ -443,6 +448,7 @@ int filenamecmp(const char * s, const char * t) {
 static struct termios termios, old_termios;
 
 void set_interactive_mode(void) {
+	if (batch_mode) return;
 	tcgetattr(0, &termios);
 
 	old_termios = termios;
@@ -510,6 +516,7 @@ void set_interactive_mode(void) {
    old_termios has been filled with the old termios structure. */
 
 void unset_interactive_mode(void) {
+	if (batch_mode) return;
 
 	/* We move the cursor on the last line, clear it, and output a CR, so that
 		the kernel can track the cursor position. Note that clear_to_eol() can
@@ -697,3 +704,133 @@ const char *cur_bookmarks_string(const buffer *b) {
 	if (s > str) *(--s) = '\0';
 	return str;
 }
+
+
+/* The column index of long lines. Computing widths and positions on a line
+   requires a scan from its start, which is unbearably slow on lines of
+   several megabytes (e.g., minimized JSON files). Thus, for lines longer
+   than COL_INDEX_MIN_LEN we lazily build an array of checkpoints, about
+   COL_INDEX_STEP bytes apart, recording the number of characters and the
+   width of the line up to each checkpoint; calc_width() and friends use
+   binary search to find the nearest checkpoint and scan from there.
+
+   A few indices are kept in a small cache, keyed by line descriptor. Since
+   indices depend on the content of the line, buffer.c calls
+   col_index_invalidate() whenever a line is modified, allocated or freed;
+   moreover, the line pointer and length are checked on every lookup. */
+
+#define COL_INDEX_CACHE_SIZE 8
+
+typedef struct {
+	const line_desc *ld;
+	const char *line;
+	int64_t line_len;
+	int tab_size;
+	encoding_type encoding;
+	int64_t num_checkpoints, alloc_checkpoints;
+	col_checkpoint *checkpoint;
+} col_index;
+
+static col_index col_index_cache[COL_INDEX_CACHE_SIZE];
+static int col_index_next;
+
+
+/* Invalidates the column index of the given line descriptor, or all indices
+   if ld is NULL. */
+
+void col_index_invalidate(const line_desc * const ld) {
+	for(int i = 0; i < COL_INDEX_CACHE_SIZE; i++)
+		if (ld == NULL || col_index_cache[i].ld == ld) col_index_cache[i].ld = NULL;
+}
+
+
+/* Returns the column index of a line descriptor, building it if necessary.
+   If tab_size is zero any index will do (it is used when only character
+   counts are needed). Returns NULL if we run out of memory. */
+
+static const col_index *get_col_index(const line_desc * const ld, int tab_size, const encoding_type encoding) {
+	for(int i = 0; i < COL_INDEX_CACHE_SIZE; i++) {
+		const col_index * const ci = &col_index_cache[i];
+		if (ci->ld == ld && ci->line == ld->line && ci->line_len == ld->line_len && ci->encoding == encoding && (tab_size == 0 || ci->tab_size == tab_size)) return ci;
+	}
+
+	if (tab_size == 0) tab_size = 8;
+
+	col_index * const ci = &col_index_cache[col_index_next];
+	col_index_next = (col_index_next + 1) % COL_INDEX_CACHE_SIZE;
+	ci->ld = NULL;
+
+	const int64_t needed = ld->line_len / COL_INDEX_STEP + 1;
+	if (ci->alloc_checkpoints < needed) {
+		col_checkpoint * const p = realloc(ci->checkpoint, needed * sizeof *p);
+		if (!p) return NULL;
+		ci->checkpoint = p;
+		ci->alloc_checkpoints = needed;
+	}
+
+	int64_t n = 0, chars = 0, width = 0, need = 0, next = 0;
+	for(int64_t pos = 0; pos < ld->line_len; pos = next_pos(ld->line, pos, encoding), chars++) {
+		if (pos >= next) {
+			assert(n < ci->alloc_checkpoints);
+			ci->checkpoint[n++] = (col_checkpoint){ pos, chars, width, need };
+			next += COL_INDEX_STEP;
+		}
+		const int c_width = get_char_width(&ld->line[pos], encoding);
+		need = width + c_width;
+		if (ld->line[pos] != '\t') width += c_width;
+		else width += tab_size - width % tab_size;
+	}
+
+	ci->num_checkpoints = n;
+	ci->line = ld->line;
+	ci->line_len = ld->line_len;
+	ci->tab_size = tab_size;
+	ci->encoding = encoding;
+	ci->ld = ld;
+	return ci;
+}
+
+
+/* Stores in *cp the last checkpoint of the column index of ld whose field at
+   the given offset is smaller than or equal to key (all fields are
+   nondecreasing along the index). Returns false (leaving *cp untouched) if no
+   index is available. */
+
+static bool col_index_search(const line_desc * const ld, const int tab_size, const encoding_type encoding, const size_t field, const int64_t key, col_checkpoint * const cp) {
+	const col_index * const ci = get_col_index(ld, tab_size, encoding);
+	if (!ci || ci->num_checkpoints == 0) return false;
+
+	int64_t l = 0, r = ci->num_checkpoints;
+	while(r - l > 1) {
+		const int64_t m = (l + r) / 2;
+		if (*(const int64_t *)((const char *)&ci->checkpoint[m] + field) <= key) l = m;
+		else r = m;
+	}
+
+	*cp = ci->checkpoint[l];
+	return true;
+}
+
+
+/* Stores in *cp the last checkpoint of the column index of ld whose position
+   is smaller than or equal to pos. */
+
+bool col_index_by_pos(const line_desc * const ld, const int64_t pos, const int tab_size, const encoding_type encoding, col_checkpoint * const cp) {
+	return col_index_search(ld, tab_size, encoding, offsetof(col_checkpoint, pos), pos, cp);
+}
+
+
+/* Stores in *cp the last checkpoint of the column index of ld whose width is
+   smaller than the given width. */
+
+bool col_index_by_width(const line_desc * const ld, const int64_t width, const int tab_size, const encoding_type encoding, col_checkpoint * const cp) {
+	return col_index_search(ld, tab_size, encoding, offsetof(col_checkpoint, width), width - 1, cp);
+}
+
+
+/* Stores in *cp the last checkpoint of the column index of ld that calc_pos()
+   would get past when looking for column col. */
+
+bool col_index_by_col(const line_desc * const ld, const int64_t col, const int tab_size, const encoding_type encoding, col_checkpoint * const cp) {
+	return col_index_search(ld, tab_size, encoding, offsetof(col_checkpoint, need), col, cp);
+}
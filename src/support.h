@@ -54,22 +54,56 @@ static int inline get_char_width(const char * const s, const encoding_type encod
 	return *(unsigned char *)s < 128 ? 1 : encoding == ENC_UTF8 ? output_width(utf8char(s)) : output_width(*(unsigned char *)s);
 }
 
-/* Computes the TAB-expanded width of a line descriptor up to a certain
-   position. The position can be greater than the line length, the usual
-   convention of infinite expansion via spaces being in place. */
-
-static int64_t inline calc_width(const line_desc * const ld, const int64_t n, const int tab_size, const encoding_type encoding) {
+/* Returns the length of the longest prefix of the first len bytes of s made
+   of US-ASCII characters other than TAB, that is, of characters of width one
+   occupying one byte. Bytes are examined a word at a time: a word is
+   rejected if it contains a byte with the high bit set, or if its XOR with a
+   word of TABs contains a zero byte. */
+
+static int64_t inline ascii_run(const char * const s, const int64_t len) {
+	int64_t i = 0;
+	for(uint64_t w, t; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		t = w ^ UINT64_C(0x0909090909090909);
+		if ((w | (t - UINT64_C(0x0101010101010101) & ~t)) & UINT64_C(0x8080808080808080)) break;
+	}
+	while(i < len && (unsigned char)s[i] < 0x80 && s[i] != '\t') i++;
+	return i;
+}
 
-	int64_t width = 0;
-	for(int64_t pos = 0; pos < n; pos = pos < ld->line_len ? next_pos(ld->line, pos, encoding) : pos + 1) {
-		if (pos >= ld->line_len) width++;
-		else if (ld->line[pos] != '\t') width += get_char_width(&ld->line[pos], encoding);
+/* Computes the TAB-expanded width of a line descriptor up to a certain
+   position, starting from a known position and a corresponding known width.
+   The position can be greater than the line length, the usual convention of
+   infinite expansion via spaces being in place. */
+
+static int64_t inline calc_width_from(const line_desc * const ld, const int64_t n, const int tab_size, const encoding_type encoding, int64_t pos, int64_t width) {
+	const int64_t end = min(n, ld->line_len);
+	while(pos < end) {
+		const int64_t run = ascii_run(ld->line + pos, end - pos);
+		width += run;
+		if ((pos += run) >= end) break;
+		if (ld->line[pos] != '\t') width += get_char_width(&ld->line[pos], encoding);
 		else width += tab_size - width % tab_size;
+		pos = next_pos(ld->line, pos, encoding);
 	}
 
+	/* Beyond the end of the line we have virtual spaces. */
+	if (pos < n) width += n - pos;
 	return width;
 }
 
+/* Computes the TAB-expanded width of a line descriptor up to a certain
+   position. The position can be greater than the line length, the usual
+   convention of infinite expansion via spaces being in place. On long lines
+   we start from the nearest checkpoint of the column index. */
+
+static int64_t inline calc_width(const line_desc * const ld, const int64_t n, const int tab_size, const encoding_type encoding) {
+	col_checkpoint cp;
+	if (ld->line_len >= COL_INDEX_MIN_LEN && n > COL_INDEX_STEP && col_index_by_pos(ld, n, tab_size, encoding, &cp))
+		return calc_width_from(ld, n, tab_size, encoding, cp.pos, cp.width);
+	return calc_width_from(ld, n, tab_size, encoding, 0, 0);
+}
+
 /* Computes the TAB-expanded width of a line descriptor up to a certain
    position. The position can be greater than the line length, the usual
    convention of infinite expansion via spaces being in place. An initial
@@ -77,15 +111,8 @@ static int64_t inline calc_width(const line_desc * const ld, const int64_t n, co
    known width. */
 
 static int64_t inline calc_width_hint(const line_desc * const ld, const int64_t n, const int tab_size, const encoding_type encoding, const int64_t cur_pos, const int64_t cur_width) {
-	if (cur_pos < n) {
-		int64_t width = cur_width;
-		for(int64_t pos = cur_pos; pos < n; pos = pos < ld->line_len ? next_pos(ld->line, pos, encoding) : pos + 1) {
-			if (pos >= ld->line_len) width++;
-			else if (ld->line[pos] != '\t') width += get_char_width(&ld->line[pos], encoding);
-			else width += tab_size - width % tab_size;
-		}
-		return width;
-	}
+	if (cur_pos < n && (n - cur_pos <= COL_INDEX_STEP || ld->line_len < COL_INDEX_MIN_LEN))
+		return calc_width_from(ld, n, tab_size, encoding, cur_pos, cur_width);
 	else return calc_width(ld, n, tab_size, encoding);
 }
 
@@ -93,26 +120,56 @@ static int64_t inline calc_width_hint(const line_desc * const ld, const int64_t
 /* Computes character length of a line descriptor up to a given position. */
 
 static int64_t inline calc_char_len(const line_desc * const ld, const int64_t n, const encoding_type encoding) {
-	int64_t len = 0;
-	for(int64_t pos = 0; pos < n; pos = next_pos(ld->line, pos, encoding), len++);
+	if (encoding != ENC_UTF8) return n > 0 ? n : 0;
+
+	col_checkpoint cp = { 0 };
+	if (ld->line_len >= COL_INDEX_MIN_LEN && n > COL_INDEX_STEP) col_index_by_pos(ld, n, 0, encoding, &cp);
+
+	int64_t len = cp.chars, pos = cp.pos;
+	while(pos < n) {
+		const int64_t run = ascii_run(ld->line + pos, min(n, ld->line_len) - pos);
+		len += run;
+		if ((pos += run) >= n) break;
+		pos = next_pos(ld->line, pos, encoding);
+		len++;
+	}
 	return len;
 }
 
 
+/* Scans a line descriptor, starting from a known position and a
+   corresponding known width, up to the first byte "containing" the given
+   column, or up to the end of the line. The width up to the returned
+   position is stored in *width. */
+
+static int64_t inline calc_pos_from(const line_desc * const ld, const int64_t col, const int tab_size, const encoding_type encoding, int64_t pos, int64_t * const width) {
+	int c_width;
+	int64_t w = *width;
+	while(pos < ld->line_len) {
+		/* Characters in an US-ASCII run have width one. */
+		int64_t run = ascii_run(ld->line + pos, ld->line_len - pos);
+		if (run > col - w) run = max(col - w, 0);
+		w += run;
+		pos += run;
+		if (pos >= ld->line_len || w + (c_width = get_char_width(&ld->line[pos], encoding)) > col) break;
+		if (ld->line[pos] != '\t') w += c_width;
+		else w += tab_size - w % tab_size;
+		pos = next_pos(ld->line, pos, encoding);
+	}
+
+	*width = w;
+	return pos;
+}
+
 /* Given a column, the index of the byte "containing" that position is
    given, that is, calc_width(index) > n, and index is minimum with this
    property. If the width of the line is smaller than the given column, the
    line length is returned. */
 
 static int64_t inline calc_pos(const line_desc * const ld, const int64_t col, const int tab_size, const encoding_type encoding) {
-	int c_width;
-	int64_t pos = 0;
-	for(int64_t width = 0; pos < ld->line_len && width + (c_width = get_char_width(&ld->line[pos], encoding)) <= col; pos = next_pos(ld->line, pos, encoding)) {
-		if (ld->line[pos] != '\t') width += c_width;
-		else width += tab_size - width % tab_size;
-	}
-
-	return pos;
+	col_checkpoint cp = { 0 };
+	if (ld->line_len >= COL_INDEX_MIN_LEN && col > COL_INDEX_STEP) col_index_by_col(ld, col, tab_size, encoding, &cp);
+	return calc_pos_from(ld, col, tab_size, encoding, cp.pos, &cp.width);
 }
 
 /* Given a column, the index of the byte "containing" that position is
@@ -121,12 +178,11 @@ static int64_t inline calc_pos(const line_desc * const ld, const int64_t col, co
    line is extended with spaces. */
 
 static int64_t inline calc_virt_pos(const line_desc * const ld, const int64_t col, const int tab_size, const encoding_type encoding) {
-	int c_width;
-	int64_t pos, width;
-	for(pos = width = 0; pos < ld->line_len && width + (c_width = get_char_width(&ld->line[pos], encoding)) <= col; pos = next_pos(ld->line, pos, encoding)) {
-		if (ld->line[pos] != '\t') width += c_width;
-		else width += tab_size - width % tab_size;
-	}
+	col_checkpoint cp = { 0 };
+	if (ld->line_len >= COL_INDEX_MIN_LEN && col > COL_INDEX_STEP) col_index_by_col(ld, col, tab_size, encoding, &cp);
+
+	int64_t width = cp.width;
+	int64_t pos = calc_pos_from(ld, col, tab_size, encoding, cp.pos, &width);
 
 	assert(pos <= ld->line_len);
 	assert(pos == ld->line_len || width == col);
@@ -182,7 +238,12 @@ static int inline get_char(const char * const s, const encoding_type encoding) {
 static int inline get_string_width(const char * const s, const int64_t len, const encoding_type encoding) {
 	if (s == NULL) return len;
 	int64_t width = 0;
-	for(int64_t pos = 0; pos < len; pos = next_pos(s, pos, encoding)) width += get_char_width(s + pos, encoding);
+	for(int64_t pos = 0; pos < len; pos = next_pos(s, pos, encoding)) {
+		const int64_t run = ascii_run(s + pos, len - pos);
+		width += run;
+		if ((pos += run) >= len) break;
+		width += get_char_width(s + pos, encoding);
+	}
 	return width;
 }
 
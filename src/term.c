@@ -35,6 +35,7 @@
 
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #include "term.h"
 #include "ansi.h"
@@ -196,6 +197,11 @@ the cursor motion strings. */
 struct cm Wcm;
 
 
+/* The (xterm) sequences turning bracketed paste on and off. */
+
+#define BRACKETED_PASTE_ON "\x1b[?2004h"
+#define BRACKETED_PASTE_OFF "\x1b[?2004l"
+
 #define OUTPUT(a) tputs (a, ne_lines - curY, cmputc)
 #define OUTPUT1(a) tputs (a, 1, cmputc)
 #define OUTPUTL(a, lines) tputs (a, lines, cmputc)
@@ -239,15 +245,91 @@ int	specified_window;
 
 bool	io_utf8;
 
+/* wcwidth() is slow (it usually scans tables of intervals), and it is called
+ for every non-US-ASCII character we display or whose width we compute. We
+ cache its results in a two-level table: the first level is indexed by the
+ upper bits of the code point, and points to blocks containing the widths of
+ WIDTH_BLOCK_SIZE consecutive code points. Blocks are filled lazily from the
+ current locale the first time one of their characters is examined; blocks
+ in which all characters have width one (most of them) share the same
+ storage. Since widths are also computed by the autocompletion threads,
+ blocks are filled and published under a mutex; a published block is never
+ modified. */
+
+#ifndef NOWCHAR
+
+#define WIDTH_BLOCK_BITS 8
+#define WIDTH_BLOCK_SIZE (1 << WIDTH_BLOCK_BITS)
+#define WIDTH_MAX_CHAR 0x10FFFF
+
+static const signed char *width_block[(WIDTH_MAX_CHAR >> WIDTH_BLOCK_BITS) + 1];
+static signed char width_ones[WIDTH_BLOCK_SIZE];
+static pthread_mutex_t width_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the width of c after filling (if necessary) its block. */
+
+static int fill_width_block(const int c) {
+	const int n = c >> WIDTH_BLOCK_BITS;
+	signed char scratch[WIDTH_BLOCK_SIZE];
+	bool ones = true;
+
+	for(int i = 0; i < WIDTH_BLOCK_SIZE; i++) {
+		scratch[i] = wcwidth(n << WIDTH_BLOCK_BITS | i);
+		if (scratch[i] != 1) ones = false;
+	}
+
+	pthread_mutex_lock(&width_mutex);
+	if (!width_block[n]) {
+		if (ones) {
+			if (!width_ones[0]) memset(width_ones, 1, sizeof width_ones);
+			width_block[n] = width_ones;
+		}
+		else {
+			signed char * const block = malloc(WIDTH_BLOCK_SIZE);
+			if (block) width_block[n] = memcpy(block, scratch, WIDTH_BLOCK_SIZE); /* Otherwise, we will try again next time. */
+		}
+	}
+	pthread_mutex_unlock(&width_mutex);
+	return scratch[c & WIDTH_BLOCK_SIZE - 1];
+}
+
+#endif
+
+/* Returns the same value of wcwidth(c), using the table above. */
+
+static int char_wcwidth(const int c) {
+#ifdef NOWCHAR
+	return wcwidth(c);
+#else
+	if (c < 0 || c > WIDTH_MAX_CHAR) return wcwidth(c);
+	const signed char * const block = width_block[c >> WIDTH_BLOCK_BITS];
+	return block ? block[c & WIDTH_BLOCK_SIZE - 1] : fill_width_block(c);
+#endif
+}
+
 /* Returns the output width of the given character. It is maximised with 1
  w.r.t. wcwidth(), so its result is equivalent to the width of the character
  that will be output by out(). */
 
 int output_width(const int c) {
-	const int width = wcwidth(c);
+	if (c < 0x80) return 1;
+	const int width = char_wcwidth(c);
 	return width > 0 ? width : 1;
 }
 
+/* Returns the length of the longest prefix of the first len bytes of s made
+ of US-ASCII characters. Bytes are examined a word at a time. */
+
+static int ascii_prefix_len(const char * const s, const int len) {
+	int i = 0;
+	for(uint64_t w; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, 8);
+		if (w & UINT64_C(0x8080808080808080)) break;
+	}
+	while(i < len && (unsigned char)s[i] < 0x80) i++;
+	return i;
+}
+
 /* Returns the output width of the given string. If s is NULL, returns len.  If
 the width of the string exceeds maxWidth, modifies len so that it contains the
 longest prefix of s whose width is not greater than maxWidth, and returns the
@@ -261,6 +343,13 @@ static int string_output_width(const char *s, int *len, int maxWidth, bool utf8)
 	else {
 		int width = 0, char_width, l = *len;
 		if (utf8) {
+			/* US-ASCII characters have width one, and their number is the
+			number of bytes they occupy. */
+			const int ascii_len = ascii_prefix_len(s, l < maxWidth ? l : maxWidth);
+			width = ascii_len;
+			s += ascii_len;
+			l -= ascii_len;
+
 			while(l-- != 0) {
 				char_width = output_width(utf8char(s));
 				if (width + char_width > maxWidth) {
@@ -445,7 +534,7 @@ static void out(int c, const uint32_t attr) {
 	/* If io_utf8 is off, we consider all characters in the range of ISO-8859-x
 	encoding schemes as printable. */
 
-	if (io_utf8 && wcwidth(c) <= 0) {
+	if (io_utf8 && char_wcwidth(c) <= 0) {
 		c = '?';
 		add_attr = INVERSE;
 	}
@@ -558,6 +647,12 @@ void set_terminal_modes(void) {
 	if (ne_has_meta_key) OUTPUT1_IF(ne_meta_on);
    turn_off_standout();
 	losecursor();
+
+	/* We ask the terminal to bracket pasted text with ESC [ 200 ~ and
+	ESC [ 201 ~, so that we can insert it as a whole (see get_paste_stream()).
+	Terminals not supporting bracketed paste ignore the request. */
+
+	OUTPUT1(BRACKETED_PASTE_ON);
 }
 
 
@@ -568,6 +663,7 @@ void reset_terminal_modes (void) {
 	OUTPUT1_IF(ne_exit_attribute_mode);
 	OUTPUT1_IF(ne_exit_alt_charset_mode);
 	turn_off_standout();
+	OUTPUT1(BRACKETED_PASTE_OFF);
 	OUTPUT1_IF(ne_keypad_local);
 	OUTPUT1_IF(ne_exit_ca_mode);
 }
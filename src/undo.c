@@ -21,16 +21,319 @@
 
 #include "ne.h"
 #include "support.h"
+#include <sys/mman.h>
 
 
-/* How many undo steps we (re)allocate whenever we need more. */
+/* How many undo log bytes we (re)allocate whenever we need more. */
 
-#define STD_UNDO_STEP_SIZE		(1024)
+#define STD_UNDO_STEP_SIZE		(8*1024)
 
 /* How many undo stream bytes we (re)allocate whenever we need more. */
 
 #define STD_UNDO_STREAM_SIZE	(16*1024)
 
+/* The maximum length of a step obtained by coalescing independent undo
+   units (e.g., characters typed one after the other). Steps within the same
+   chain are undone together anyway, so they are coalesced without limits; on
+   the contrary, unlimited coalescing of independent units would make a long
+   stretch of typing disappear with a single undo. */
+
+#define MAX_COALESCED_LEN		(64)
+
+/* Undo steps are stored in a log of variable-length records. Each record
+   contains the difference between the line of the step and the line of the
+   previous step, the position and the length of the step, each as a zigzag
+   varint (so the small negative values used by the undo conventions are
+   cheap), followed by a byte containing the length of the three varints, so
+   that the log can be walked backwards, too. The top bit of the last byte is
+   set if the step can be extended by a following compatible step (i.e., it is
+   a deletion, or an insertion not spanning several lines). A typical step
+   thus occupies four or five bytes instead of sizeof(undo_step). */
+
+#define MAX_STEP_RECORD_LEN	(3 * 10 + 1)
+#define EXTENDABLE_STEP			(0x80)
+
+/* The log and the undo stream are undo_arrays: when together they use more
+   than undo_memory kilobytes, the parts far from the current position are
+   moved to a per-buffer spill file (an anonymous temporary file), and paged
+   back in when undoing or redoing that far. Offsets (cur_offset, cur_stream,
+   etc.) always refer to the whole array. Everything outside the window kept
+   in memory is in the spill file, which is rewritten whenever a part of the
+   window is evicted. At least UNDO_MARGIN bytes of the log preceding
+   cur_offset are in memory when recording, which is enough to decode
+   backwards the few steps that might be modified. */
+
+#define UNDO_MARGIN				(4 * MAX_STEP_RECORD_LEN)
+
+/* How many bytes we page in at least when reading back from a spill file
+   (but never more than an eighth of the budget, to avoid thrashing). */
+
+#define UNDO_PAGE_SIZE			(undo_memory > 0 ? min(64*1024, undo_memory * 1024LL / 8) : 64*1024)
+
+#define STEP_PTR(ub, offset)	((ub)->steps.data + (offset) - (ub)->steps.base)
+#define STREAM_PTR(ub, offset)	((ub)->streams.data + (offset) - (ub)->streams.base)
+
+/* Shrinks the window of an undo array to [new_base..new_top), writing the
+   evicted data to the spill file. */
+
+static int evict_undo_array(undo_array * const ua, const int64_t new_base, const int64_t new_top) {
+	assert_undo_array(ua);
+	assert(ua->base <= new_base && new_base <= new_top && new_top <= ua->top);
+
+	if (new_base == ua->base && new_top == ua->top) return OK;
+	if (!ua->spill && !(ua->spill = tmpfile())) return CANT_OPEN_TEMPORARY_FILE;
+
+	const int fd = fileno(ua->spill);
+	if (new_base > ua->base && pwrite(fd, ua->data, new_base - ua->base, ua->base) != new_base - ua->base) return IO_ERROR;
+	if (new_top < ua->top && pwrite(fd, ua->data + new_top - ua->base, ua->top - new_top, new_top) != ua->top - new_top) return IO_ERROR;
+
+	memmove(ua->data, ua->data + new_base - ua->base, new_top - new_base);
+	ua->base = new_base;
+	ua->top = new_top;
+
+	/* We give back the memory we do not need anymore. */
+	if (ua->size > 2 * (new_top - new_base) + STD_UNDO_STREAM_SIZE) {
+		char * const p = realloc(ua->data, new_top - new_base + STD_UNDO_STREAM_SIZE);
+		if (p) {
+			ua->data = p;
+			ua->size = new_top - new_base + STD_UNDO_STREAM_SIZE;
+		}
+	}
+	return OK;
+}
+
+/* Enlarges the window of an undo array so that it contains [from..to),
+   reading data back from the spill file (at least UNDO_PAGE_SIZE bytes, but
+   never beyond end, the end of the array). If the window and the requested
+   range are not adjacent, the window is evicted completely first. */
+
+static int load_undo_array(undo_array * const ua, int64_t from, int64_t to, const int64_t end) {
+	assert_undo_array(ua);
+	assert(from <= to && to <= end);
+
+	if (from >= ua->base && to <= ua->top) return OK;
+
+	if (from < ua->base) from = max(0, min(from, ua->base - UNDO_PAGE_SIZE));
+	if (to > ua->top) to = min(end, max(to, ua->top + UNDO_PAGE_SIZE));
+
+	if (to < ua->base || from > ua->top) {
+		const int error = evict_undo_array(ua, ua->top, ua->top);
+		if (error) return error;
+		ua->base = ua->top = from;
+	}
+
+	from = min(from, ua->base);
+	to = max(to, ua->top);
+	const int64_t before = ua->base - from, used = ua->top - ua->base, after = to - ua->top;
+
+	if (to - from > ua->size) {
+		char * const p = realloc(ua->data, to - from);
+		if (!p) return OUT_OF_MEMORY;
+		ua->data = p;
+		ua->size = to - from;
+	}
+
+	memmove(ua->data + before, ua->data, used);
+	if (before && pread(fileno(ua->spill), ua->data, before, from) != before
+		|| after && pread(fileno(ua->spill), ua->data + before + used, after, ua->top) != after) {
+		memmove(ua->data, ua->data + before, used);
+		return IO_ERROR;
+	}
+
+	ua->base = from;
+	ua->top = to;
+	return OK;
+}
+
+/* Makes room for appending len bytes at the given offset, discarding
+   whatever follows it. */
+
+static int reserve_undo_array(undo_array * const ua, const int64_t offset, const int64_t len, const int64_t increment) {
+	int error;
+
+	if (offset > ua->top || offset < ua->base) {
+		if (error = evict_undo_array(ua, ua->top, ua->top)) return error;
+		ua->base = offset;
+	}
+	ua->top = offset;
+
+	if (offset - ua->base + len > ua->size) {
+		char * const p = realloc(ua->data, offset - ua->base + len + increment);
+		if (!p) return OUT_OF_MEMORY;
+		ua->data = p;
+		ua->size = offset - ua->base + len + increment;
+	}
+	return OK;
+}
+
+/* Keeps the window of an undo array within limit bytes, evicting data far
+   from the current offset cur, but keeping at least margin bytes before it.
+   Failures are harmless: data is simply kept in memory. */
+
+static void fit_undo_array(undo_array * const ua, const int64_t cur, const int64_t limit, const int64_t margin) {
+	if (ua->top - ua->base <= limit) return;
+	const int64_t keep = max(limit / 2, margin), new_base = max(ua->base, min(cur - keep, ua->top));
+	evict_undo_array(ua, new_base, max(new_base, min(ua->top, cur + keep)));
+}
+
+/* Keeps the undo buffer within the budget set by undo_memory, giving half of
+   it to the log and half to the stream. */
+
+static void fit_undo_buffer(undo_buffer * const ub) {
+	if (undo_memory <= 0) return;
+	const int64_t limit = undo_memory * 1024LL / 2;
+	fit_undo_array(&ub->steps, ub->cur_offset, limit, UNDO_MARGIN);
+	fit_undo_array(&ub->streams, ub->cur_stream, limit, 0);
+}
+
+/* Makes sure that the UNDO_MARGIN bytes of the log preceding cur_offset are
+   in memory. */
+
+static int ensure_undo_steps(undo_buffer * const ub) {
+	return load_undo_array(&ub->steps, max(0, ub->cur_offset - UNDO_MARGIN), ub->cur_offset, ub->last_offset);
+}
+
+static int put_varint(char * const p, const int64_t x) {
+	uint64_t u = (uint64_t)x << 1 ^ (uint64_t)(x >> 63);
+	int n = 0;
+	while(u >= 0x80) {
+		p[n++] = (char)(u | 0x80);
+		u >>= 7;
+	}
+	p[n++] = (char)u;
+	return n;
+}
+
+static int get_varint(const char * const p, int64_t * const x) {
+	uint64_t u = 0;
+	int n = 0, shift = 0;
+	do {
+		u |= (uint64_t)((unsigned char)p[n] & 0x7F) << shift;
+		shift += 7;
+	} while((unsigned char)p[n++] & 0x80);
+	*x = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+	return n;
+}
+
+/* Encodes a step record at p, returning its length. */
+
+static int encode_step(char * const p, const int64_t delta, const int64_t pos, const int64_t len, const bool extendable) {
+	int n = put_varint(p, delta);
+	n += put_varint(p + n, pos);
+	n += put_varint(p + n, len);
+	p[n] = n | (extendable ? EXTENDABLE_STEP : 0);
+	return n + 1;
+}
+
+/* Decodes the step record starting at p, returning its length. */
+
+static int decode_step(const char * const p, int64_t * const delta, undo_step * const step) {
+	int n = get_varint(p, delta);
+	n += get_varint(p + n, &step->pos);
+	n += get_varint(p + n, &step->len);
+	return n + 1;
+}
+
+/* Returns the offset of the step record ending at the given offset. */
+
+static inline int64_t step_start(const undo_buffer * const ub, const int64_t offset) {
+	return offset - 1 - (*(unsigned char *)STEP_PTR(ub, offset - 1) & ~EXTENDABLE_STEP);
+}
+
+/* Returns whether the step record ending at the given offset is extendable. */
+
+static inline bool step_extendable(const undo_buffer * const ub, const int64_t offset) {
+	return *(unsigned char *)STEP_PTR(ub, offset - 1) & EXTENDABLE_STEP;
+}
+
+/* Decodes the step preceding cur_step (which must be positive, and must be
+   in memory). If delta is not NULL, the line difference stored in the record
+   is returned there. */
+
+static undo_step prev_step(const undo_buffer * const ub, int64_t * const delta) {
+	undo_step step;
+	int64_t d;
+	assert(ub->cur_step > 0);
+	decode_step(STEP_PTR(ub, step_start(ub, ub->cur_offset)), &d, &step);
+	step.line = ub->cur_line;
+	if (delta) *delta = d;
+	return step;
+}
+
+/* Replaces pos and len of the step preceding cur_step, moving the following
+   records if the length of the encoding changes. */
+
+static int rewrite_prev_step(undo_buffer * const ub, const int64_t pos, const int64_t len, const bool extendable) {
+	const int64_t start = step_start(ub, ub->cur_offset);
+	int64_t delta;
+	undo_step step;
+	char record[MAX_STEP_RECORD_LEN];
+	int error;
+
+	decode_step(STEP_PTR(ub, start), &delta, &step);
+	const int64_t n = encode_step(record, delta, pos, len, extendable), shift = start + n - ub->cur_offset;
+
+	if (shift) {
+		/* We need all the following records in memory. */
+		if (error = load_undo_array(&ub->steps, ub->steps.base, ub->last_offset, ub->last_offset)) return error;
+		if (ub->last_offset - ub->steps.base + shift > ub->steps.size) {
+			char * const p = realloc(ub->steps.data, ub->steps.size + STD_UNDO_STEP_SIZE);
+			if (!p) return OUT_OF_MEMORY;
+			ub->steps.data = p;
+			ub->steps.size += STD_UNDO_STEP_SIZE;
+		}
+		memmove(STEP_PTR(ub, ub->cur_offset + shift), STEP_PTR(ub, ub->cur_offset), ub->last_offset - ub->cur_offset);
+	}
+	memcpy(STEP_PTR(ub, start), record, n);
+	ub->cur_offset += shift;
+	ub->last_offset += shift;
+	ub->steps.top += shift;
+	return 0;
+}
+
+/* Returns whether step can be extended by a step on the same line with
+   given position and length: either they are insertions at contiguous
+   positions (e.g., typing), or deletions at the same position (e.g., deleting
+   forward). In both cases the undo stream is already in the right order. */
+
+static bool compatible_steps(const undo_step * const step, const int64_t line, const int64_t pos, const int64_t len) {
+	if (step->line != line || (step->len < 0) != (len < 0)) return false;
+	const int64_t real_pos = pos < 0 ? -1 - pos : pos, prev_pos = step->pos < 0 ? -1 - step->pos : step->pos;
+	return len < 0 ? prev_pos - step->len == real_pos : prev_pos == real_pos;
+}
+
+/* Tries to merge the last two steps, provided that each of them is a complete
+   undo unit (i.e., it is not linked, and it is not the last step of a chain).
+   We never merge across the step of the last save, as last_save_step would
+   become meaningless, or if some redo is possible. */
+
+static int coalesce_last_steps(undo_buffer * const ub) {
+	if (ub->cur_step < 2 || ub->cur_step != ub->last_step || ub->last_save_step >= ub->cur_step - 1) return 0;
+
+	const int64_t last_start = step_start(ub, ub->cur_offset), prev_start = step_start(ub, last_start);
+	int64_t last_delta, delta;
+	undo_step last, prev;
+
+	decode_step(STEP_PTR(ub, last_start), &last_delta, &last);
+	decode_step(STEP_PTR(ub, prev_start), &delta, &prev);
+	last.line = ub->cur_line;
+	prev.line = ub->cur_line - last_delta;
+
+	if (last.pos < 0 || prev.pos < 0 || !step_extendable(ub, last_start)) return 0;
+	if (!compatible_steps(&prev, last.line, last.pos, last.len) || llabs(prev.len + last.len) > MAX_COALESCED_LEN) return 0;
+	if (ub->cur_step > 2) {
+		undo_step before;
+		decode_step(STEP_PTR(ub, step_start(ub, prev_start)), &delta, &before);
+		if (before.pos < 0) return 0;
+	}
+
+	const bool extendable = step_extendable(ub, ub->cur_offset);
+	ub->cur_offset = ub->last_offset = ub->steps.top = last_start;
+	ub->cur_line = prev.line;
+	ub->last_step = --ub->cur_step;
+	return rewrite_prev_step(ub, prev.pos, prev.len + last.len, extendable);
+}
+
 /* This is the main function for recording an undo step (though it should be
    called through add_undo_step). It adds to the given undo buffer an undo step
    with given line, position and length, possibly enlarging the undo step
@@ -39,33 +342,28 @@
    pos. */
 
 
-static int cat_undo_step(undo_buffer * const ub, const int64_t line, const int64_t pos, const int64_t len) {
+static int cat_undo_step(undo_buffer * const ub, const int64_t line, const int64_t pos, const int64_t len, const bool extendable) {
 	if (!ub) return false;
 
 	assert_undo_buffer(ub);
 
-	if (ub->cur_step >= ub->steps_size) {
-		undo_step * const ud = realloc(ub->steps, (ub->steps_size + STD_UNDO_STEP_SIZE) * sizeof(undo_step));
-		if (ud) {
-			ub->steps_size += STD_UNDO_STEP_SIZE;
-			ub->steps = ud;
-		}
-		else return OUT_OF_MEMORY;
-	}
+	const int error = reserve_undo_array(&ub->steps, ub->cur_offset, MAX_STEP_RECORD_LEN, STD_UNDO_STEP_SIZE);
+	if (error) return error;
 
-	ub->steps[ub->cur_step].line = line;
-	ub->steps[ub->cur_step].pos = pos;
-	ub->steps[ub->cur_step].len = len;
+	ub->cur_offset += encode_step(STEP_PTR(ub, ub->cur_offset), line - ub->cur_line, pos, len, extendable);
+	ub->cur_line = line;
+	ub->last_offset = ub->steps.top = ub->cur_offset;
 
 	if (ub->last_save_step > ub->cur_step) ub->last_save_step = -1;
 	ub->last_step = ++ub->cur_step;
 	ub->last_stream = ub->cur_stream;
+	if (ub->streams.top > ub->cur_stream) ub->streams.top = max(ub->streams.base, ub->cur_stream);
 	reset_stream(&ub->redo);
+	fit_undo_buffer(ub);
 	return 0;
 }
 
 
-
 /* Activates the chaining feature of the undo system. Any operations recorded
    between start_undo_chain() and end_undo_chain() will be undone or redone as
    a single entity. These calls can be nested, since a nesting index keeps
@@ -80,15 +378,22 @@ void start_undo_chain(buffer * const b) {
 #endif
 
 	assert_buffer(b);
-	assert(b->undo.cur_step == 0 || b->link_undos || b->undo.steps[b->undo.cur_step - 1].pos >= 0);
+#ifndef NDEBUG
+	if (b->undo.cur_step && !b->link_undos) {
+		const int error = ensure_undo_steps(&b->undo);
+		assert(error || prev_step(&b->undo, NULL).pos >= 0);
+	}
+#endif
 
 	b->link_undos++;
 }
 
 
-/* See the comments to the previous function. */
+/* See the comments to the previous function. When the outermost chain ends,
+   if it consists of a single step we try to coalesce it with the previous
+   one. Returns an error if the step records could not be rewritten. */
 
-void end_undo_chain(buffer * const b) {
+int end_undo_chain(buffer * const b) {
 
 #ifdef NE_TEST
 	D(fprintf(stderr, "# end_undo_chain: %d -> %d\n", b->link_undos, b->link_undos - 1);)
@@ -97,9 +402,13 @@ void end_undo_chain(buffer * const b) {
 
 	assert_undo_buffer(&b->undo);
 
-	if (--b->link_undos) return;
+	if (--b->link_undos || !b->undo.cur_step) return 0;
 
-	if (b->undo.cur_step && b->undo.steps[b->undo.cur_step - 1].pos < 0) b->undo.steps[b->undo.cur_step - 1].pos = -(1 + b->undo.steps[b->undo.cur_step - 1].pos);
+	int error;
+	if (error = ensure_undo_steps(&b->undo)) return error;
+	const undo_step step = prev_step(&b->undo, NULL);
+	if (step.pos < 0 && (error = rewrite_prev_step(&b->undo, -(1 + step.pos), step.len, step_extendable(&b->undo, b->undo.cur_offset)))) return error;
+	return coalesce_last_steps(&b->undo);
 }
 
 
@@ -107,10 +416,27 @@ void end_undo_chain(buffer * const b) {
    takes care of recording a position of -pos-1 if the undo linking feature is
    in use. A positive len records an insertion, a negative len records a
    deletion. When an insertion is recorded, len characters have to be added to
-   the undo stream with add_to_undo_stream(). */
+   the undo stream with add_to_undo_stream(). extendable must be false if the
+   step cannot absorb a following compatible step (e.g., for a multiline
+   insertion). Compatible steps in the same chain are merged immediately;
+   independent steps are merged when they are complete. */
+
+int add_undo_step(buffer * const b, const int64_t line, const int64_t pos, const int64_t len, const bool extendable) {
+	undo_buffer * const ub = &b->undo;
+	int error;
+
+	if (error = ensure_undo_steps(ub)) return error;
+
+	if (b->link_undos && ub->cur_step && ub->cur_step == ub->last_step) {
+		const undo_step step = prev_step(ub, NULL);
+		/* A linked step belongs to the current chain. */
+		if (step.pos < 0 && step_extendable(ub, ub->cur_offset) && compatible_steps(&step, line, pos, len))
+			return rewrite_prev_step(ub, step.pos, step.len + len, extendable);
+	}
 
-int add_undo_step(buffer * const b, const int64_t line, const int64_t pos, const int64_t len) {
-	return cat_undo_step(&b->undo, line, b->link_undos ? -pos - 1 : pos, len);
+	error = cat_undo_step(ub, line, b->link_undos ? -pos - 1 : pos, len, extendable);
+	if (!error && !b->link_undos) error = coalesce_last_steps(ub);
+	return error;
 }
 
 /* Fixes the last undo step adding the given delta to its length. This
@@ -118,7 +444,9 @@ int add_undo_step(buffer * const b, const int64_t line, const int64_t pos, const
    the exact length of a deletion until it is performed. */
 
 void fix_last_undo_step(buffer * const b, const int64_t delta) {
-	b->undo.steps[b->undo.cur_step - 1].len += delta;
+	if (!delta || ensure_undo_steps(&b->undo)) return;
+	const undo_step step = prev_step(&b->undo, NULL);
+	rewrite_prev_step(&b->undo, step.pos, step.len + delta, step_extendable(&b->undo, b->undo.cur_offset));
 }
 
 
@@ -128,31 +456,33 @@ int add_to_undo_stream(undo_buffer * const ub, const char * const p, const int64
 
 	assert(len > 0);
 	assert(ub != NULL);
-	assert(ub->cur_step && ub->steps[ub->cur_step - 1].len > 0);
 
 	if (!ub) return -1;
 
 	assert_undo_buffer(ub);
 
-	if (!ub->cur_step || ub->steps[ub->cur_step - 1].len < 0) return -1;
-
-	if (ub->cur_stream + len >= ub->streams_size) {
-		char *new_stream;
+	if (!ub->cur_step || ensure_undo_steps(ub) || prev_step(ub, NULL).len < 0) return -1;
 
-		if (new_stream = realloc(ub->streams, (ub->cur_stream + len + STD_UNDO_STREAM_SIZE))) {
-			ub->streams_size = ub->cur_stream + len + STD_UNDO_STREAM_SIZE;
-			ub->streams = new_stream;
-		}
-		else return OUT_OF_MEMORY;
-	}
+	const int error = reserve_undo_array(&ub->streams, ub->cur_stream, len, STD_UNDO_STREAM_SIZE);
+	if (error) return error;
 
-	memcpy(&ub->streams[ub->cur_stream], p, len);
-	ub->last_stream = (ub->cur_stream += len);
+	memcpy(STREAM_PTR(ub, ub->cur_stream), p, len);
+	ub->last_stream = ub->streams.top = (ub->cur_stream += len);
+	fit_undo_buffer(ub);
 
 	return 0;
 }
 
 
+/* Frees the memory and the spill file of an undo array, and empties it. */
+
+static void free_undo_array(undo_array * const ua) {
+	free(ua->data);
+	if (ua->spill) fclose(ua->spill);
+	memset(ua, 0, sizeof *ua);
+}
+
+
 /* Resets the undo buffer. All the previous undo steps are lost. */
 
 void reset_undo_buffer(undo_buffer * const ub) {
@@ -160,17 +490,372 @@ void reset_undo_buffer(undo_buffer * const ub) {
 	ub->last_step =
 	ub->cur_stream =
 	ub->last_stream =
-	ub->steps_size =
-	ub->streams_size = 0;
+	ub->cur_offset =
+	ub->last_offset =
+	ub->cur_line = 0;
 	ub->last_save_step = 0;
-	free(ub->streams);
-	free(ub->steps);
-	ub->streams = NULL;
-	ub->steps = NULL;
+	ub->journal_checked = false;
+	free_undo_array(&ub->steps);
+	free_undo_array(&ub->streams);
 	reset_stream(&ub->redo);
 }
 
 
+/* The undo journal keeps the undo history of a document across sessions.
+   When undo_journal is true, saving a document writes its undo history up to
+   the current step in a file in the undo subdirectory of the preferences
+   directory, whose name is a hash of the canonical name of the document.
+   The journal is read only if the user tries to undo past the beginning of
+   the history of a document just loaded, and only if the hash of the
+   document contents matches the one recorded in the journal, or when the
+   document is saved for the first time, and only if the file has not
+   changed since the journal was written. In both cases the journal is
+   chained in front of the history of the current session, so a journal
+   written later contains the whole history. Journals are meant to be read
+   on the same machine, so the header uses native integers. The header is
+   followed by the canonical name of the document, by the step log and by
+   the undo stream. */
+
+#define UNDO_JOURNAL_MAGIC "ne-undo1"
+
+typedef struct {
+	char magic[8];
+	uint64_t hash;
+	int64_t steps;
+	int64_t log_len;
+	int64_t stream_len;
+	int64_t cur_line;
+	int64_t path_len;
+	file_stamp stamp;
+} undo_journal_header;
+
+/* A 64-bit FNV-1a hash. */
+
+static uint64_t fnv_hash(uint64_t h, const char * const p, const int64_t len) {
+	for(int64_t i = 0; i < len; i++) h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/* Returns a hash of the contents of a buffer. */
+
+static uint64_t buffer_hash(const buffer * const b) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(line_desc *ld = (line_desc *)b->line_desc_list.head; ld->ld_node.next; ld = (line_desc *)ld->ld_node.next) {
+		h = fnv_hash(h, ld->line, ld->line_len);
+		h = fnv_hash(h, "\n", 1);
+	}
+	return h;
+}
+
+/* Returns the name of the undo journal of the given file, and its canonical
+   name in *path (both to be freed), or NULL. If create is true, the journal
+   directory is created if necessary. */
+
+static char *undo_journal_name(const char * const filename, char ** const path, const bool create) {
+	const char * const prefs_dir = exists_prefs_dir();
+	if (!prefs_dir || !(*path = realpath(tilde_expand(filename), NULL))) return NULL;
+
+	char * const name = malloc(strlen(prefs_dir) + 6 + 16 + 1);
+	if (name) {
+		strcat(strcpy(name, prefs_dir), "undo");
+		if (create) mkdir(name, 0700);
+		sprintf(name + strlen(name), "/%016" PRIx64, fnv_hash(0xcbf29ce484222325ULL, *path, strlen(*path)));
+		return name;
+	}
+	free(*path);
+	return NULL;
+}
+
+/* Writes the first len bytes of an undo array to fd. */
+
+static int write_undo_array(const int fd, const undo_array * const ua, const int64_t len) {
+	char buffer[64 * 1024];
+	for(int64_t done = 0, n; done < len; done += n) {
+		const char *p;
+		if (done >= ua->base && done < ua->top) {
+			n = min(ua->top, len) - done;
+			p = ua->data + done - ua->base;
+		}
+		else {
+			n = min(len - done, (int64_t)sizeof buffer);
+			if (done < ua->base) n = min(n, ua->base - done);
+			if (pread(fileno(ua->spill), buffer, n, done) != n) return IO_ERROR;
+			p = buffer;
+		}
+		if (write(fd, p, n) != n) return IO_ERROR;
+	}
+	return OK;
+}
+
+/* Copies the bytes of an undo array from offset from to offset to to p. */
+
+static int read_undo_array(const undo_array * const ua, char * const p, const int64_t from, const int64_t to) {
+	const int64_t base = max(from, min(ua->base, to)), top = max(base, min(ua->top, to));
+	if (base > from && pread(fileno(ua->spill), p, base - from, from) != base - from) return IO_ERROR;
+	if (top > base) memcpy(p + base - from, ua->data + base - ua->base, top - base);
+	if (to > top && pread(fileno(ua->spill), p + top - from, to - top, top) != to - top) return IO_ERROR;
+	return OK;
+}
+
+static bool load_undo_journal(buffer * const b, const char * const filename, const file_stamp * const stamp);
+
+/* Saves the undo journal of a buffer that has just been saved to filename.
+   stamp is the stamp of the file before the save: if the journal has not
+   been checked yet, and the file has not changed since the journal was
+   written, the journal is chained in front of the current history first. */
+
+int save_undo_journal(buffer * const b, const char * const filename, const file_stamp * const stamp) {
+	if (!undo_journal || !b->opt.do_undo || !filename) return OK;
+
+	undo_buffer * const ub = &b->undo;
+	load_undo_journal(b, filename, stamp);
+	char *path;
+	char * const name = undo_journal_name(filename, &path, true);
+	if (!name) return CANT_FIND_PREFS_DIR;
+
+	int error = OK;
+
+	if (ub->cur_step == 0) unlink(name);
+	else {
+		char * const temp = malloc(strlen(name) + 8);
+		int fd = -1;
+		if (!temp || (fd = mkstemp(strcat(strcpy(temp, name), ".XXXXXX"))) < 0) error = CANT_OPEN_TEMPORARY_FILE;
+		else {
+			undo_journal_header h = { UNDO_JOURNAL_MAGIC, buffer_hash(b), ub->cur_step, ub->cur_offset, ub->cur_stream, ub->cur_line, strlen(path), b->stamp };
+			if (write(fd, &h, sizeof h) != sizeof h || write(fd, path, h.path_len) != h.path_len) error = IO_ERROR;
+			if (!error) error = write_undo_array(fd, &ub->steps, ub->cur_offset);
+			if (!error) error = write_undo_array(fd, &ub->streams, ub->cur_stream);
+			if (close(fd) && !error) error = IO_ERROR;
+			if (!error && rename(temp, name)) error = IO_ERROR;
+			if (error) unlink(temp);
+		}
+		free(temp);
+	}
+
+	free(name);
+	free(path);
+	return error;
+}
+
+/* Fills an empty undo array with len bytes from p, keeping in memory only
+   the part allowed by the budget. */
+
+static int fill_undo_array(undo_array * const ua, const char * const p, const int64_t len) {
+	const int64_t base = undo_memory > 0 ? max(0, len - undo_memory * 1024LL / 2) : 0;
+
+	if (base && (!(ua->spill = tmpfile()) || pwrite(fileno(ua->spill), p, base, 0) != base)) return IO_ERROR;
+	if (!(ua->data = malloc(len - base + STD_UNDO_STREAM_SIZE))) return OUT_OF_MEMORY;
+
+	memcpy(ua->data, p + base, len - base);
+	ua->size = len - base + STD_UNDO_STREAM_SIZE;
+	ua->base = base;
+	ua->top = len;
+	return OK;
+}
+
+/* Chains the step log and the undo stream of a journal (the stream follows
+   the log) in front of the history of an undo buffer. The line difference of
+   the first step of the history, which is relative to line 0, is rewritten
+   relative to the line of the last step of the journal. */
+
+static int chain_undo_journal(undo_buffer * const ub, const undo_journal_header * const h, const char * const log) {
+	char record[MAX_STEP_RECORD_LEN];
+	int64_t n = 0, skip = 0;
+	int error;
+
+	if (ub->last_step) {
+		if (error = load_undo_array(&ub->steps, 0, min(ub->last_offset, MAX_STEP_RECORD_LEN), ub->last_offset)) return error;
+		int64_t delta;
+		undo_step step;
+		skip = decode_step(STEP_PTR(ub, 0), &delta, &step);
+		n = encode_step(record, delta - h->cur_line, step.pos, step.len, step_extendable(ub, skip));
+	}
+
+	const int64_t log_len = h->log_len + n + ub->last_offset - skip, stream_len = h->stream_len + ub->last_stream;
+	char * const p = malloc(max(log_len, stream_len));
+	if (!p) return OUT_OF_MEMORY;
+
+	undo_array steps = { 0 }, streams = { 0 };
+	memcpy(p, log, h->log_len);
+	memcpy(p + h->log_len, record, n);
+	if (!(error = read_undo_array(&ub->steps, p + h->log_len + n, skip, ub->last_offset))
+		&& !(error = fill_undo_array(&steps, p, log_len))) {
+		memcpy(p, log + h->log_len, h->stream_len);
+		if (!(error = read_undo_array(&ub->streams, p + h->stream_len, 0, ub->last_stream)))
+			error = fill_undo_array(&streams, p, stream_len);
+	}
+	free(p);
+
+	if (error) {
+		free_undo_array(&steps);
+		free_undo_array(&streams);
+		return error;
+	}
+
+	free_undo_array(&ub->steps);
+	free_undo_array(&ub->streams);
+	ub->steps = steps;
+	ub->streams = streams;
+
+	if (ub->cur_step) ub->cur_offset += h->log_len + n - skip;
+	else {
+		ub->cur_offset = h->log_len;
+		ub->cur_line = h->cur_line;
+	}
+	ub->last_offset += h->log_len + n - skip;
+	ub->cur_stream += h->stream_len;
+	ub->last_stream += h->stream_len;
+	ub->cur_step += h->steps;
+	ub->last_step += h->steps;
+	if (ub->last_save_step >= 0) ub->last_save_step += h->steps;
+	return OK;
+}
+
+/* Tries to load the undo journal of a buffer for the given file, chaining it
+   in front of the current history, and returns true if some history has been
+   loaded. If stamp is NULL, the buffer must be in the state it was loaded in,
+   and the journal is validated by the hash of the buffer contents; otherwise,
+   the file must still have the given stamp. We try just once. */
+
+static bool load_undo_journal(buffer * const b, const char * const filename, const file_stamp * const stamp) {
+	undo_buffer * const ub = &b->undo;
+	if (!undo_journal || !filename || ub->journal_checked) return false;
+	ub->journal_checked = true;
+
+	char *path;
+	char * const name = undo_journal_name(filename, &path, false);
+	if (!name) return false;
+
+	bool loaded = false;
+	const int fd = open(name, O_RDONLY);
+	struct stat st;
+
+	if (fd >= 0 && !fstat(fd, &st) && st.st_size >= (off_t)sizeof(undo_journal_header)) {
+		const char * const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			undo_journal_header h;
+			memcpy(&h, map, sizeof h);
+			const int64_t len = sizeof h + h.path_len + h.log_len + h.stream_len;
+			if (!memcmp(h.magic, UNDO_JOURNAL_MAGIC, sizeof h.magic) && h.path_len >= 0 && h.log_len > 0 && h.stream_len >= 0 && h.steps > 0
+				&& len == st.st_size && h.path_len == strlen(path) && !memcmp(map + sizeof h, path, h.path_len)
+				&& (stamp ? same_file_stamp(&h.stamp, stamp) : h.hash == buffer_hash(b)))
+				loaded = !chain_undo_journal(ub, &h, map + sizeof h + h.path_len);
+			munmap((void *)map, st.st_size);
+		}
+	}
+
+	if (fd >= 0) close(fd);
+	free(name);
+	free(path);
+	return loaded;
+}
+
+
+/* Undo and redo replay a whole chain of linked steps (e.g., those generated
+   by a ReplaceAll) using a private line cursor, instead of moving the buffer
+   cursor and updating syntax states at each step. Steps must be applied in
+   order, as each one refers to the text left by the previous one, but the
+   cursor moves just by the distance between consecutive steps, so the line
+   list is walked once in the order of the chain. The range of modified lines
+   is tracked as we go, and at the end syntax states are updated once for the
+   whole range, and the view is synchronized with the last step. */
+
+typedef struct {
+	line_desc *ld;       /* The descriptor of line. */
+	int64_t line;        /* The line of the cursor. */
+	int64_t pos;         /* The position of the last step. */
+	line_desc *first_ld; /* The descriptor of first_line, or NULL if no step was applied. */
+	int64_t first_line;  /* The first modified line. */
+	int64_t last_line;   /* The last modified line. */
+} replay_cursor;
+
+
+static void start_replay(buffer * const b, replay_cursor * const rc) {
+	/* Pending syntax updates refer to the current line. */
+	update_syntax_states(b, -1, b->cur_line_desc, NULL);
+	rc->ld = b->cur_line_desc;
+	rc->line = b->cur_line;
+	rc->first_ld = NULL;
+}
+
+
+/* Applies a step, inserting the given stream, or deleting len characters if
+   stream is NULL. */
+
+static void replay_step(buffer * const b, replay_cursor * const rc, const int64_t line, const int64_t pos, const char * const stream, const int64_t len) {
+	assert(line >= 0 && line < b->num_lines);
+
+	const int64_t relative_cost = line < rc->line ? rc->line - line : line - rc->line;
+
+	if (line < relative_cost) {
+		rc->ld = (line_desc *)b->line_desc_list.head;
+		rc->line = 0;
+	}
+	else if (b->num_lines - 1 - line < relative_cost) {
+		rc->ld = (line_desc *)b->line_desc_list.tail_pred;
+		rc->line = b->num_lines - 1;
+	}
+	for(; rc->line < line; rc->line++) rc->ld = (line_desc *)rc->ld->ld_node.next;
+	for(; rc->line > line; rc->line--) rc->ld = (line_desc *)rc->ld->ld_node.prev;
+
+	const int64_t num_lines = b->num_lines;
+	if (stream) insert_stream(b, rc->ld, line, pos, stream, len);
+	else delete_stream(b, rc->ld, line, pos, len);
+	const int64_t delta = b->num_lines - num_lines;
+
+	/* Inserted lines follow line; deleted lines are joined to line, and their
+	   descriptors are freed, but the descriptor of line survives. */
+	if (rc->first_ld) {
+		if (rc->last_line > line) rc->last_line = max(line, rc->last_line + delta);
+		rc->last_line = max(rc->last_line, line + max(delta, 0));
+		if (line < rc->first_line) {
+			rc->first_ld = rc->ld;
+			rc->first_line = line;
+		}
+	}
+	else {
+		rc->first_ld = rc->ld;
+		rc->first_line = line;
+		rc->last_line = line + max(delta, 0);
+	}
+
+	rc->pos = pos;
+}
+
+
+/* Updates syntax states for the modified range, and moves the buffer cursor
+   to the position of the last step applied, scrolling the view only if
+   necessary. */
+
+static void end_replay(buffer * const b, const replay_cursor * const rc) {
+	if (!rc->first_ld) return;
+
+	line_desc *ld = rc->first_ld;
+	for(int64_t i = rc->first_line; i < rc->last_line; i++) ld = (line_desc *)ld->ld_node.next;
+	update_syntax_states_delay(b, rc->first_ld, ld);
+
+	const int64_t win_y = b->win_y;
+	b->y_wanted = 0;
+	b->attr_len = -1;
+	b->cur_line = rc->line;
+	b->cur_line_desc = rc->ld;
+
+	if (b->cur_line < b->win_y || b->cur_line >= b->win_y + ne_lines - 1 || b->win_y > max(0, b->num_lines - (ne_lines - 1))) {
+		b->win_y = b->cur_line - (ne_lines - 1) / 2;
+		if (b->win_y > b->num_lines - (ne_lines - 1)) b->win_y = b->num_lines - (ne_lines - 1);
+		if (b->win_y < 0) b->win_y = 0;
+	}
+
+	b->cur_y = b->cur_line - b->win_y;
+	ld = b->cur_line_desc;
+	for(int64_t i = 0; i < b->cur_y; i++) ld = (line_desc *)ld->ld_node.prev;
+	b->top_line_desc = ld;
+
+	if (b->win_y != win_y && b == cur_buffer) update_window(b);
+	goto_pos(b, rc->pos);
+}
+
+
 /* Undoes the current undo step, which is the last one, if no undo has still be
    done, or an intermediate one, if some undo has already been done. */
 
@@ -181,7 +866,7 @@ int undo(buffer * const b) {
 
 	assert_buffer(b);
 
-	if (b->undo.cur_step == 0) return NOTHING_TO_UNDO;
+	if (b->undo.cur_step == 0 && !load_undo_journal(b, b->filename, NULL)) return NOTHING_TO_UNDO;
 
 	/* WARNING: insert_stream() and delete_stream() do different things while
 		undoing or redoing. */
@@ -191,34 +876,38 @@ int undo(buffer * const b) {
 #ifdef NE_TEST
 	D(fprintf(stderr, "# undo():  undo.cur_step: %d; undo.last_step: %d\n", b->undo.cur_step, b->undo.last_step);)
 #endif
-	do {
+	int error = ensure_undo_steps(&b->undo);
+	replay_cursor rc;
+	start_replay(b, &rc);
 
-		b->undo.cur_step--;
+	while(!error) {
+		int64_t delta;
+		const undo_step step = prev_step(&b->undo, &delta);
 
-		if (b->undo.steps[b->undo.cur_step].len) {
-			goto_line_pos(b, b->undo.steps[b->undo.cur_step].line,
-				b->undo.steps[b->undo.cur_step].pos >= 0 ? b->undo.steps[b->undo.cur_step].pos : -(1 + b->undo.steps[b->undo.cur_step].pos));
+		if (step.len > 0 && (error = load_undo_array(&b->undo.streams, b->undo.cur_stream - step.len, b->undo.cur_stream, b->undo.last_stream))) break;
 
-			if (b->undo.steps[b->undo.cur_step].len < 0) {
-				delete_stream(b, b->cur_line_desc, b->cur_line, b->cur_pos, -b->undo.steps[b->undo.cur_step].len);
-				update_syntax_states_delay(b, b->cur_line_desc, NULL);
-			}
-			else {
-				line_desc *end_ld = (line_desc *)b->cur_line_desc->ld_node.next;
-				insert_stream(b, b->cur_line_desc, b->cur_line, b->cur_pos, b->undo.streams + (b->undo.cur_stream -= b->undo.steps[b->undo.cur_step].len), b->undo.steps[b->undo.cur_step].len);
-				update_syntax_states_delay(b, b->cur_line_desc, end_ld);
-			}
+		b->undo.cur_step--;
+		b->undo.cur_offset = step_start(&b->undo, b->undo.cur_offset);
+		b->undo.cur_line -= delta;
 
+		if (step.len) {
+			const int64_t pos = step.pos >= 0 ? step.pos : -(1 + step.pos);
+			if (step.len < 0) replay_step(b, &rc, step.line, pos, NULL, -step.len);
+			else replay_step(b, &rc, step.line, pos, STREAM_PTR(&b->undo, b->undo.cur_stream -= step.len), step.len);
 		}
 
+		fit_undo_buffer(&b->undo);
+
 #ifdef NE_TEST
 	D(fprintf(stderr, "# undo():  undo.cur_step: %d; undo.last_step: %d\n", b->undo.cur_step, b->undo.last_step);)
 #endif
-	} while(b->undo.cur_step && b->undo.steps[b->undo.cur_step - 1].pos < 0);
+		if (!b->undo.cur_step || (error = ensure_undo_steps(&b->undo)) || prev_step(&b->undo, NULL).pos >= 0) break;
+	}
 
+	end_replay(b, &rc);
 	b->undoing = 0;
 
-	return 0;
+	return error;
 }
 
 
@@ -241,31 +930,38 @@ int redo(buffer * const b) {
 #ifdef NE_TEST
 	D(fprintf(stderr, "# redo():  undo.cur_step: %d; undo.last_step: %d\n", b->undo.cur_step, b->undo.last_step);)
 #endif
+	int error = 0;
+	replay_cursor rc;
+	start_replay(b, &rc);
+
 	do {
-		if (b->undo.steps[b->undo.cur_step].len) {
-			goto_line_pos(b, b->undo.steps[b->undo.cur_step].line,
-				b->undo.steps[b->undo.cur_step].pos >= 0 ? b->undo.steps[b->undo.cur_step].pos : -(1 + b->undo.steps[b->undo.cur_step].pos));
-
-			if (b->undo.steps[b->undo.cur_step].len < 0) { 
-				line_desc *end_ld = (line_desc *)b->cur_line_desc->ld_node.next;
-				insert_stream(b, b->cur_line_desc, b->cur_line, b->cur_pos, b->undo.redo.stream + (b->undo.redo.len += b->undo.steps[b->undo.cur_step].len), -b->undo.steps[b->undo.cur_step].len);
-				update_syntax_states_delay(b, b->cur_line_desc, end_ld);
-			}	
+		int64_t delta;
+		undo_step step;
+
+		if (error = load_undo_array(&b->undo.steps, b->undo.cur_offset, min(b->undo.last_offset, b->undo.cur_offset + MAX_STEP_RECORD_LEN), b->undo.last_offset)) break;
+
+		b->undo.cur_offset += decode_step(STEP_PTR(&b->undo, b->undo.cur_offset), &delta, &step);
+		step.line = b->undo.cur_line += delta;
+
+		if (step.len) {
+			const int64_t pos = step.pos >= 0 ? step.pos : -(1 + step.pos);
+			if (step.len < 0) replay_step(b, &rc, step.line, pos, b->undo.redo.stream + (b->undo.redo.len += step.len), -step.len);
 			else {
-				delete_stream(b, b->cur_line_desc, b->cur_line, b->cur_pos, b->undo.steps[b->undo.cur_step].len);
-				b->undo.cur_stream += b->undo.steps[b->undo.cur_step].len;
-				update_syntax_states_delay(b, b->cur_line_desc, NULL);
+				replay_step(b, &rc, step.line, pos, NULL, step.len);
+				b->undo.cur_stream += step.len;
 			}
 		}
 
 		b->undo.cur_step++;
+		fit_undo_buffer(&b->undo);
 
 #ifdef NE_TEST
 	D(fprintf(stderr, "# redo():  undo.cur_step: %d; undo.last_step: %d\n", b->undo.cur_step, b->undo.last_step);)
 #endif
-	} while(b->undo.cur_step < b->undo.last_step && b->undo.steps[b->undo.cur_step - 1].pos < 0);
+	} while(b->undo.cur_step < b->undo.last_step && prev_step(&b->undo, NULL).pos < 0);
 
+	end_replay(b, &rc);
 	b->redoing = 0;
 
-	return 0;
+	return error;
 }
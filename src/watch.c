@@ -0,0 +1,414 @@
+/* Tracking of external modifications of the files of open documents.
+
+   Copyright (C) 1993-1998 Sebastiano Vigna
+   Copyright (C) 1999-2018 Todd M. Lewis and Sebastiano Vigna
+
+   This file is part of ne, the nice editor.
+
+   This library is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or (at your
+   option) any later version.
+
+   This library is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.  */
+
+
+#include "ne.h"
+#include "support.h"
+
+/* On Linux, the files of the open documents are watched using inotify, so
+   that a document whose file is changed by another program is flagged as
+   soon as this happens, rather than when we try to save it (see
+   buffer_file_modified()). If auto_reload is true, unmodified documents are
+   reloaded instead. Documents in follow mode are instead updated by
+   appending the text added to their file (see follow_file()).
+
+   We watch the directory containing each file rather than the file itself,
+   as most programs (ne included) save by writing a temporary file and renaming
+   it over the original, which an inotify watch on the file would not follow.
+   We just listen for files being closed after writing, moved, deleted or
+   having their attributes changed: modifications in progress are ignored, so
+   we never reload a partially written file. Modifications are reported only
+   for followed files, which are usually written by programs (e.g., loggers)
+   that never close them.
+
+   A watcher thread blocks on the inotify descriptor, and marks the watched
+   files named by the events it receives. Buffers cannot be touched outside of
+   the main thread, so when the main loop is waiting for a key (see
+   wake_on_file_change()) the watcher interrupts it with SIGURG, whose default
+   action is to be ignored; since the signal might arrive just before the main
+   thread blocks, it is sent again every WAKE_INTERVAL milliseconds until the
+   main loop has called check_watched_files(). The latter compares the current
+   stamp of each file with the one recorded when the document was loaded or
+   saved, so events caused by our own saves are harmless. */
+
+/* Reloads an unmodified buffer from its file, trying to keep the cursor
+   position. Returns false if the file cannot be read, in which case the buffer
+   is untouched. */
+
+static bool reload_buffer(buffer * const b) {
+	char * const name = str_dup(b->filename);
+	if (!name) return false;
+
+	const int64_t line = b->cur_line, col = b->win_x + b->cur_x;
+	const bool following = b->following, at_end = b->cur_line == b->num_lines - 1;
+	const int error = load_file_in_buffer(b, name);
+	if (error == CANT_OPEN_FILE || error == FILE_IS_DIRECTORY || error == FILE_IS_MIGRATED) {
+		free(name);
+		return false;
+	}
+
+	change_filename(b, name);
+	b->following = following;
+	watch_buffer(b);
+	reset_syntax_states(b);
+	goto_line(b, following && at_end ? b->num_lines - 1 : min(line, b->num_lines - 1));
+	goto_column(b, col);
+
+	if (b == cur_buffer) {
+		reset_window();
+		if (error) print_error(error);
+		else print_message(info_msg[DOCUMENT_RELOADED]);
+	}
+	return true;
+}
+
+/* Brings a followed buffer up to date with its file, appending the text
+   added since the last time (see append_fd_to_buffer()). If the cursor was
+   on the last line, it is moved to the new last line, so that the end of the
+   file is kept in view, as with tail -f. Returns ERROR if the file has been
+   replaced or truncated, so that it cannot be followed, or if the buffer has
+   been modified, as the text would be appended to a document differing from
+   the file. */
+
+int follow_file(buffer * const b) {
+	if (!b->filename || b->is_modified) return ERROR;
+
+	const int fd = open(tilde_expand(b->filename), READ_FLAGS);
+	if (fd < 0) return ERROR;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_ino != b->stamp.ino || st.st_size < b->stamp.size) {
+		close(fd);
+		return ERROR;
+	}
+
+	line_desc * const last = (line_desc *)b->line_desc_list.tail_pred;
+	const int64_t last_line = b->num_lines - 1;
+	const bool at_end = b->cur_line == last_line;
+	const encoding_type encoding = b->encoding;
+	off_t pos = b->stamp.size;
+	const int error = append_fd_to_buffer(b, fd, &pos);
+
+	if (!fstat(fd, &st)) {
+		b->stamp.mtime = st.st_mtim;
+		b->stamp.ino = st.st_ino;
+	}
+	b->stamp.size = pos;
+	close(fd);
+	if (error) return error;
+
+	if (b->encoding != encoding) {
+		move_to_sol(b);
+		if (b == cur_buffer) reset_window();
+	}
+	else if (b == cur_buffer && last_line - b->win_y < ne_lines - 1) update_window_lines(b, last, last_line - b->win_y, ne_lines - 2, false);
+
+	if (at_end) goto_line(b, b->num_lines - 1);
+	return OK;
+}
+
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB | IN_MODIFY)
+#define WATCH_BUF_SIZE (16 * 1024)
+#define WAKE_INTERVAL 100
+
+typedef struct {
+	int wd;               /* The watch of the directory containing the file. */
+	char *name;           /* The name of the file within the directory. */
+	int count;            /* The number of buffers watching this file. */
+	int follow;           /* The number of buffers following this file. */
+	bool changed;         /* An event on this file happened (set by the watcher). */
+	bool grown;           /* This file has been modified, and it is followed (set by the watcher). */
+	bool check;           /* The buffers watching this file must be checked (used by the main thread). */
+	bool append;          /* The buffers following this file must be checked (used by the main thread). */
+} watched_file;
+
+static int inotify_fd = -1;
+static pthread_t main_thread, watcher_thread;
+
+/* Protects the changed and grown fields of watched, and the following flags. The watched
+   table is modified by the main thread only, and always with the mutex held. */
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static watched_file *watched;
+static int num_watched, watched_size;
+static bool pending;  /* Some file has been marked as changed. */
+static bool idle;     /* The main loop is waiting for a key. */
+
+static void handle_urg(const int sig) {}
+
+static void *watcher(void *unused) {
+	char buf[WATCH_BUF_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+
+	for(;;) {
+		pthread_mutex_lock(&watch_mutex);
+		const bool waiting = pending;
+		if (pending && idle) pthread_kill(main_thread, SIGURG);
+		pthread_mutex_unlock(&watch_mutex);
+
+		if (poll(&pfd, 1, waiting ? WAKE_INTERVAL : -1) <= 0) continue;
+
+		const ssize_t len = read(inotify_fd, buf, sizeof buf);
+		if (len <= 0) {
+			if (len < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+			return NULL;
+		}
+
+		pthread_mutex_lock(&watch_mutex);
+		for(const char *p = buf; p < buf + len; ) {
+			const struct inotify_event * const e = (const struct inotify_event *)p;
+			for(int i = 0; i < num_watched; i++) {
+				/* On overflow we lost events, so we check everything. If a directory
+				   is removed (IN_IGNORED) all its files are gone. */
+				if ((e->mask & IN_Q_OVERFLOW) || (watched[i].wd == e->wd && ((e->mask & IN_IGNORED) || (e->len && !strcmp(watched[i].name, e->name))))) {
+					if (e->mask & IN_MODIFY) {
+						if (watched[i].follow) pending = watched[i].grown = true;
+					}
+					else pending = watched[i].changed = true;
+				}
+			}
+			p += sizeof *e + e->len;
+		}
+		pthread_mutex_unlock(&watch_mutex);
+	}
+}
+
+/* Starts the watcher thread, if necessary. Returns false if files cannot
+   be watched. */
+
+static bool start_watcher(void) {
+	static bool failed;
+	if (inotify_fd >= 0) return true;
+	if (failed || batch_mode) return false;
+
+	if ((inotify_fd = inotify_init1(IN_CLOEXEC)) >= 0) {
+		struct sigaction sa = { .sa_handler = handle_urg };
+		sigemptyset(&sa.sa_mask);
+		/* No SA_RESTART: we want the read of the next key to be interrupted. */
+		sigaction(SIGURG, &sa, NULL);
+
+		main_thread = pthread_self();
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		const bool created = !pthread_create(&watcher_thread, NULL, watcher, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (created) return true;
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	failed = true;
+	return false;
+}
+
+static watched_file *find_watched(const int wd, const char * const name) {
+	for(int i = 0; i < num_watched; i++) if (watched[i].wd == wd && !strcmp(watched[i].name, name)) return &watched[i];
+	return NULL;
+}
+
+/* Removes the inotify watch wd, unless some file still uses it. */
+
+static void release_watch(const int wd) {
+	for(int i = 0; i < num_watched; i++) if (watched[i].wd == wd) return;
+	inotify_rm_watch(inotify_fd, wd);
+}
+
+/* Starts watching the file of a buffer (if any), stopping watching the
+   previous one. To be called whenever a buffer gets a new file name or has
+   been loaded from or saved to its file. */
+
+void watch_buffer(buffer * const b) {
+	unwatch_buffer(b);
+	if (!b->filename || !start_watcher()) return;
+
+	const char * const name = tilde_expand(b->filename);
+	/* We watch the directory of the file symbolic links point to. */
+	char * const real_name = realpath(name, NULL);
+	const char * const path = real_name ? real_name : name;
+	const char * const base = file_part(path);
+	char * const dir = malloc(base - path + 2);
+	int wd = -1;
+
+	if (dir && *base) {
+		if (base == path) strcpy(dir, ".");
+		else {
+			memcpy(dir, path, base - path);
+			dir[base - path] = 0;
+		}
+		wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+	}
+
+	char * const watch_name = wd >= 0 ? str_dup(base) : NULL;
+
+	if (watch_name) {
+		pthread_mutex_lock(&watch_mutex);
+		watched_file *w = find_watched(wd, base);
+		if (w) {
+			w->count++;
+			w->follow += b->following;
+		}
+		else {
+			if (num_watched == watched_size) {
+				const int size = watched_size ? watched_size * 2 : 16;
+				watched_file * const t = realloc(watched, size * sizeof *t);
+				if (t) {
+					watched = t;
+					watched_size = size;
+				}
+			}
+			if (num_watched < watched_size && (watched[num_watched].name = str_dup(base))) {
+				w = &watched[num_watched++];
+				w->wd = wd;
+				w->count = 1;
+				w->follow = b->following;
+				w->changed = w->grown = w->check = w->append = false;
+			}
+		}
+		pthread_mutex_unlock(&watch_mutex);
+
+		if (w) {
+			b->watch = wd;
+			b->watch_name = watch_name;
+		}
+		else free(watch_name);
+	}
+
+	if (wd >= 0 && !b->watch) release_watch(wd);
+
+	free(dir);
+	free(real_name);
+}
+
+/* Stops watching the file of a buffer. */
+
+void unwatch_buffer(buffer * const b) {
+	if (!b->watch) return;
+
+	pthread_mutex_lock(&watch_mutex);
+	watched_file * const w = find_watched(b->watch, b->watch_name);
+	if (w) w->follow -= b->following;
+	if (w && --w->count == 0) {
+		free(w->name);
+		*w = watched[--num_watched];
+	}
+	pthread_mutex_unlock(&watch_mutex);
+
+	release_watch(b->watch);
+	free(b->watch_name);
+	b->watch_name = NULL;
+	b->watch = 0;
+}
+
+/* Tells the watcher thread whether the main loop is waiting for a key, and can
+   thus be interrupted to call check_watched_files(). */
+
+void wake_on_file_change(const bool wake) {
+	if (inotify_fd < 0) return;
+	pthread_mutex_lock(&watch_mutex);
+	idle = wake;
+	pthread_mutex_unlock(&watch_mutex);
+}
+
+/* Checks the files of the buffers on which the watcher thread saw some event.
+   A buffer whose file has a stamp different from the one recorded when it was
+   last loaded or saved is reloaded, if auto_reload is true, it is not
+   modified and its file still exists; otherwise, it is flagged as changed on
+   disk. A followed buffer is updated by appending the new text of its file,
+   unless the file has been replaced or truncated (e.g., when logs are
+   rotated), in which case it is reloaded, if not modified. */
+
+void check_watched_files(void) {
+	if (inotify_fd < 0) return;
+
+	pthread_mutex_lock(&watch_mutex);
+	const bool changed = pending;
+	pending = false;
+	for(int i = 0; i < num_watched; i++) {
+		watched[i].check = watched[i].changed;
+		watched[i].append = watched[i].grown;
+		watched[i].changed = watched[i].grown = false;
+	}
+	pthread_mutex_unlock(&watch_mutex);
+
+	if (!changed) return;
+
+	for(buffer *b = (buffer *)buffers.head; b->b_node.next; b = (buffer *)b->b_node.next) {
+		if (!b->watch) continue;
+		const watched_file * const w = find_watched(b->watch, b->watch_name);
+		if (!w || (!w->check && !(w->append && b->following))) continue;
+
+		file_stamp stamp;
+		const bool exists = get_file_stamp(tilde_expand(b->filename), &stamp);
+		if (same_file_stamp(&stamp, &b->stamp)) continue;
+		if (b->following) {
+			const int error = follow_file(b);
+			if (error != ERROR) {
+				if (error && b == cur_buffer) print_error(error);
+				continue;
+			}
+		}
+		if ((auto_reload || b->following) && exists && !b->is_modified && reload_buffer(b)) continue;
+		if (!b->changed_on_disk) {
+			b->changed_on_disk = 1;
+			if (b == cur_buffer) print_message(info_msg[FILE_CHANGED_ON_DISK]);
+		}
+	}
+}
+
+#else
+
+/* Without inotify, we only notice external modifications when saving. */
+
+void watch_buffer(buffer * const b) {}
+void unwatch_buffer(buffer * const b) {}
+void wake_on_file_change(const bool wake) {}
+void check_watched_files(void) {}
+
+#endif
+
+
+/* Starts or stops following the file of a buffer. When starting, the buffer
+   is immediately brought up to date. */
+
+int set_following(buffer * const b, const bool follow) {
+	if (follow && !b->filename) return CANT_OPEN_FILE;
+
+	unwatch_buffer(b);
+	b->following = follow;
+	watch_buffer(b);
+
+	if (follow) {
+		file_stamp stamp;
+		get_file_stamp(tilde_expand(b->filename), &stamp);
+		if (!same_file_stamp(&stamp, &b->stamp)) {
+			const int error = follow_file(b);
+			if (error != ERROR) return error;
+			if (b->is_modified || !reload_buffer(b)) b->changed_on_disk = 1;
+		}
+	}
+	return OK;
+}